@@ -0,0 +1,279 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Everything we measure ends up in a BenchmarkReport, which prints it as CSV or JSON so scripts can track regressions.
+
+enum class ReportFormat {
+    Json,
+    Csv
+};
+
+inline ReportFormat parseReportFormat(const std::string& name) {
+    if (name == "json") return ReportFormat::Json;
+    if (name == "csv") return ReportFormat::Csv;
+    throw std::runtime_error("Unknown report format: " + name + " (expected json or csv)");
+}
+
+using BenchmarkClock = std::chrono::steady_clock;
+
+inline double millisecondsSince(BenchmarkClock::time_point start) {
+    return std::chrono::duration<double, std::milli>(BenchmarkClock::now() - start).count();
+}
+
+struct SampleStatistics {
+    size_t count = 0;
+    double min = 0.0;
+    double median = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+    double mean = 0.0;
+
+    static SampleStatistics compute(std::vector<double> samples) {
+        SampleStatistics stats;
+        stats.count = samples.size();
+        if (samples.empty()) {
+            return stats;
+        }
+        std::sort(samples.begin(), samples.end());
+        // nearest rank percentile, good enough for a few thousand frames
+        auto percentile = [&samples](double p) {
+            size_t rank = static_cast<size_t>(std::ceil(p * samples.size()));
+            return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+        };
+        stats.min = samples.front();
+        stats.median = percentile(0.50);
+        stats.p95 = percentile(0.95);
+        stats.p99 = percentile(0.99);
+        stats.max = samples.back();
+        double sum = 0.0;
+        for (double sample : samples) {
+            sum += sample;
+        }
+        stats.mean = sum / samples.size();
+        return stats;
+    }
+};
+
+class BenchmarkReport {
+public:
+    // A series is a list of per-frame samples (e.g. milliseconds spent in vkQueueSubmit) that gets reduced to min/median/p95/p99/max.
+    void addSample(const std::string& series, double value) {
+        seriesSamples(series).push_back(value);
+    }
+
+    // A metric is a single number such as frames per second.
+    void setMetric(const std::string& name, double value) {
+        for (auto& metric : metrics) {
+            if (metric.first == name) {
+                metric.second = value;
+                return;
+            }
+        }
+        metrics.emplace_back(name, value);
+    }
+
+    // Info is free text describing the run (device, mode, ...), so results from different machines can be told apart.
+    void setInfo(const std::string& name, const std::string& value) {
+        info[name] = value;
+    }
+
+    bool empty() const {
+        return series.empty() && metrics.empty();
+    }
+
+    void write(std::ostream& out, ReportFormat format) const {
+        if (format == ReportFormat::Csv) {
+            writeCsv(out);
+        }
+        else {
+            writeJson(out);
+        }
+    }
+
+private:
+    std::vector<std::pair<std::string, std::vector<double>>> series; // vector to keep the order in which series were first recorded
+    std::vector<std::pair<std::string, double>> metrics;
+    std::map<std::string, std::string> info;
+
+    std::vector<double>& seriesSamples(const std::string& name) {
+        for (auto& entry : series) {
+            if (entry.first == name) {
+                return entry.second;
+            }
+        }
+        series.emplace_back(name, std::vector<double>());
+        return series.back().second;
+    }
+
+    static std::string escapeJson(const std::string& text) {
+        std::string escaped;
+        for (char c : text) {
+            switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) { // the other control characters are not allowed raw in a JSON string either
+                    const char* hex = "0123456789abcdef";
+                    escaped += "\\u00";
+                    escaped += hex[(c >> 4) & 0xf];
+                    escaped += hex[c & 0xf];
+                }
+                else {
+                    escaped += c;
+                }
+            }
+        }
+        return escaped;
+    }
+
+    // RFC 4180: the field is quoted and quotes inside it are doubled, so commas and line breaks in e.g. device names stay in one field.
+    static std::string quoteCsv(const std::string& text) {
+        std::string quoted = "\"";
+        for (char c : text) {
+            if (c == '"') {
+                quoted += '"';
+            }
+            quoted += c;
+        }
+        quoted += '"';
+        return quoted;
+    }
+
+    void writeCsv(std::ostream& out) const {
+        out << "kind,name,count,min,median,p95,p99,max,mean,value\n";
+        for (const auto& entry : info) {
+            out << "info," << quoteCsv(entry.first) << ",,,,,,,," << quoteCsv(entry.second) << "\n";
+        }
+        for (const auto& entry : metrics) {
+            out << "metric," << quoteCsv(entry.first) << ",,,,,,,," << entry.second << "\n";
+        }
+        for (const auto& entry : series) {
+            SampleStatistics stats = SampleStatistics::compute(entry.second);
+            out << "series," << quoteCsv(entry.first) << "," << stats.count << "," << stats.min << "," << stats.median << ","
+                << stats.p95 << "," << stats.p99 << "," << stats.max << "," << stats.mean << ",\n";
+        }
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << "{\n  \"info\": {";
+        const char* separator = "\n";
+        for (const auto& entry : info) {
+            out << separator << "    \"" << escapeJson(entry.first) << "\": \"" << escapeJson(entry.second) << "\"";
+            separator = ",\n";
+        }
+        out << "\n  },\n  \"metrics\": {";
+        separator = "\n";
+        for (const auto& entry : metrics) {
+            out << separator << "    \"" << escapeJson(entry.first) << "\": " << entry.second;
+            separator = ",\n";
+        }
+        out << "\n  },\n  \"series\": {";
+        separator = "\n";
+        for (const auto& entry : series) {
+            SampleStatistics stats = SampleStatistics::compute(entry.second);
+            out << separator << "    \"" << escapeJson(entry.first) << "\": { \"count\": " << stats.count
+                << ", \"min\": " << stats.min << ", \"median\": " << stats.median << ", \"p95\": " << stats.p95
+                << ", \"p99\": " << stats.p99 << ", \"max\": " << stats.max << ", \"mean\": " << stats.mean << " }";
+            separator = ",\n";
+        }
+        out << "\n  }\n}\n";
+    }
+};
+
+// Collects CPU-side per-phase frame timings. Frames inside the warmup window are run but not recorded.
+// A benchmark can consist of several passes (e.g. one per recording mode), every pass gets its own warmup and
+// its series and metrics are prefixed with "<pass>." so they can be compared within one report.
+class FrameProfiler {
+public:
+    void enable(uint32_t warmupFrameCount) {
+        enabled = true;
+        warmupFrames = warmupFrameCount;
+    }
+
+    void beginPass(const std::string& name) {
+        prefix = name.empty() ? "" : name + ".";
+        frameIndex = 0;
+        measuredFrames = 0;
+    }
+
+    // Prefixes a series or metric name with the current pass.
+    std::string seriesName(const std::string& name) const {
+        return prefix + name;
+    }
+
+    bool isEnabled() const {
+        return enabled;
+    }
+
+    bool isRecording() const {
+        return enabled && frameIndex >= warmupFrames;
+    }
+
+    void beginFrame() {
+        if (!enabled) return;
+        if (frameIndex == warmupFrames) {
+            measureStart = BenchmarkClock::now();
+        }
+        frameStart = BenchmarkClock::now();
+    }
+
+    // Records the time since phaseStart under the series "<name>_ms".
+    void recordPhase(const char* name, BenchmarkClock::time_point phaseStart) {
+        if (!isRecording()) return;
+        report.addSample(prefix + name + "_ms", millisecondsSince(phaseStart));
+    }
+
+    // Records an already measured value, e.g. GPU timestamps read back from a query pool.
+    void recordSample(const char* series, double value) {
+        if (!isRecording()) return;
+        report.addSample(prefix + series, value);
+    }
+
+    void endFrame() {
+        if (!enabled) return;
+        if (isRecording()) {
+            report.addSample(prefix + "frame_ms", millisecondsSince(frameStart));
+            measuredFrames++;
+        }
+        frameIndex++;
+    }
+
+    // Time from the first measured frame until now, for throughput numbers of our own.
+    double measuredSeconds() const {
+        return measuredFrames > 0 ? millisecondsSince(measureStart) / 1000.0 : 0.0;
+    }
+
+    // Call once after the last frame of a pass, adds the throughput numbers to the report.
+    void finish() {
+        if (!enabled || measuredFrames == 0) return;
+        double seconds = millisecondsSince(measureStart) / 1000.0;
+        report.setMetric(prefix + "measured_frames", static_cast<double>(measuredFrames));
+        report.setMetric(prefix + "warmup_frames", static_cast<double>(warmupFrames));
+        report.setMetric(prefix + "elapsed_s", seconds);
+        report.setMetric(prefix + "fps", seconds > 0.0 ? measuredFrames / seconds : 0.0);
+    }
+
+    BenchmarkReport report;
+
+private:
+    bool enabled = false;
+    uint32_t warmupFrames = 0;
+    uint64_t frameIndex = 0;
+    uint64_t measuredFrames = 0;
+    std::string prefix;
+    BenchmarkClock::time_point frameStart;
+    BenchmarkClock::time_point measureStart;
+};
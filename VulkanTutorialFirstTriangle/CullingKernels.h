@@ -0,0 +1,341 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CULLING_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif (defined(__aarch64__) || defined(_M_ARM64)) && defined(CULLING_ENABLE_NEON)
+// The NEON kernels (culling here, frame conversion in FrameEncoder.h) have not been built on AArch64 or compared against the
+// scalar ones yet. Until they are, ARM builds use the scalar kernels, define CULLING_ENABLE_NEON to try them.
+#define CULLING_NEON 1
+#include <arm_neon.h>
+#endif
+
+// CPU culling and transform kernels over structure-of-arrays data. Every kernel exists as plain scalar code and in the
+// SIMD flavours the CPU may have, selectCullingKernels() hands out the one picked at runtime. SSE2 is part of x86-64 and
+// NEON of AArch64, so only AVX2 has to be checked for. MSVC compiles intrinsics of any level without extra flags, GCC and
+// Clang need the target attribute for the AVX2 functions since the rest of the program is built for the baseline.
+
+#if defined(CULLING_X86) && !defined(_MSC_VER)
+#define CULLING_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CULLING_TARGET_AVX2
+#endif
+
+// Vectors whose data starts on a cache line, so a SIMD load never straddles two lines (as long as the index is a multiple of the width).
+template <typename T, size_t Alignment>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* pointer, size_t) {
+        ::operator delete(pointer, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+static constexpr size_t SIMD_ALIGNMENT = 64;
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T, SIMD_ALIGNMENT>>;
+
+// The frustum of a flat scene: four lines. A bounding circle is visible if for every line dot(normal, center) + distance >= -radius.
+struct Frustum2D {
+    float normalX[4];
+    float normalY[4];
+    float distance[4];
+
+    // What the vertex shader can put on screen, -1 <= x, y <= 1.
+    static Frustum2D clipSpace() {
+        return view(0.0f, 0.0f, 1.0f);
+    }
+
+    // What is on screen when the vertex shader maps world position p to (p - offset) * scale.
+    static Frustum2D view(float offsetX, float offsetY, float scale) {
+        float halfExtent = 1.0f / scale;
+        return { { 1.0f, -1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, -1.0f },
+            { halfExtent - offsetX, halfExtent + offsetX, halfExtent - offsetY, halfExtent + offsetY } };
+    }
+};
+
+enum class SimdLevel {
+    Scalar,
+    Sse2,
+    Avx2,
+    Neon
+};
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Sse2: return "sse2";
+    case SimdLevel::Avx2: return "avx2";
+    case SimdLevel::Neon: return "neon";
+    default: return "scalar";
+    }
+}
+
+inline SimdLevel parseSimdLevel(const std::string& name) {
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2, SimdLevel::Neon }) {
+        if (name == simdLevelName(level)) return level;
+    }
+    throw std::runtime_error("Unknown SIMD level: " + name + " (expected scalar, sse2, avx2 or neon)");
+}
+
+inline bool simdLevelSupported(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Scalar:
+        return true;
+#if defined(CULLING_X86)
+    case SimdLevel::Sse2:
+        return true;
+    case SimdLevel::Avx2: {
+#if defined(_MSC_VER)
+        // The CPU has to support AVX2 and the OS has to save the YMM registers on a context switch.
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return false;
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+#if defined(CULLING_NEON)
+    case SimdLevel::Neon:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+inline SimdLevel bestSimdLevel() {
+    for (SimdLevel level : { SimdLevel::Avx2, SimdLevel::Sse2, SimdLevel::Neon }) {
+        if (simdLevelSupported(level)) return level;
+    }
+    return SimdLevel::Scalar;
+}
+
+// Kernels work on elements [first, first + count) of the arrays.
+// cullSpheres writes the indices of the visible spheres to visible (room for count indices) and returns how many there are.
+using CullSpheresKernel = size_t (*)(const Frustum2D& frustum, const float* centerX, const float* centerY, const float* radius,
+    size_t first, size_t count, uint32_t* visible);
+// advanceRotations adds deltaRadians to every rotation and wraps it into [0, 2 pi), so it keeps its precision in long runs.
+using AdvanceRotationsKernel = void (*)(float* rotation, size_t first, size_t count, float deltaRadians);
+
+struct CullingKernels {
+    SimdLevel level;
+    CullSpheresKernel cullSpheres;
+    AdvanceRotationsKernel advanceRotations;
+};
+
+static constexpr float TWO_PI = 6.28318530718f;
+
+inline size_t cullSpheresScalar(const Frustum2D& frustum, const float* centerX, const float* centerY, const float* radius,
+    size_t first, size_t count, uint32_t* visible) {
+    size_t visibleCount = 0;
+    for (size_t i = first; i < first + count; i++) {
+        bool inside = true;
+        for (int plane = 0; plane < 4; plane++) {
+            inside &= frustum.normalX[plane] * centerX[i] + frustum.normalY[plane] * centerY[i] + frustum.distance[plane] >= -radius[i];
+        }
+        // always write, only keep it if visible: no branch to mispredict
+        visible[visibleCount] = static_cast<uint32_t>(i);
+        visibleCount += inside ? 1 : 0;
+    }
+    return visibleCount;
+}
+
+inline void advanceRotationsScalar(float* rotation, size_t first, size_t count, float deltaRadians) {
+    for (size_t i = first; i < first + count; i++) {
+        float angle = rotation[i] + deltaRadians;
+        rotation[i] = angle - TWO_PI * std::floor(angle * (1.0f / TWO_PI));
+    }
+}
+
+// Appends the lanes set in mask. Fully visible and fully culled groups are the common case on a grid, so they skip the loop.
+inline size_t appendVisibleLanes(uint32_t* visible, size_t visibleCount, size_t base, int mask, int laneCount) {
+    if (mask == 0) return visibleCount;
+    for (int lane = 0; lane < laneCount; lane++) {
+        visible[visibleCount] = static_cast<uint32_t>(base + lane);
+        visibleCount += (mask >> lane) & 1;
+    }
+    return visibleCount;
+}
+
+#if defined(CULLING_X86)
+inline size_t cullSpheresSse2(const Frustum2D& frustum, const float* centerX, const float* centerY, const float* radius,
+    size_t first, size_t count, uint32_t* visible) {
+    __m128 normalX[4], normalY[4], distance[4];
+    for (int plane = 0; plane < 4; plane++) {
+        normalX[plane] = _mm_set1_ps(frustum.normalX[plane]);
+        normalY[plane] = _mm_set1_ps(frustum.normalY[plane]);
+        distance[plane] = _mm_set1_ps(frustum.distance[plane]);
+    }
+
+    size_t visibleCount = 0;
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        __m128 x = _mm_loadu_ps(centerX + i);
+        __m128 y = _mm_loadu_ps(centerY + i);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int plane = 0; plane < 4; plane++) {
+            __m128 signedDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(normalX[plane], x), _mm_mul_ps(normalY[plane], y)), distance[plane]);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(signedDistance, negativeRadius));
+        }
+        visibleCount = appendVisibleLanes(visible, visibleCount, i, _mm_movemask_ps(inside), 4);
+    }
+    return visibleCount + cullSpheresScalar(frustum, centerX, centerY, radius, i, end - i, visible + visibleCount);
+}
+
+inline void advanceRotationsSse2(float* rotation, size_t first, size_t count, float deltaRadians) {
+    __m128 delta = _mm_set1_ps(deltaRadians);
+    __m128 twoPi = _mm_set1_ps(TWO_PI);
+    __m128 inverseTwoPi = _mm_set1_ps(1.0f / TWO_PI);
+    __m128 one = _mm_set1_ps(1.0f);
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        __m128 angle = _mm_add_ps(_mm_loadu_ps(rotation + i), delta);
+        // SSE2 has no floor: truncate and step down where that rounded up (negative values)
+        __m128 turns = _mm_mul_ps(angle, inverseTwoPi);
+        __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(turns));
+        __m128 floored = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, turns), one));
+        _mm_storeu_ps(rotation + i, _mm_sub_ps(angle, _mm_mul_ps(twoPi, floored)));
+    }
+    advanceRotationsScalar(rotation, i, end - i, deltaRadians);
+}
+
+CULLING_TARGET_AVX2 inline size_t cullSpheresAvx2(const Frustum2D& frustum, const float* centerX, const float* centerY, const float* radius,
+    size_t first, size_t count, uint32_t* visible) {
+    __m256 normalX[4], normalY[4], distance[4];
+    for (int plane = 0; plane < 4; plane++) {
+        normalX[plane] = _mm256_set1_ps(frustum.normalX[plane]);
+        normalY[plane] = _mm256_set1_ps(frustum.normalY[plane]);
+        distance[plane] = _mm256_set1_ps(frustum.distance[plane]);
+    }
+
+    size_t visibleCount = 0;
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 8 <= end; i += 8) {
+        __m256 x = _mm256_loadu_ps(centerX + i);
+        __m256 y = _mm256_loadu_ps(centerY + i);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int plane = 0; plane < 4; plane++) {
+            __m256 signedDistance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(normalX[plane], x), _mm256_mul_ps(normalY[plane], y)), distance[plane]);
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(signedDistance, negativeRadius, _CMP_GE_OQ));
+        }
+        int mask = _mm256_movemask_ps(inside);
+        if (mask == 0xFF) { // all eight visible: one store of consecutive indices
+            __m256i indices = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(i)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(visible + visibleCount), indices);
+            visibleCount += 8;
+            continue;
+        }
+        visibleCount = appendVisibleLanes(visible, visibleCount, i, mask, 8);
+    }
+    return visibleCount + cullSpheresScalar(frustum, centerX, centerY, radius, i, end - i, visible + visibleCount);
+}
+
+CULLING_TARGET_AVX2 inline void advanceRotationsAvx2(float* rotation, size_t first, size_t count, float deltaRadians) {
+    __m256 delta = _mm256_set1_ps(deltaRadians);
+    __m256 twoPi = _mm256_set1_ps(TWO_PI);
+    __m256 inverseTwoPi = _mm256_set1_ps(1.0f / TWO_PI);
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 8 <= end; i += 8) {
+        __m256 angle = _mm256_add_ps(_mm256_loadu_ps(rotation + i), delta);
+        __m256 turns = _mm256_floor_ps(_mm256_mul_ps(angle, inverseTwoPi));
+        _mm256_storeu_ps(rotation + i, _mm256_sub_ps(angle, _mm256_mul_ps(twoPi, turns)));
+    }
+    advanceRotationsScalar(rotation, i, end - i, deltaRadians);
+}
+#endif
+
+#if defined(CULLING_NEON)
+inline size_t cullSpheresNeon(const Frustum2D& frustum, const float* centerX, const float* centerY, const float* radius,
+    size_t first, size_t count, uint32_t* visible) {
+    static const uint32_t laneBits[4] = { 1, 2, 4, 8 };
+    uint32x4_t bits = vld1q_u32(laneBits);
+
+    size_t visibleCount = 0;
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        float32x4_t x = vld1q_f32(centerX + i);
+        float32x4_t y = vld1q_f32(centerY + i);
+        float32x4_t negativeRadius = vnegq_f32(vld1q_f32(radius + i));
+        uint32x4_t inside = vdupq_n_u32(0xFFFFFFFF);
+        for (int plane = 0; plane < 4; plane++) {
+            float32x4_t signedDistance = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(frustum.distance[plane]), x, frustum.normalX[plane]), y, frustum.normalY[plane]);
+            inside = vandq_u32(inside, vcgeq_f32(signedDistance, negativeRadius));
+        }
+        int mask = static_cast<int>(vaddvq_u32(vandq_u32(inside, bits))); // NEON has no movemask, sum up one bit per lane
+        visibleCount = appendVisibleLanes(visible, visibleCount, i, mask, 4);
+    }
+    return visibleCount + cullSpheresScalar(frustum, centerX, centerY, radius, i, end - i, visible + visibleCount);
+}
+
+inline void advanceRotationsNeon(float* rotation, size_t first, size_t count, float deltaRadians) {
+    float32x4_t delta = vdupq_n_f32(deltaRadians);
+    size_t i = first;
+    size_t end = first + count;
+    for (; i + 4 <= end; i += 4) {
+        float32x4_t angle = vaddq_f32(vld1q_f32(rotation + i), delta);
+        float32x4_t turns = vrndmq_f32(vmulq_n_f32(angle, 1.0f / TWO_PI)); // round towards minus infinity
+        vst1q_f32(rotation + i, vmlsq_n_f32(angle, turns, TWO_PI));
+    }
+    advanceRotationsScalar(rotation, i, end - i, deltaRadians);
+}
+#endif
+
+// Falls back to the scalar kernels for levels this CPU or build does not have.
+inline CullingKernels selectCullingKernels(SimdLevel level) {
+    if (simdLevelSupported(level)) {
+        switch (level) {
+#if defined(CULLING_X86)
+        case SimdLevel::Sse2: return { level, cullSpheresSse2, advanceRotationsSse2 };
+        case SimdLevel::Avx2: return { level, cullSpheresAvx2, advanceRotationsAvx2 };
+#endif
+#if defined(CULLING_NEON)
+        case SimdLevel::Neon: return { level, cullSpheresNeon, advanceRotationsNeon };
+#endif
+        default: break;
+        }
+    }
+    return { SimdLevel::Scalar, cullSpheresScalar, advanceRotationsScalar };
+}
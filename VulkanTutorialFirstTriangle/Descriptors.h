@@ -0,0 +1,234 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Descriptor plumbing: layouts created once per distinct description, descriptor sets handed out of pools that are only
+// destroyed as a whole, and a uniform ring buffer for per-frame data that is bound with dynamic offsets, so the same
+// descriptor set serves every frame and nothing is mapped or allocated while recording.
+
+// Hashes a flattened layout description, two descriptions are only the same layout if every value matches.
+struct DescriptionHash {
+    size_t operator()(const std::vector<uint64_t>& description) const {
+        uint64_t value = 14695981039346656037ULL; // FNV-1a
+        for (uint64_t field : description) {
+            value ^= field;
+            value *= 1099511628211ULL;
+        }
+        return static_cast<size_t>(value);
+    }
+};
+
+// Creates every descriptor set layout and pipeline layout once and hands out the same handle for the same description.
+// Owns them, destroy() them together at the end. Layouts with immutable samplers are not supported.
+class DescriptorLayoutCache {
+public:
+    void init(VkDevice device) {
+        this->device = device;
+    }
+
+    VkDescriptorSetLayout getSetLayout(const std::vector<VkDescriptorSetLayoutBinding>& bindings) {
+        std::vector<uint64_t> description;
+        for (const VkDescriptorSetLayoutBinding& binding : bindings) {
+            if (binding.pImmutableSamplers != nullptr) {
+                throw std::runtime_error("The descriptor layout cache does not support immutable samplers!");
+            }
+            description.insert(description.end(), { binding.binding, static_cast<uint64_t>(binding.descriptorType), binding.descriptorCount, binding.stageFlags });
+        }
+        auto cached = setLayouts.find(description);
+        if (cached != setLayouts.end()) {
+            return cached->second;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+        layoutInfo.pBindings = bindings.data();
+        VkDescriptorSetLayout layout;
+        if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &layout) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create descriptor set layout!");
+        }
+        setLayouts[description] = layout;
+        return layout;
+    }
+
+    VkPipelineLayout getPipelineLayout(const std::vector<VkDescriptorSetLayout>& layouts, const std::vector<VkPushConstantRange>& pushConstantRanges) {
+        std::vector<uint64_t> description = { layouts.size() };
+        for (VkDescriptorSetLayout layout : layouts) {
+            description.push_back(reinterpret_cast<uint64_t>(layout)); // set layouts come from this cache, so equal layouts have equal handles
+        }
+        for (const VkPushConstantRange& range : pushConstantRanges) {
+            description.insert(description.end(), { range.stageFlags, range.offset, range.size });
+        }
+        auto cached = pipelineLayouts.find(description);
+        if (cached != pipelineLayouts.end()) {
+            return cached->second;
+        }
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(layouts.size());
+        pipelineLayoutInfo.pSetLayouts = layouts.data();
+        pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(pushConstantRanges.size());
+        pipelineLayoutInfo.pPushConstantRanges = pushConstantRanges.data();
+        VkPipelineLayout layout;
+        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &layout) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create pipeline layout!");
+        }
+        pipelineLayouts[description] = layout;
+        return layout;
+    }
+
+    void destroy() {
+        for (auto& entry : pipelineLayouts) {
+            vkDestroyPipelineLayout(device, entry.second, nullptr);
+        }
+        for (auto& entry : setLayouts) {
+            vkDestroyDescriptorSetLayout(device, entry.second, nullptr);
+        }
+        pipelineLayouts.clear();
+        setLayouts.clear();
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    std::unordered_map<std::vector<uint64_t>, VkDescriptorSetLayout, DescriptionHash> setLayouts;
+    std::unordered_map<std::vector<uint64_t>, VkPipelineLayout, DescriptionHash> pipelineLayouts;
+};
+
+// Hands out descriptor sets from pools that grow on demand. Sets live until destroy(), no set is ever freed on its own.
+// Every set we use is written once (or when its buffers change) and bound with dynamic offsets, so there are no per-frame sets.
+class DescriptorAllocator {
+public:
+    static constexpr uint32_t SETS_PER_POOL = 64;
+
+    void init(VkDevice device) {
+        this->device = device;
+    }
+
+    VkDescriptorSet allocatePersistentSet(VkDescriptorSetLayout layout) {
+        return allocate(persistentPools, layout);
+    }
+
+    uint32_t poolCount() const {
+        return static_cast<uint32_t>(persistentPools.pools.size());
+    }
+
+    void destroy() {
+        for (VkDescriptorPool pool : persistentPools.pools) {
+            vkDestroyDescriptorPool(device, pool, nullptr);
+        }
+        persistentPools = {};
+    }
+
+private:
+    // pools[current] is where the next set comes from, the ones before it ran full
+    struct PoolList {
+        std::vector<VkDescriptorPool> pools;
+        size_t current = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    PoolList persistentPools;
+
+    VkDescriptorSet allocate(PoolList& pools, VkDescriptorSetLayout layout) {
+        while (true) {
+            bool newPool = pools.current == pools.pools.size();
+            if (newPool) {
+                pools.pools.push_back(createPool());
+            }
+            VkDescriptorSetAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocInfo.descriptorPool = pools.pools[pools.current];
+            allocInfo.descriptorSetCount = 1;
+            allocInfo.pSetLayouts = &layout;
+            VkDescriptorSet set;
+            VkResult result = vkAllocateDescriptorSets(device, &allocInfo, &set);
+            if (result == VK_SUCCESS) {
+                return set;
+            }
+            // Out of sets or descriptors, move on to the next pool. That is VK_ERROR_OUT_OF_POOL_MEMORY or FRAGMENTED_POOL,
+            // but Vulkan 1.0 drivers without maintenance1 may report any error. If a new pool fails the set will never fit.
+            if (newPool) {
+                throw std::runtime_error("Failed to allocate descriptor set!");
+            }
+            pools.current++;
+        }
+    }
+
+    // Room for SETS_PER_POOL sets of the kinds we use, a few descriptors of each type per set.
+    VkDescriptorPool createPool() {
+        std::vector<VkDescriptorPoolSize> poolSizes = {
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, SETS_PER_POOL },
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, SETS_PER_POOL },
+            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, SETS_PER_POOL * 4 }
+        };
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.maxSets = SETS_PER_POOL;
+        poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+        poolInfo.pPoolSizes = poolSizes.data();
+        VkDescriptorPool pool;
+        if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create descriptor pool!");
+        }
+        return pool;
+    }
+};
+
+// Per-frame uniform data, written straight into a persistently mapped buffer. Every frame slot owns one region that is
+// reused once the slot's fence signaled. Bind it with a UNIFORM_BUFFER_DYNAMIC descriptor and the offset push() returned.
+class UniformRing {
+public:
+    // The buffer has to hold frameCount * bytesPerFrame bytes and stay mapped at mapped.
+    void init(VkBuffer buffer, void* mapped, VkDeviceSize bytesPerFrame, uint32_t frameCount, VkDeviceSize alignment) {
+        ringBuffer = buffer;
+        mappedData = static_cast<char*>(mapped);
+        frameBytes = bytesPerFrame;
+        frameCapacity = frameCount;
+        offsetAlignment = std::max<VkDeviceSize>(alignment, 1);
+    }
+
+    // Starts writing into the region of frameSlot, whatever the GPU read from it before must be done.
+    void beginFrame(uint32_t frameSlot) {
+        if (frameSlot >= frameCapacity) {
+            throw std::runtime_error("Uniform ring has no region for frame slot " + std::to_string(frameSlot) + "!");
+        }
+        frameStart = frameSlot * frameBytes;
+        head = frameStart;
+    }
+
+    // Copies the data into the current frame's region and returns its offset in the buffer, the dynamic offset to bind.
+    uint32_t push(const void* data, size_t size) {
+        VkDeviceSize offset = (head + offsetAlignment - 1) / offsetAlignment * offsetAlignment;
+        if (offset + size > frameStart + frameBytes) {
+            throw std::runtime_error("Uniform ring ran out of space for this frame!");
+        }
+        memcpy(mappedData + offset, data, size);
+        head = offset + size;
+        return static_cast<uint32_t>(offset);
+    }
+
+    template <typename T>
+    uint32_t push(const T& value) {
+        return push(&value, sizeof(T));
+    }
+
+    VkBuffer buffer() const {
+        return ringBuffer;
+    }
+
+private:
+    VkBuffer ringBuffer = VK_NULL_HANDLE;
+    char* mappedData = nullptr;
+    VkDeviceSize frameBytes = 0;
+    uint32_t frameCapacity = 0;
+    VkDeviceSize offsetAlignment = 1;
+    VkDeviceSize frameStart = 0;
+    VkDeviceSize head = 0;
+};
@@ -0,0 +1,147 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Picking the physical device to run on. Every device gets a score from what it is (type, VRAM, limits, features,
+// queue layout), the best suitable one wins unless a selector (index, UUID or part of the name) asks for a specific one.
+
+// Everything the scorers and selectors look at, queried once per device.
+struct PhysicalDeviceInfo {
+    VkPhysicalDevice device = VK_NULL_HANDLE;
+    uint32_t index = 0; // position in vkEnumeratePhysicalDevices
+    VkPhysicalDeviceProperties properties{};
+    VkPhysicalDeviceFeatures features{};
+    VkPhysicalDeviceMemoryProperties memory{};
+    std::vector<VkQueueFamilyProperties> queueFamilies;
+    std::string uuid; // empty if the instance can not query it
+};
+
+// Gets a higher number for a better device. Replace it to prefer something else, e.g. the device with the most VRAM.
+using DeviceScorer = std::function<int64_t(const PhysicalDeviceInfo&)>;
+
+// pGetProperties2 may be nullptr, the info then has no UUID. It needs VK_KHR_get_physical_device_properties2 and
+// VK_KHR_external_memory_capabilities on a 1.0 instance.
+inline PhysicalDeviceInfo queryPhysicalDevice(VkPhysicalDevice device, uint32_t index, PFN_vkGetPhysicalDeviceProperties2KHR pGetProperties2) {
+    PhysicalDeviceInfo info;
+    info.device = device;
+    info.index = index;
+    vkGetPhysicalDeviceProperties(device, &info.properties);
+    vkGetPhysicalDeviceFeatures(device, &info.features);
+    vkGetPhysicalDeviceMemoryProperties(device, &info.memory);
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, nullptr);
+    info.queueFamilies.resize(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &queueFamilyCount, info.queueFamilies.data());
+
+    if (pGetProperties2 != nullptr) {
+        VkPhysicalDeviceIDProperties idProperties{};
+        idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+        VkPhysicalDeviceProperties2 properties2{};
+        properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+        properties2.pNext = &idProperties;
+        pGetProperties2(device, &properties2);
+
+        // 8-4-4-4-12 hex digits, like nvidia-smi -L and vulkaninfo print it
+        char text[2 * VK_UUID_SIZE + 5];
+        char* out = text;
+        for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+            if (i == 4 || i == 6 || i == 8 || i == 10) {
+                *out++ = '-';
+            }
+            out += snprintf(out, 3, "%02x", idProperties.deviceUUID[i]);
+        }
+        info.uuid = text;
+    }
+    return info;
+}
+
+inline const char* deviceTypeName(VkPhysicalDeviceType type) {
+    switch (type) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+    default: return "other";
+    }
+}
+
+// All DEVICE_LOCAL heaps together. Integrated GPUs report (part of) system memory here.
+inline VkDeviceSize deviceLocalBytes(const VkPhysicalDeviceMemoryProperties& memory) {
+    VkDeviceSize bytes = 0;
+    for (uint32_t i = 0; i < memory.memoryHeapCount; i++) {
+        if (memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            bytes += memory.memoryHeaps[i].size;
+        }
+    }
+    return bytes;
+}
+
+// The type decides almost everything, a software rasterizer never beats a GPU and an integrated GPU only wins against a
+// discrete one that lacks something. Within a type VRAM counts most, then what this renderer makes use of.
+inline int64_t defaultDeviceScore(const PhysicalDeviceInfo& info) {
+    int64_t score = 0;
+    switch (info.properties.deviceType) {
+    case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score += 1000000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 100000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score += 50000; break;
+    case VK_PHYSICAL_DEVICE_TYPE_CPU: break;
+    default: score += 10000; break;
+    }
+
+    score += static_cast<int64_t>(std::min<VkDeviceSize>(deviceLocalBytes(info.memory) / (1024 * 1024), 65536)); // 1 point per MiB, capped at 64 GiB
+    score += info.properties.limits.maxImageDimension2D / 16;
+    score += info.properties.limits.maxComputeWorkGroupInvocations / 8;
+
+    // features the renderer uses when they are there: GPU culling, statistics, timestamps
+    score += info.features.multiDrawIndirect ? 500 : 0;
+    score += info.features.drawIndirectFirstInstance ? 500 : 0;
+    score += info.features.pipelineStatisticsQuery ? 100 : 0;
+    score += info.properties.limits.timestampComputeAndGraphics ? 100 : 0;
+
+    // queue layout: a transfer-only family uploads without stealing graphics time, a compute family without graphics can run async compute
+    bool transferOnlyFamily = false;
+    bool asyncComputeFamily = false;
+    for (const VkQueueFamilyProperties& family : info.queueFamilies) {
+        bool graphics = (family.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        bool compute = (family.queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+        transferOnlyFamily |= (family.queueFlags & VK_QUEUE_TRANSFER_BIT) && !graphics && !compute;
+        asyncComputeFamily |= compute && !graphics;
+    }
+    score += transferOnlyFamily ? 300 : 0;
+    score += asyncComputeFamily ? 200 : 0;
+    return score;
+}
+
+// A selector is a device index ("1"), a UUID (dashes and case do not matter) or a case-insensitive part of the name ("nvidia").
+inline bool matchesDeviceSelector(const PhysicalDeviceInfo& info, const std::string& selector) {
+    if (!selector.empty() && std::all_of(selector.begin(), selector.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        return std::stoul(selector) == info.index;
+    }
+
+    auto normalized = [](const std::string& text, bool dropDashes) {
+        std::string result;
+        for (unsigned char c : text) {
+            if (dropDashes && c == '-') continue;
+            result += static_cast<char>(std::tolower(c));
+        }
+        return result;
+    };
+    if (!info.uuid.empty() && normalized(selector, true) == normalized(info.uuid, true)) {
+        return true;
+    }
+    return normalized(info.properties.deviceName, false).find(normalized(selector, false)) != std::string::npos;
+}
+
+// "name (type, N MiB VRAM)", for logs and reports
+inline std::string describeDevice(const PhysicalDeviceInfo& info) {
+    return std::string(info.properties.deviceName) + " (" + deviceTypeName(info.properties.deviceType) + ", " +
+        std::to_string(deviceLocalBytes(info.memory) / (1024 * 1024)) + " MiB VRAM)";
+}
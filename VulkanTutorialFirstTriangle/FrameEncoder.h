@@ -0,0 +1,614 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX // windows.h would break std::min and std::max
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "CullingKernels.h"
+#include "FrameReadback.h"
+
+// Writes the frames the readback ring hands out as one long stream: raw pixels, concatenated PPMs or Y4M, to a file or a
+// named pipe (mkfifo, or \\.\pipe\name on Windows) that ffmpeg reads from. Raw frames go from the mapped readback buffer
+// straight to the file. The other formats are converted from the mapped buffer into one of two staging buffers by SIMD
+// kernels, an output thread writes them while the next frame is converted. Nothing is allocated per frame.
+
+enum class FrameOutputFormat {
+    Raw, // the pixels as rendered, 4 bytes each (ffmpeg -f rawvideo -pix_fmt bgra)
+    Ppm, // one binary PPM per frame (ffmpeg -f image2pipe -c:v ppm)
+    Y4m  // YUV4MPEG2 with full resolution 4:4:4 planes, BT.601 studio range (ffmpeg -f yuv4mpegpipe)
+};
+
+inline const char* frameOutputFormatName(FrameOutputFormat format) {
+    switch (format) {
+    case FrameOutputFormat::Ppm: return "ppm";
+    case FrameOutputFormat::Y4m: return "y4m";
+    default: return "raw";
+    }
+}
+
+inline FrameOutputFormat parseFrameOutputFormat(const std::string& name) {
+    for (FrameOutputFormat format : { FrameOutputFormat::Raw, FrameOutputFormat::Ppm, FrameOutputFormat::Y4m }) {
+        if (name == frameOutputFormatName(format)) return format;
+    }
+    throw std::runtime_error("Unknown frame output format: " + name + " (expected raw, ppm or y4m)");
+}
+
+// .ppm and .y4m pick their format, anything else (.raw, a pipe) gets the raw pixels.
+inline FrameOutputFormat frameOutputFormatForPath(const std::string& path) {
+    auto endsWith = [&](const char* suffix) {
+        size_t length = std::strlen(suffix);
+        return path.size() >= length && path.compare(path.size() - length, length, suffix) == 0;
+    };
+    if (endsWith(".ppm")) return FrameOutputFormat::Ppm;
+    if (endsWith(".y4m")) return FrameOutputFormat::Y4m;
+    return FrameOutputFormat::Raw;
+}
+
+// Kernels convert count pixels of 4 bytes, bgra says whether they are B8G8R8A8 or R8G8B8A8. Alpha is dropped.
+// packRgb writes 3 bytes per pixel, planarYuv one byte per pixel to each of the three planes.
+using PackRgbKernel = void (*)(const uint8_t* pixels, uint8_t* rgb, size_t count, bool bgra);
+using PlanarYuvKernel = void (*)(const uint8_t* pixels, uint8_t* y, uint8_t* u, uint8_t* v, size_t count, bool bgra);
+
+struct EncoderKernels {
+    SimdLevel level;
+    PackRgbKernel packRgb;
+    PlanarYuvKernel planarYuv;
+};
+
+// BT.601 studio range in 8 bit fixed point, (coefficient * channel + 128) >> 8 plus the offset. Weights are in R, G, B order.
+static constexpr int16_t YUV_WEIGHTS[3][3] = { { 66, 129, 25 }, { -38, -74, 112 }, { 112, -94, -18 } };
+static constexpr int YUV_OFFSETS[3] = { 16, 128, 128 };
+
+inline void packRgbScalar(const uint8_t* pixels, uint8_t* rgb, size_t count, bool bgra) {
+    int red = bgra ? 2 : 0;
+    int blue = bgra ? 0 : 2;
+    for (size_t i = 0; i < count; i++, pixels += 4, rgb += 3) {
+        rgb[0] = pixels[red];
+        rgb[1] = pixels[1];
+        rgb[2] = pixels[blue];
+    }
+}
+
+inline void planarYuvScalar(const uint8_t* pixels, uint8_t* y, uint8_t* u, uint8_t* v, size_t count, bool bgra) {
+    uint8_t* planes[3] = { y, u, v };
+    int red = bgra ? 2 : 0;
+    int blue = bgra ? 0 : 2;
+    for (size_t i = 0; i < count; i++, pixels += 4) {
+        for (int plane = 0; plane < 3; plane++) {
+            const int16_t* weights = YUV_WEIGHTS[plane];
+            int sum = weights[0] * pixels[red] + weights[1] * pixels[1] + weights[2] * pixels[blue];
+            planes[plane][i] = static_cast<uint8_t>(((sum + 128) >> 8) + YUV_OFFSETS[plane]);
+        }
+    }
+}
+
+#if defined(CULLING_X86)
+// The plane's weights in the byte order of a pixel, as 16 bit pairs for _mm_madd_epi16. Alpha gets 0.
+inline void yuvPixelWeights(int plane, bool bgra, int16_t weights[4]) {
+    const int16_t* rgb = YUV_WEIGHTS[plane];
+    weights[0] = bgra ? rgb[2] : rgb[0];
+    weights[1] = rgb[1];
+    weights[2] = bgra ? rgb[0] : rgb[2];
+    weights[3] = 0;
+}
+
+inline void packRgbSse2(const uint8_t* pixels, uint8_t* rgb, size_t count, bool bgra) {
+    const __m128i redBlue = _mm_set1_epi32(0x00FF00FF);
+    const __m128i firstPixelOfPair = _mm_set1_epi64x(0x0000000000FFFFFF);
+    const __m128i secondPixelOfPair = _mm_set1_epi64x(0x0000FFFFFF000000);
+    const __m128i firstPair = _mm_set_epi64x(0, 0x0000FFFFFFFFFFFF);
+    const __m128i secondPair = _mm_set_epi64x(0x00000000FFFFFFFF, static_cast<int64_t>(0xFFFF000000000000ull));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4, pixels += 16, rgb += 12) {
+        __m128i quad = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+        if (bgra) { // swap bytes 0 and 2 of every pixel
+            __m128i swapped = _mm_and_si128(quad, redBlue);
+            swapped = _mm_or_si128(_mm_srli_epi32(swapped, 16), _mm_slli_epi32(swapped, 16));
+            quad = _mm_or_si128(_mm_andnot_si128(redBlue, quad), swapped);
+        }
+        // SSE2 has no byte shuffle: squeeze out alpha within each pair of pixels, then move the second pair next to the first
+        __m128i pairs = _mm_or_si128(_mm_and_si128(quad, firstPixelOfPair), _mm_and_si128(_mm_srli_epi64(quad, 8), secondPixelOfPair));
+        __m128i packed = _mm_or_si128(_mm_and_si128(pairs, firstPair), _mm_and_si128(_mm_srli_si128(pairs, 2), secondPair));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(rgb), packed);
+        int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+        std::memcpy(rgb + 8, &last, sizeof(last));
+    }
+    packRgbScalar(pixels, rgb, count - i, bgra);
+}
+
+// Weighted sum of the channels of 4 pixels, one 32 bit result per pixel.
+inline __m128i weightPixelsSse2(__m128i quad, __m128i weights) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i low = _mm_madd_epi16(_mm_unpacklo_epi8(quad, zero), weights); // pixel 0: lanes 0 and 1, pixel 1: lanes 2 and 3
+    __m128i high = _mm_madd_epi16(_mm_unpackhi_epi8(quad, zero), weights);
+    low = _mm_add_epi32(low, _mm_srli_epi64(low, 32));
+    high = _mm_add_epi32(high, _mm_srli_epi64(high, 32));
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(low, _MM_SHUFFLE(3, 1, 2, 0)), _mm_shuffle_epi32(high, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+inline void planarYuvSse2(const uint8_t* pixels, uint8_t* y, uint8_t* u, uint8_t* v, size_t count, bool bgra) {
+    uint8_t* planes[3] = { y, u, v };
+    __m128i weights[3], offsets[3];
+    for (int plane = 0; plane < 3; plane++) {
+        int16_t pixelWeights[4];
+        yuvPixelWeights(plane, bgra, pixelWeights);
+        weights[plane] = _mm_setr_epi16(pixelWeights[0], pixelWeights[1], pixelWeights[2], pixelWeights[3],
+            pixelWeights[0], pixelWeights[1], pixelWeights[2], pixelWeights[3]);
+        offsets[plane] = _mm_set1_epi32(YUV_OFFSETS[plane]);
+    }
+    const __m128i rounding = _mm_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i quads[4];
+        for (int q = 0; q < 4; q++) {
+            quads[q] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + (i + q * 4) * 4));
+        }
+        for (int plane = 0; plane < 3; plane++) {
+            __m128i values[4];
+            for (int q = 0; q < 4; q++) {
+                __m128i sum = _mm_add_epi32(weightPixelsSse2(quads[q], weights[plane]), rounding);
+                values[q] = _mm_add_epi32(_mm_srai_epi32(sum, 8), offsets[plane]);
+            }
+            __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(values[0], values[1]), _mm_packs_epi32(values[2], values[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(planes[plane] + i), bytes);
+        }
+    }
+    planarYuvScalar(pixels + i * 4, y + i, u + i, v + i, count - i, bgra);
+}
+
+CULLING_TARGET_AVX2 inline void packRgbAvx2(const uint8_t* pixels, uint8_t* rgb, size_t count, bool bgra) {
+    // 4 pixels per 128 bit lane become 12 bytes at its start, the permute closes the gap between the lanes
+    __m256i shuffle = bgra
+        ? _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+        : _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8, pixels += 32, rgb += 24) {
+        __m256i packed = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels)), shuffle);
+        packed = _mm256_permutevar8x32_epi32(packed, compact);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(rgb), _mm256_castsi256_si128(packed));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(rgb + 16), _mm256_extracti128_si256(packed, 1));
+    }
+    packRgbScalar(pixels, rgb, count - i, bgra);
+}
+
+CULLING_TARGET_AVX2 inline __m256i weightPixelsAvx2(__m256i pixels, __m256i weights) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i low = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), weights); // pixels 0, 1 | 4, 5
+    __m256i high = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), weights); // pixels 2, 3 | 6, 7
+    low = _mm256_add_epi32(low, _mm256_srli_epi64(low, 32));
+    high = _mm256_add_epi32(high, _mm256_srli_epi64(high, 32));
+    return _mm256_unpacklo_epi64(_mm256_shuffle_epi32(low, _MM_SHUFFLE(3, 1, 2, 0)), _mm256_shuffle_epi32(high, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+CULLING_TARGET_AVX2 inline void planarYuvAvx2(const uint8_t* pixels, uint8_t* y, uint8_t* u, uint8_t* v, size_t count, bool bgra) {
+    uint8_t* planes[3] = { y, u, v };
+    __m256i weights[3], offsets[3];
+    for (int plane = 0; plane < 3; plane++) {
+        int16_t w[4];
+        yuvPixelWeights(plane, bgra, w);
+        weights[plane] = _mm256_setr_epi16(w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3]);
+        offsets[plane] = _mm256_set1_epi32(YUV_OFFSETS[plane]);
+    }
+    const __m256i rounding = _mm256_set1_epi32(128);
+    const __m256i laneOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7); // the packs work per lane, this puts the pixels back in order
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i octets[4];
+        for (int o = 0; o < 4; o++) {
+            octets[o] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + (i + o * 8) * 4));
+        }
+        for (int plane = 0; plane < 3; plane++) {
+            __m256i values[4];
+            for (int o = 0; o < 4; o++) {
+                __m256i sum = _mm256_add_epi32(weightPixelsAvx2(octets[o], weights[plane]), rounding);
+                values[o] = _mm256_add_epi32(_mm256_srai_epi32(sum, 8), offsets[plane]);
+            }
+            __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(values[0], values[1]), _mm256_packs_epi32(values[2], values[3]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(planes[plane] + i), _mm256_permutevar8x32_epi32(bytes, laneOrder));
+        }
+    }
+    planarYuvScalar(pixels + i * 4, y + i, u + i, v + i, count - i, bgra);
+}
+#endif
+
+#if defined(CULLING_NEON)
+inline void packRgbNeon(const uint8_t* pixels, uint8_t* rgb, size_t count, bool bgra) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, pixels += 64, rgb += 48) {
+        uint8x16x4_t channels = vld4q_u8(pixels); // deinterleaves, one register per channel
+        uint8x16x3_t packed;
+        packed.val[0] = channels.val[bgra ? 2 : 0];
+        packed.val[1] = channels.val[1];
+        packed.val[2] = channels.val[bgra ? 0 : 2];
+        vst3q_u8(rgb, packed);
+    }
+    packRgbScalar(pixels, rgb, count - i, bgra);
+}
+
+inline void planarYuvNeon(const uint8_t* pixels, uint8_t* y, uint8_t* u, uint8_t* v, size_t count, bool bgra) {
+    uint8_t* planes[3] = { y, u, v };
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t channels = vld4q_u8(pixels + i * 4);
+        uint8x16_t red = channels.val[bgra ? 2 : 0];
+        uint8x16_t green = channels.val[1];
+        uint8x16_t blue = channels.val[bgra ? 0 : 2];
+        for (int plane = 0; plane < 3; plane++) {
+            const int16_t* weights = YUV_WEIGHTS[plane];
+            uint8x8_t halves[2];
+            for (int half = 0; half < 2; half++) {
+                // 16 bit is enough: luma sums are positive and below 2^16, chroma sums stay within +-2^15
+                uint16x8_t r = vmovl_u8(half == 0 ? vget_low_u8(red) : vget_high_u8(red));
+                uint16x8_t g = vmovl_u8(half == 0 ? vget_low_u8(green) : vget_high_u8(green));
+                uint16x8_t b = vmovl_u8(half == 0 ? vget_low_u8(blue) : vget_high_u8(blue));
+                if (plane == 0) {
+                    uint16x8_t sum = vmlaq_n_u16(vmlaq_n_u16(vmulq_n_u16(r, 66), g, 129), b, 25);
+                    halves[half] = vmovn_u16(vaddq_u16(vshrq_n_u16(vaddq_u16(sum, vdupq_n_u16(128)), 8), vdupq_n_u16(16)));
+                }
+                else {
+                    int16x8_t sum = vmlaq_n_s16(vmlaq_n_s16(vmulq_n_s16(vreinterpretq_s16_u16(r), weights[0]), vreinterpretq_s16_u16(g), weights[1]),
+                        vreinterpretq_s16_u16(b), weights[2]);
+                    halves[half] = vqmovun_s16(vaddq_s16(vshrq_n_s16(vaddq_s16(sum, vdupq_n_s16(128)), 8), vdupq_n_s16(128)));
+                }
+            }
+            vst1q_u8(planes[plane] + i, vcombine_u8(halves[0], halves[1]));
+        }
+    }
+    planarYuvScalar(pixels + i * 4, y + i, u + i, v + i, count - i, bgra);
+}
+#endif
+
+// Falls back to the scalar kernels for levels this CPU or build does not have.
+inline EncoderKernels selectEncoderKernels(SimdLevel level) {
+    if (simdLevelSupported(level)) {
+        switch (level) {
+#if defined(CULLING_X86)
+        case SimdLevel::Sse2: return { level, packRgbSse2, planarYuvSse2 };
+        case SimdLevel::Avx2: return { level, packRgbAvx2, planarYuvAvx2 };
+#endif
+#if defined(CULLING_NEON)
+        case SimdLevel::Neon: return { level, packRgbNeon, planarYuvNeon };
+#endif
+        default: break;
+        }
+    }
+    return { SimdLevel::Scalar, packRgbScalar, planarYuvScalar };
+}
+
+// Unbuffered output file. Every write goes to the OS as one call (or as few as a pipe accepts), there is no stream buffer
+// in between that would copy the frame once more in small pieces.
+class OutputFile {
+public:
+    OutputFile() = default;
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    ~OutputFile() {
+        close();
+    }
+
+    // Creates or truncates regular files, pipes are opened as they are (this blocks until the reader connected).
+    // "-" writes to a duplicate of stdout, so close() leaves the process' stdout alone.
+    void open(const std::string& path) {
+        close();
+#if defined(_WIN32)
+        if (path == "-") {
+            if (!DuplicateHandle(GetCurrentProcess(), GetStdHandle(STD_OUTPUT_HANDLE), GetCurrentProcess(), &file, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+                file = INVALID_HANDLE_VALUE;
+                throw std::runtime_error("Failed to open stdout as frame output!");
+            }
+            return;
+        }
+        file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_NOT_FOUND) { // named pipes can not be "created"
+            file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        }
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to open frame output: " + path);
+        }
+#else
+        if (path == "-") {
+            descriptor = ::dup(STDOUT_FILENO);
+            if (descriptor < 0) {
+                throw std::runtime_error("Failed to open stdout as frame output!");
+            }
+            return;
+        }
+        struct stat fileInfo;
+        bool fifo = stat(path.c_str(), &fileInfo) == 0 && S_ISFIFO(fileInfo.st_mode);
+        descriptor = ::open(path.c_str(), fifo ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (descriptor < 0) {
+            throw std::runtime_error("Failed to open frame output: " + path);
+        }
+#endif
+    }
+
+    void writeAll(const void* data, size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+#if defined(_WIN32)
+            DWORD written = 0;
+            DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 1u << 30));
+            if (!WriteFile(file, bytes, chunk, &written, nullptr) || written == 0) {
+                throw std::runtime_error("Failed to write frame output!");
+            }
+#else
+            ssize_t written = ::write(descriptor, bytes, size);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                throw std::runtime_error(std::string("Failed to write frame output: ") + std::strerror(errno));
+            }
+#endif
+            bytes += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (descriptor >= 0) ::close(descriptor);
+        descriptor = -1;
+#endif
+    }
+
+    bool isOpen() const {
+#if defined(_WIN32)
+        return file != INVALID_HANDLE_VALUE;
+#else
+        return descriptor >= 0;
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+#else
+    int descriptor = -1;
+#endif
+};
+
+struct FrameEncoderStats {
+    uint64_t framesWritten = 0;
+    uint64_t bytesWritten = 0;
+    double convertMs = 0.0; // SIMD conversion, on the thread that calls encode()
+    double writeMs = 0.0; // time spent in the OS write calls
+    double waitMs = 0.0; // encode() waiting for the output thread to free a staging buffer, > 0 means the disk or pipe is the limit
+};
+
+class FrameEncoder {
+public:
+    // The frame header goes right in front of the payload so header and pixels leave in one write, the payload itself
+    // starts on a SIMD_ALIGNMENT boundary.
+    static constexpr size_t HEADER_SPACE = SIMD_ALIGNMENT;
+    static constexpr uint32_t STAGING_BUFFER_COUNT = 2;
+
+    FrameEncoder() = default;
+    FrameEncoder(const FrameEncoder&) = delete;
+    FrameEncoder& operator=(const FrameEncoder&) = delete;
+
+    ~FrameEncoder() {
+        close();
+    }
+
+    void open(const std::string& path, FrameOutputFormat format, uint32_t width, uint32_t height, uint32_t framesPerSecond, SimdLevel level) {
+        close();
+        this->format = format;
+        this->width = width;
+        this->height = height;
+        kernels = selectEncoderKernels(level);
+        stats = {};
+        outputError = nullptr;
+        output.open(path);
+
+        if (format == FrameOutputFormat::Y4m) {
+            std::string streamHeader = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" + std::to_string(framesPerSecond) +
+                ":1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n";
+            output.writeAll(streamHeader.data(), streamHeader.size());
+            stats.bytesWritten += streamHeader.size();
+        }
+        if (format == FrameOutputFormat::Raw) return; // written straight from the readback buffer, no staging or output thread
+
+        size_t pixelCount = static_cast<size_t>(width) * height;
+        for (Staging& staging : stagingBuffers) {
+            staging.bytes.resize(HEADER_SPACE + pixelCount * 3); // RGB and 4:4:4 YUV are both 3 bytes per pixel
+            staging.full = false;
+        }
+        nextStaging = 0;
+        stopping = false;
+        outputThread = std::thread([this] { outputLoop(); });
+    }
+
+    // Called by the readback writer thread with the mapped pixels. Returns once the readback buffer may be reused.
+    void encode(const ReadbackFrame& frame) {
+        if (frame.width != width || frame.height != height) {
+            throw std::runtime_error("Frame is " + std::to_string(frame.width) + "x" + std::to_string(frame.height) + " but the encoder was opened for " +
+                std::to_string(width) + "x" + std::to_string(height) + "!");
+        }
+        bool bgra = frame.format == VK_FORMAT_B8G8R8A8_SRGB || frame.format == VK_FORMAT_B8G8R8A8_UNORM;
+        const uint8_t* pixels = static_cast<const uint8_t*>(frame.data);
+        size_t tightPitch = static_cast<size_t>(width) * 4;
+
+        if (format == FrameOutputFormat::Raw) {
+            auto writeStart = std::chrono::steady_clock::now();
+            if (frame.rowPitch == tightPitch) {
+                output.writeAll(pixels, frame.byteCount());
+            }
+            else {
+                for (uint32_t row = 0; row < height; row++) {
+                    output.writeAll(pixels + row * frame.rowPitch, tightPitch);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.writeMs += millisecondsSince(writeStart);
+            stats.bytesWritten += tightPitch * height;
+            stats.framesWritten++;
+            return;
+        }
+
+        Staging& staging = stagingBuffers[nextStaging];
+        nextStaging = (nextStaging + 1) % STAGING_BUFFER_COUNT;
+        {
+            auto waitStart = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            stagingFreed.wait(lock, [&] { return !staging.full || outputError; });
+            rethrowOutputError();
+            stats.waitMs += millisecondsSince(waitStart);
+        }
+
+        auto convertStart = std::chrono::steady_clock::now();
+        uint8_t* payload = staging.bytes.data() + HEADER_SPACE;
+        if (format == FrameOutputFormat::Ppm) {
+            for (uint32_t row = 0; row < height; row++) {
+                kernels.packRgb(pixels + row * frame.rowPitch, payload + static_cast<size_t>(row) * width * 3, width, bgra);
+            }
+        }
+        else {
+            size_t planeSize = static_cast<size_t>(width) * height;
+            for (uint32_t row = 0; row < height; row++) {
+                size_t offset = static_cast<size_t>(row) * width;
+                kernels.planarYuv(pixels + row * frame.rowPitch, payload + offset, payload + planeSize + offset, payload + 2 * planeSize + offset, width, bgra);
+            }
+        }
+        std::string header = format == FrameOutputFormat::Ppm ? "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n" : "FRAME\n";
+        std::memcpy(payload - header.size(), header.data(), header.size());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.convertMs += millisecondsSince(convertStart);
+            staging.headerSize = header.size();
+            staging.full = true;
+        }
+        stagingFilled.notify_one();
+    }
+
+    // Blocks until every encoded frame reached the OS.
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        stagingFreed.wait(lock, [&] {
+            return outputError || std::none_of(stagingBuffers, stagingBuffers + STAGING_BUFFER_COUNT, [](const Staging& staging) { return staging.full; });
+        });
+        rethrowOutputError();
+    }
+
+    // Frames that were not written yet are dropped, call flush() first to keep them.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        stagingFilled.notify_all();
+        if (outputThread.joinable()) {
+            outputThread.join();
+        }
+        output.close();
+    }
+
+    bool isOpen() const {
+        return output.isOpen();
+    }
+
+    FrameOutputFormat outputFormat() const {
+        return format;
+    }
+
+    SimdLevel simdLevel() const {
+        return kernels.level;
+    }
+
+    FrameEncoderStats takeStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        FrameEncoderStats taken = stats;
+        stats = {};
+        return taken;
+    }
+
+private:
+    struct Staging {
+        AlignedVector<uint8_t> bytes;
+        size_t headerSize = 0;
+        bool full = false; // converted and waiting for the output thread
+    };
+
+    FrameOutputFormat format = FrameOutputFormat::Raw;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    EncoderKernels kernels = selectEncoderKernels(SimdLevel::Scalar);
+    OutputFile output;
+    Staging stagingBuffers[STAGING_BUFFER_COUNT];
+    uint32_t nextStaging = 0; // the one encode() fills next, the output thread writes them in the same order
+    std::thread outputThread;
+    std::mutex mutex;
+    std::condition_variable stagingFilled;
+    std::condition_variable stagingFreed;
+    bool stopping = false;
+    std::exception_ptr outputError;
+    FrameEncoderStats stats;
+
+    static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void rethrowOutputError() {
+        if (outputError) {
+            std::rethrow_exception(outputError);
+        }
+    }
+
+    void outputLoop() {
+        for (uint32_t next = 0;; next = (next + 1) % STAGING_BUFFER_COUNT) {
+            Staging& staging = stagingBuffers[next];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stagingFilled.wait(lock, [&] { return stopping || staging.full; });
+                if (stopping) return;
+            }
+
+            const uint8_t* payload = staging.bytes.data() + HEADER_SPACE;
+            size_t size = staging.headerSize + (staging.bytes.size() - HEADER_SPACE);
+            auto writeStart = std::chrono::steady_clock::now();
+            try {
+                output.writeAll(payload - staging.headerSize, size);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                outputError = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats.writeMs += millisecondsSince(writeStart);
+                stats.bytesWritten += size;
+                stats.framesWritten++;
+                staging.full = false;
+            }
+            stagingFreed.notify_all();
+            if (outputError) return;
+        }
+    }
+};
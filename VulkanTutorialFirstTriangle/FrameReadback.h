@@ -0,0 +1,164 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "TimelineSync.h"
+
+// Pipelined readback of rendered frames. Every frame slot copies its image into its own persistently mapped buffer at
+// the end of its command buffer. A background thread waits for the frame's timeline value and hands the mapped pixels
+// to a consumer, so the GPU renders frame N+1 while frame N is written out and the render loop only waits when the
+// consumer falls a whole ring behind.
+
+// Pixels of one finished frame, straight in the mapped readback buffer. Only valid during the consumer call.
+struct ReadbackFrame {
+    uint64_t frameNumber = 0;
+    const void* data = nullptr;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    size_t rowPitch = 0;
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    bool measured = false; // counted in the readback statistics, i.e. rendered while the benchmark recorded
+
+    size_t byteCount() const {
+        return rowPitch * height;
+    }
+};
+
+class ReadbackWriter {
+public:
+    using Consumer = std::function<void(const ReadbackFrame&)>;
+
+    ReadbackWriter() = default;
+    ReadbackWriter(const ReadbackWriter&) = delete;
+    ReadbackWriter& operator=(const ReadbackWriter&) = delete;
+
+    ~ReadbackWriter() {
+        stop();
+    }
+
+    // consumer runs on the writer thread, one frame at a time in submission order.
+    void start(QueueTimeline& timeline, uint32_t slotCount, Consumer consumer) {
+        this->timeline = &timeline;
+        this->consumer = std::move(consumer);
+        slotBusy.assign(slotCount, false);
+        stopping = false;
+        writerThread = std::thread([this] { writeLoop(); });
+    }
+
+    // The slot's buffer is read once the GPU reached timelineValue, don't record into it again before waitForSlot().
+    void submit(uint32_t slot, uint64_t timelineValue, const ReadbackFrame& frame) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rethrowWriterError();
+            slotBusy[slot] = true;
+            jobs.push_back({ slot, timelineValue, frame });
+        }
+        workAvailable.notify_one();
+    }
+
+    // Blocks until the writer is done with the slot's previous frame. Returns right away if it kept up.
+    void waitForSlot(uint32_t slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFreed.wait(lock, [&] { return !slotBusy[slot] || writerError; });
+        rethrowWriterError();
+    }
+
+    // Blocks until every submitted frame was consumed.
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        slotFreed.wait(lock, [&] { return (jobs.empty() && !writing) || writerError; });
+        rethrowWriterError();
+    }
+
+    // Frames and bytes of measured frames consumed since the last call.
+    void takeMeasuredStats(uint64_t& frames, uint64_t& bytes) {
+        frames = measuredFrames.exchange(0);
+        bytes = measuredBytes.exchange(0);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        if (writerThread.joinable()) {
+            writerThread.join();
+        }
+        jobs.clear();
+    }
+
+    bool isRunning() const {
+        return writerThread.joinable();
+    }
+
+private:
+    struct Job {
+        uint32_t slot;
+        uint64_t timelineValue;
+        ReadbackFrame frame;
+    };
+
+    QueueTimeline* timeline = nullptr;
+    Consumer consumer;
+    std::thread writerThread;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable slotFreed;
+    std::deque<Job> jobs;
+    std::vector<bool> slotBusy;
+    bool writing = false;
+    bool stopping = false;
+    std::exception_ptr writerError;
+    std::atomic<uint64_t> measuredFrames{ 0 };
+    std::atomic<uint64_t> measuredBytes{ 0 };
+
+    void rethrowWriterError() {
+        if (writerError) {
+            std::rethrow_exception(writerError);
+        }
+    }
+
+    void writeLoop() {
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workAvailable.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                job = jobs.front();
+                jobs.pop_front();
+                writing = true;
+            }
+
+            try {
+                timeline->wait(job.timelineValue); // the copy into the buffer is part of the frame's submit
+                consumer(job.frame);
+                if (job.frame.measured) {
+                    measuredFrames++;
+                    measuredBytes += job.frame.byteCount();
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                writerError = std::current_exception();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                writing = false;
+                slotBusy[job.slot] = false;
+            }
+            slotFreed.notify_all();
+            if (writerError) return;
+        }
+    }
+};
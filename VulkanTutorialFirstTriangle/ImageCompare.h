@@ -0,0 +1,135 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Golden image regression checks: rendered frames are compared against a reference PPM with a per-channel tolerance,
+// so a change that is only supposed to make things faster can prove it did not change what ends up on screen.
+// PPM because every image viewer opens it and writing it needs nothing but an ofstream.
+
+struct RgbImage {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels; // width * height * 3, rows top to bottom
+    std::string comment; // stored as a # line in the PPM header, e.g. which device rendered it
+};
+
+// 4 byte pixels as they come out of vkCmdCopyImageToBuffer, bgra for the B8G8R8A8 formats. Alpha is dropped.
+inline RgbImage rgbFromPixels(const void* data, uint32_t width, uint32_t height, size_t rowPitch, bool bgra) {
+    RgbImage image;
+    image.width = width;
+    image.height = height;
+    image.pixels.resize(static_cast<size_t>(width) * height * 3);
+    const uint8_t* rows = static_cast<const uint8_t*>(data);
+    uint8_t* out = image.pixels.data();
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* pixel = rows + y * rowPitch;
+        for (uint32_t x = 0; x < width; x++, pixel += 4, out += 3) {
+            out[0] = pixel[bgra ? 2 : 0];
+            out[1] = pixel[1];
+            out[2] = pixel[bgra ? 0 : 2];
+        }
+    }
+    return image;
+}
+
+inline void writePpm(const std::string& path, const RgbImage& image) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open image file for writing: " + path);
+    }
+    file << "P6\n";
+    if (!image.comment.empty()) {
+        file << "# " << image.comment << "\n";
+    }
+    file << image.width << " " << image.height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(image.pixels.data()), static_cast<std::streamsize>(image.pixels.size()));
+}
+
+// Binary PPM (P6) with 8 bit channels, the first comment line ends up in RgbImage::comment.
+inline RgbImage readPpm(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open image file: " + path);
+    }
+    RgbImage image;
+    auto nextToken = [&]() {
+        std::string token;
+        while (file.good()) {
+            int c = file.get();
+            if (c == '#') { // comment until the end of the line
+                std::string line;
+                std::getline(file, line);
+                size_t start = line.find_first_not_of(' ');
+                if (image.comment.empty() && start != std::string::npos) {
+                    image.comment = line.substr(start);
+                }
+            }
+            else if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                if (!token.empty()) return token;
+            }
+            else if (c != EOF) {
+                token += static_cast<char>(c);
+            }
+        }
+        return token;
+    };
+    if (nextToken() != "P6") {
+        throw std::runtime_error("Not a binary PPM (P6) image: " + path);
+    }
+    image.width = static_cast<uint32_t>(std::strtoul(nextToken().c_str(), nullptr, 10));
+    image.height = static_cast<uint32_t>(std::strtoul(nextToken().c_str(), nullptr, 10));
+    if (nextToken() != "255" || image.width == 0 || image.height == 0) {
+        throw std::runtime_error("Only 8 bit PPM images are supported: " + path);
+    }
+    image.pixels.resize(static_cast<size_t>(image.width) * image.height * 3);
+    file.read(reinterpret_cast<char*>(image.pixels.data()), static_cast<std::streamsize>(image.pixels.size()));
+    if (file.gcount() != static_cast<std::streamsize>(image.pixels.size())) {
+        throw std::runtime_error("PPM image is truncated: " + path);
+    }
+    return image;
+}
+
+struct ImageDiff {
+    uint64_t mismatchedPixels = 0; // pixels with at least one channel off by more than the tolerance
+    uint32_t maxChannelDifference = 0;
+    double meanAbsoluteError = 0.0; // per channel, over the whole image
+    RgbImage diffImage; // mismatched pixels red, the rest a dimmed gray copy of the golden image
+
+    double mismatchedPercent(const RgbImage& image) const {
+        return 100.0 * mismatchedPixels / (static_cast<double>(image.width) * image.height);
+    }
+};
+
+inline ImageDiff compareImages(const RgbImage& actual, const RgbImage& golden, uint32_t tolerance) {
+    if (actual.width != golden.width || actual.height != golden.height) {
+        throw std::runtime_error("Image is " + std::to_string(actual.width) + "x" + std::to_string(actual.height) + " but the golden image is " +
+            std::to_string(golden.width) + "x" + std::to_string(golden.height) + "!");
+    }
+    ImageDiff diff;
+    diff.diffImage.width = golden.width;
+    diff.diffImage.height = golden.height;
+    diff.diffImage.pixels.resize(golden.pixels.size());
+    uint64_t totalError = 0;
+    for (size_t i = 0; i < golden.pixels.size(); i += 3) {
+        uint32_t pixelMax = 0;
+        for (size_t channel = 0; channel < 3; channel++) {
+            uint32_t difference = static_cast<uint32_t>(std::abs(actual.pixels[i + channel] - golden.pixels[i + channel]));
+            pixelMax = std::max(pixelMax, difference);
+            totalError += difference;
+        }
+        diff.maxChannelDifference = std::max(diff.maxChannelDifference, pixelMax);
+        bool mismatch = pixelMax > tolerance;
+        diff.mismatchedPixels += mismatch ? 1 : 0;
+        uint8_t gray = static_cast<uint8_t>((golden.pixels[i] + golden.pixels[i + 1] + golden.pixels[i + 2]) / 12);
+        diff.diffImage.pixels[i] = mismatch ? 255 : gray;
+        diff.diffImage.pixels[i + 1] = mismatch ? 0 : gray;
+        diff.diffImage.pixels[i + 2] = mismatch ? 0 : gray;
+    }
+    diff.meanAbsoluteError = golden.pixels.empty() ? 0.0 : static_cast<double>(totalError) / golden.pixels.size();
+    return diff;
+}
@@ -0,0 +1,414 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+// Sub-allocates resources out of a few large VkDeviceMemory blocks per memory type instead of calling vkAllocateMemory for
+// every buffer and image. Drivers only guarantee maxMemoryAllocationCount (often 4096) allocations and each one is slow.
+
+enum class AllocationStrategy {
+    FreeList, // long lived resources of any lifetime, best fit with coalescing on free
+    Linear    // bump allocator for resources that die together, a block is reset once its last allocation was freed
+};
+
+// What the memory is bound to. Linear and optimal resources must not share a bufferImageGranularity page.
+enum class ResourceKind {
+    Linear, // buffers and VK_IMAGE_TILING_LINEAR images
+    Optimal // VK_IMAGE_TILING_OPTIMAL images
+};
+
+struct MemoryBlock;
+
+struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr; // points at offset if the memory is host visible, blocks stay mapped for their whole lifetime
+    MemoryBlock* block = nullptr; // nullptr for dedicated allocations
+};
+
+// The resource an allocation with its own VkDeviceMemory is made for. The memory is then allocated with
+// VkMemoryDedicatedAllocateInfo (VK_KHR_dedicated_allocation, core in Vulkan 1.1), which lets the driver lay it out for
+// that one image or buffer, e.g. for render targets with compression metadata. Empty for memory that several resources share.
+struct DedicatedResource {
+    VkImage image = VK_NULL_HANDLE;
+    VkBuffer buffer = VK_NULL_HANDLE;
+    bool preferred = false; // the driver prefers or requires its own memory for the resource (VkMemoryDedicatedRequirements)
+};
+
+struct MemoryStats {
+    uint32_t deviceAllocationCount = 0; // live VkDeviceMemory objects
+    uint32_t dedicatedAllocationCount = 0;
+    uint32_t allocationCount = 0; // live sub-allocations + dedicated allocations
+    VkDeviceSize bytesReserved = 0; // everything we got from vkAllocateMemory
+    VkDeviceSize bytesUsed = 0; // what the resources asked for
+    VkDeviceSize largestFreeRange = 0;
+
+    // 0 if all free memory is one contiguous range, close to 1 if it is split into many small holes
+    double fragmentation() const {
+        VkDeviceSize freeBytes = bytesReserved - bytesUsed;
+        return freeBytes > 0 ? 1.0 - static_cast<double>(largestFreeRange) / static_cast<double>(freeBytes) : 0.0;
+    }
+};
+
+struct MemoryBlock {
+    struct Range {
+        VkDeviceSize size;
+        bool free;
+        ResourceKind kind;
+    };
+
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    uint32_t memoryTypeIndex = 0;
+    AllocationStrategy strategy = AllocationStrategy::FreeList;
+    char* mapped = nullptr;
+    VkDeviceSize usedBytes = 0;
+    uint32_t liveAllocations = 0;
+
+    std::map<VkDeviceSize, Range> ranges; // FreeList: every byte of the block belongs to exactly one range, keyed by offset
+    VkDeviceSize linearTop = 0; // Linear: everything below is handed out
+    ResourceKind linearLastKind = ResourceKind::Linear;
+
+    static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // Two resources are on the same "page" if the last byte of the first and the first byte of the second fall into the same granularity window.
+    static bool onSamePage(VkDeviceSize lastByteOfFirst, VkDeviceSize firstByteOfSecond, VkDeviceSize granularity) {
+        return lastByteOfFirst / granularity == firstByteOfSecond / granularity;
+    }
+
+    bool tryAllocate(VkDeviceSize allocSize, VkDeviceSize alignment, ResourceKind kind, VkDeviceSize granularity, VkDeviceSize& outOffset) {
+        if (strategy == AllocationStrategy::Linear) {
+            VkDeviceSize offset = alignUp(linearTop, alignment);
+            if (linearTop > 0 && linearLastKind != kind && onSamePage(linearTop - 1, offset, granularity)) {
+                offset = alignUp(offset, granularity);
+            }
+            if (offset + allocSize > size) return false;
+            linearTop = offset + allocSize;
+            linearLastKind = kind;
+            outOffset = offset;
+            return true;
+        }
+
+        // best fit: the smallest free range that still fits keeps the big ranges intact for big resources
+        auto best = ranges.end();
+        VkDeviceSize bestOffset = 0;
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            if (!it->second.free || it->second.size < allocSize) continue;
+            if (best != ranges.end() && it->second.size >= best->second.size) continue;
+
+            VkDeviceSize rangeEnd = it->first + it->second.size;
+            VkDeviceSize offset = alignUp(it->first, alignment);
+            if (it != ranges.begin()) {
+                auto previous = std::prev(it); // neighbours of a free range are always used ranges since we coalesce
+                if (previous->second.kind != kind && onSamePage(it->first - 1, offset, granularity)) {
+                    offset = alignUp(offset, granularity);
+                }
+            }
+            if (offset + allocSize > rangeEnd) continue;
+            auto next = std::next(it);
+            if (next != ranges.end() && next->second.kind != kind && onSamePage(offset + allocSize - 1, next->first, granularity)) {
+                continue;
+            }
+            best = it;
+            bestOffset = offset;
+        }
+        if (best == ranges.end()) return false;
+
+        VkDeviceSize rangeOffset = best->first;
+        VkDeviceSize rangeEnd = rangeOffset + best->second.size;
+        ranges.erase(best);
+        if (bestOffset > rangeOffset) {
+            ranges[rangeOffset] = { bestOffset - rangeOffset, true, kind }; // alignment padding stays free
+        }
+        ranges[bestOffset] = { allocSize, false, kind };
+        if (bestOffset + allocSize < rangeEnd) {
+            ranges[bestOffset + allocSize] = { rangeEnd - bestOffset - allocSize, true, kind };
+        }
+        outOffset = bestOffset;
+        return true;
+    }
+
+    void release(VkDeviceSize offset) {
+        if (strategy == AllocationStrategy::Linear) {
+            if (liveAllocations == 0) {
+                linearTop = 0; // everything in the block is dead, start over
+            }
+            return;
+        }
+
+        auto it = ranges.find(offset);
+        if (it == ranges.end() || it->second.free) {
+            throw std::runtime_error("Freed an allocation that is not part of this memory block!");
+        }
+        it->second.free = true;
+
+        auto next = std::next(it);
+        if (next != ranges.end() && next->second.free) {
+            it->second.size += next->second.size;
+            ranges.erase(next);
+        }
+        if (it != ranges.begin()) {
+            auto previous = std::prev(it);
+            if (previous->second.free) {
+                previous->second.size += it->second.size;
+                ranges.erase(it);
+            }
+        }
+    }
+
+    VkDeviceSize largestFreeRange() const {
+        if (strategy == AllocationStrategy::Linear) {
+            return size - linearTop;
+        }
+        VkDeviceSize largest = 0;
+        for (const auto& range : ranges) {
+            if (range.second.free) {
+                largest = std::max(largest, range.second.size);
+            }
+        }
+        return largest;
+    }
+};
+
+class MemoryAllocator {
+public:
+    static constexpr VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    void init(VkPhysicalDevice physicalDevice, VkDevice logicalDevice) {
+        device = logicalDevice;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+        // The instance is Vulkan 1.0, so the VK_KHR_get_memory_requirements2 entry points come from vkGetDeviceProcAddr.
+        getBufferMemoryRequirements2 = (PFN_vkGetBufferMemoryRequirements2KHR)vkGetDeviceProcAddr(device, "vkGetBufferMemoryRequirements2KHR");
+        getImageMemoryRequirements2 = (PFN_vkGetImageMemoryRequirements2KHR)vkGetDeviceProcAddr(device, "vkGetImageMemoryRequirements2KHR");
+        if (getBufferMemoryRequirements2 == nullptr || getImageMemoryRequirements2 == nullptr) {
+            throw std::runtime_error("Memory requirements functions are missing, is VK_KHR_get_memory_requirements2 enabled?");
+        }
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        bufferImageGranularity = std::max<VkDeviceSize>(1, deviceProperties.limits.bufferImageGranularity);
+    }
+
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+            // typeFilter is a bitmask of the memory types the resource may live in, properties what we additionally need
+            if ((typeFilter & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("Failed to find suitable memory type!");
+    }
+
+    bool hasMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const {
+        for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+            if ((typeFilter & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, ResourceKind kind,
+        AllocationStrategy strategy = AllocationStrategy::FreeList, const DedicatedResource& dedicated = {}) {
+        uint32_t memoryTypeIndex = findMemoryType(requirements.memoryTypeBits, properties);
+        VkDeviceSize blockSize = blockSizeFor(memoryTypeIndex);
+
+        // Big resources (render targets mostly) get their own memory, they would only fragment the blocks. Lazily allocated
+        // memory as well: the driver commits pages per VkDeviceMemory, and only a dedicated one says what one image really costs.
+        if (requirements.size > blockSize / 2 || (properties & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT) || dedicated.preferred) {
+            return allocateDedicated(requirements.size, memoryTypeIndex, dedicated);
+        }
+
+        for (auto& block : blocks) {
+            if (block->memoryTypeIndex != memoryTypeIndex || block->strategy != strategy) continue;
+            VkDeviceSize offset;
+            if (block->tryAllocate(requirements.size, requirements.alignment, kind, bufferImageGranularity, offset)) {
+                return makeAllocation(*block, offset, requirements.size);
+            }
+        }
+
+        MemoryBlock& block = createBlock(blockSize, memoryTypeIndex, strategy);
+        VkDeviceSize offset;
+        if (!block.tryAllocate(requirements.size, requirements.alignment, kind, bufferImageGranularity, offset)) {
+            throw std::runtime_error("Failed to sub-allocate from a new memory block!");
+        }
+        return makeAllocation(block, offset, requirements.size);
+    }
+
+    Allocation allocateForBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, AllocationStrategy strategy = AllocationStrategy::FreeList) {
+        DedicatedResource dedicated;
+        dedicated.buffer = buffer;
+        VkMemoryDedicatedRequirements dedicatedRequirements{};
+        dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        VkBufferMemoryRequirementsInfo2 info{};
+        info.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2;
+        info.buffer = buffer;
+        VkMemoryRequirements2 requirements{};
+        requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements.pNext = &dedicatedRequirements;
+        getBufferMemoryRequirements2(device, &info, &requirements);
+        dedicated.preferred = dedicatedRequirements.prefersDedicatedAllocation || dedicatedRequirements.requiresDedicatedAllocation;
+
+        Allocation allocation = allocate(requirements.memoryRequirements, properties, ResourceKind::Linear, strategy, dedicated);
+        vkBindBufferMemory(device, buffer, allocation.memory, allocation.offset);
+        return allocation;
+    }
+
+    Allocation allocateForImage(VkImage image, VkMemoryPropertyFlags properties, VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL) {
+        DedicatedResource dedicated;
+        dedicated.image = image;
+        VkMemoryDedicatedRequirements dedicatedRequirements{};
+        dedicatedRequirements.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS;
+        VkImageMemoryRequirementsInfo2 info{};
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+        info.image = image;
+        VkMemoryRequirements2 requirements{};
+        requirements.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        requirements.pNext = &dedicatedRequirements;
+        getImageMemoryRequirements2(device, &info, &requirements);
+        dedicated.preferred = dedicatedRequirements.prefersDedicatedAllocation || dedicatedRequirements.requiresDedicatedAllocation;
+
+        Allocation allocation = allocate(requirements.memoryRequirements, properties, tiling == VK_IMAGE_TILING_OPTIMAL ? ResourceKind::Optimal : ResourceKind::Linear,
+            AllocationStrategy::FreeList, dedicated);
+        vkBindImageMemory(device, image, allocation.memory, allocation.offset);
+        return allocation;
+    }
+
+    void free(Allocation& allocation) {
+        if (allocation.memory == VK_NULL_HANDLE) return;
+
+        if (allocation.block == nullptr) {
+            if (allocation.mapped != nullptr) {
+                vkUnmapMemory(device, allocation.memory);
+            }
+            vkFreeMemory(device, allocation.memory, nullptr);
+            stats.deviceAllocationCount--;
+            stats.dedicatedAllocationCount--;
+            stats.bytesReserved -= allocation.size;
+        }
+        else {
+            MemoryBlock& block = *allocation.block;
+            block.liveAllocations--;
+            block.usedBytes -= allocation.size;
+            block.release(allocation.offset);
+        }
+        stats.allocationCount--;
+        stats.bytesUsed -= allocation.size;
+        allocation = Allocation{};
+    }
+
+    MemoryStats getStats() const {
+        MemoryStats result = stats;
+        for (const auto& block : blocks) {
+            result.largestFreeRange = std::max(result.largestFreeRange, block->largestFreeRange());
+        }
+        return result;
+    }
+
+    // All allocations have to be freed before, blocks are kept around until here so allocation churn does not hit the driver.
+    void destroy() {
+        for (auto& block : blocks) {
+            if (block->mapped != nullptr) {
+                vkUnmapMemory(device, block->memory);
+            }
+            vkFreeMemory(device, block->memory, nullptr);
+        }
+        blocks.clear();
+        stats = MemoryStats{};
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    PFN_vkGetBufferMemoryRequirements2KHR getBufferMemoryRequirements2 = nullptr;
+    PFN_vkGetImageMemoryRequirements2KHR getImageMemoryRequirements2 = nullptr;
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    VkDeviceSize bufferImageGranularity = 1;
+    std::vector<std::unique_ptr<MemoryBlock>> blocks; // unique_ptr so Allocation::block stays valid when the vector grows
+    MemoryStats stats;
+
+    VkDeviceSize blockSizeFor(uint32_t memoryTypeIndex) const {
+        // small heaps (e.g. the 256 MiB host visible device local heap without resizable BAR) should not be eaten by one block
+        VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+        return std::min(DEFAULT_BLOCK_SIZE, heapSize / 8);
+    }
+
+    bool isHostVisible(uint32_t memoryTypeIndex) const {
+        return (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    }
+
+    VkDeviceMemory allocateDeviceMemory(VkDeviceSize size, uint32_t memoryTypeIndex, void** mapped, const DedicatedResource& dedicated = {}) {
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+        VkMemoryDedicatedAllocateInfo dedicatedInfo{};
+        dedicatedInfo.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+        dedicatedInfo.image = dedicated.image;
+        dedicatedInfo.buffer = dedicated.buffer;
+        if (dedicated.image != VK_NULL_HANDLE || dedicated.buffer != VK_NULL_HANDLE) {
+            allocInfo.pNext = &dedicatedInfo;
+        }
+
+        VkDeviceMemory memory;
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate device memory!");
+        }
+        *mapped = nullptr;
+        if (isHostVisible(memoryTypeIndex) && vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to map device memory!");
+        }
+        stats.deviceAllocationCount++;
+        stats.bytesReserved += size;
+        return memory;
+    }
+
+    MemoryBlock& createBlock(VkDeviceSize size, uint32_t memoryTypeIndex, AllocationStrategy strategy) {
+        auto block = std::make_unique<MemoryBlock>();
+        void* mapped;
+        block->memory = allocateDeviceMemory(size, memoryTypeIndex, &mapped);
+        block->mapped = static_cast<char*>(mapped);
+        block->size = size;
+        block->memoryTypeIndex = memoryTypeIndex;
+        block->strategy = strategy;
+        block->ranges[0] = { size, true, ResourceKind::Linear };
+        blocks.push_back(std::move(block));
+        return *blocks.back();
+    }
+
+    // size has to be the resource's VkMemoryRequirements::size when the memory is dedicated to it.
+    Allocation allocateDedicated(VkDeviceSize size, uint32_t memoryTypeIndex, const DedicatedResource& dedicated) {
+        Allocation allocation;
+        allocation.memory = allocateDeviceMemory(size, memoryTypeIndex, &allocation.mapped, dedicated);
+        allocation.size = size;
+        stats.dedicatedAllocationCount++;
+        stats.allocationCount++;
+        stats.bytesUsed += size;
+        return allocation;
+    }
+
+    Allocation makeAllocation(MemoryBlock& block, VkDeviceSize offset, VkDeviceSize size) {
+        block.liveAllocations++;
+        block.usedBytes += size;
+        stats.allocationCount++;
+        stats.bytesUsed += size;
+
+        Allocation allocation;
+        allocation.memory = block.memory;
+        allocation.offset = offset;
+        allocation.size = size;
+        allocation.mapped = block.mapped != nullptr ? block.mapped + offset : nullptr;
+        allocation.block = &block;
+        return allocation;
+    }
+};
@@ -0,0 +1,286 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Graphics pipeline variants: one pipeline per combination of fixed function state and shader features. Variants are
+// compiled on background threads, a frame that asks for one that is not done yet keeps drawing with a variant that is,
+// so switching never stalls a frame on the driver's shader compiler.
+
+// Toggles the shaders read as specialization constants, the driver compiles the disabled code out.
+enum ShaderFeatureBits : uint32_t {
+    SHADER_FEATURE_ROTATION = 1 << 0,      // vertex shader rotates every instance, otherwise only scale and offset
+    SHADER_FEATURE_VERTEX_COLORS = 1 << 1, // fragment color is vertex color * instance color, otherwise the instance color alone
+    SHADER_FEATURE_ALL = SHADER_FEATURE_ROTATION | SHADER_FEATURE_VERTEX_COLORS
+};
+
+// constant_id of the specialization constants in first_shader.vert/.frag
+enum SpecializationConstantId : uint32_t {
+    SPECIALIZATION_SHADER_FEATURES = 0,
+    SPECIALIZATION_OPACITY = 1
+};
+
+// Everything that makes one variant differ from another. Hash and equality look at every field, add new ones to both.
+struct PipelineVariantKey {
+    bool blend = false; // alpha blending with opacity, otherwise the fragment overwrites the framebuffer
+    float opacity = 1.0f;
+    VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT; // has to match the render pass
+    uint32_t shaderFeatures = SHADER_FEATURE_ALL;
+
+    // Values handed to the shaders through VkSpecializationInfo, laid out as SPECIALIZATION_* say.
+    struct SpecializationData {
+        uint32_t shaderFeatures;
+        float opacity;
+    };
+
+    SpecializationData specializationData() const {
+        return { shaderFeatures, blend ? opacity : 1.0f };
+    }
+
+    static std::array<VkSpecializationMapEntry, 2> specializationMapEntries() {
+        return { {
+            { SPECIALIZATION_SHADER_FEATURES, offsetof(SpecializationData, shaderFeatures), sizeof(uint32_t) },
+            { SPECIALIZATION_OPACITY, offsetof(SpecializationData, opacity), sizeof(float) }
+        } };
+    }
+
+    uint64_t hash() const {
+        uint32_t opacityBits;
+        memcpy(&opacityBits, &opacity, sizeof(opacityBits));
+        uint64_t value = 14695981039346656037ULL; // FNV-1a over the fields
+        for (uint64_t field : { static_cast<uint64_t>(blend), static_cast<uint64_t>(opacityBits), static_cast<uint64_t>(cullMode),
+                 static_cast<uint64_t>(samples), static_cast<uint64_t>(shaderFeatures) }) {
+            value ^= field;
+            value *= 1099511628211ULL;
+        }
+        return value;
+    }
+
+    bool operator==(const PipelineVariantKey& other) const {
+        return blend == other.blend && opacity == other.opacity && cullMode == other.cullMode && samples == other.samples && shaderFeatures == other.shaderFeatures;
+    }
+
+    bool operator!=(const PipelineVariantKey& other) const {
+        return !(*this == other);
+    }
+
+    // Short readable name for reports, e.g. "opaque.back.1x.rotation+vertex_colors"
+    std::string name() const {
+        std::string result = blend ? "blend" : "opaque";
+        result += cullMode == VK_CULL_MODE_NONE ? ".none" : cullMode == VK_CULL_MODE_FRONT_BIT ? ".front" : cullMode == VK_CULL_MODE_BACK_BIT ? ".back" : ".both";
+        result += "." + std::to_string(static_cast<uint32_t>(samples)) + "x.";
+        if (shaderFeatures == 0) {
+            result += "plain";
+        }
+        if (shaderFeatures & SHADER_FEATURE_ROTATION) {
+            result += "rotation";
+        }
+        if (shaderFeatures & SHADER_FEATURE_VERTEX_COLORS) {
+            result += (shaderFeatures & SHADER_FEATURE_ROTATION) ? "+vertex_colors" : "vertex_colors";
+        }
+        return result;
+    }
+};
+
+// Lets PipelineVariantKey be an unordered_map key, the map still compares keys with operator==.
+struct PipelineVariantKeyHash {
+    size_t operator()(const PipelineVariantKey& key) const {
+        return static_cast<size_t>(key.hash());
+    }
+};
+
+struct PipelineCompileTime {
+    std::string variant;
+    double milliseconds;
+    bool background; // false if a caller blocked on it
+};
+
+class PipelineVariants {
+public:
+    using Builder = std::function<VkPipeline(const PipelineVariantKey&)>;
+
+    PipelineVariants() = default;
+    PipelineVariants(const PipelineVariants&) = delete;
+    PipelineVariants& operator=(const PipelineVariants&) = delete;
+
+    ~PipelineVariants() {
+        stopThreads();
+    }
+
+    // build() creates the pipeline of a variant and may be called from any thread (and from several at once),
+    // so it should only use the shader library and the internally synchronized pipeline cache.
+    void init(VkDevice device, Builder build, uint32_t compileThreadCount) {
+        this->device = device;
+        builder = std::move(build);
+        stopping = false;
+        for (uint32_t i = 0; i < std::max(1u, compileThreadCount); i++) {
+            compileThreads.emplace_back([this] { compileLoop(); });
+        }
+    }
+
+    // Blocks until the variant exists, compiling it right here if nobody started it yet. For startup and for variants
+    // that have to be there before the next frame. Throws if the variant failed to compile.
+    VkPipeline get(const PipelineVariantKey& key) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Variant& variant = variants[key];
+        auto queued = std::find(queue.begin(), queue.end(), key);
+        if (queued != queue.end()) { // no compile thread picked it up yet, faster to do it ourselves than to wait for the ones before it
+            queue.erase(queued);
+            variant.state = State::Missing;
+        }
+        if (variant.state == State::Missing) {
+            variant.state = State::Compiling;
+            lock.unlock();
+            compile(key, false);
+            lock.lock();
+        }
+        compiled.wait(lock, [&] { return variant.state == State::Ready || variant.state == State::Failed; });
+        if (variant.state == State::Failed) {
+            std::rethrow_exception(variant.error);
+        }
+        return variant.pipeline;
+    }
+
+    // Returns the pipeline if the variant is ready, otherwise VK_NULL_HANDLE and queues it for the compile threads.
+    // Throws the variant's own compile error if it failed, the other variants are not affected by it.
+    VkPipeline request(const PipelineVariantKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Variant& variant = variants[key];
+        if (variant.state == State::Failed) {
+            std::rethrow_exception(variant.error);
+        }
+        if (variant.state == State::Ready) {
+            return variant.pipeline;
+        }
+        if (variant.state == State::Missing) {
+            variant.state = State::Compiling;
+            queue.push_back(key);
+            workAvailable.notify_one();
+        }
+        return VK_NULL_HANDLE;
+    }
+
+    // Compile times since the last call, so the caller can put them into its report.
+    std::vector<PipelineCompileTime> takeCompileTimes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<PipelineCompileTime> times;
+        times.swap(compileTimes);
+        return times;
+    }
+
+    uint32_t readyCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint32_t count = 0;
+        for (const auto& entry : variants) {
+            count += entry.second.state == State::Ready ? 1 : 0;
+        }
+        return count;
+    }
+
+    // Waits for the compile threads and destroys every variant. The device must not use any of them anymore.
+    void destroy() {
+        stopThreads();
+        for (auto& entry : variants) {
+            if (entry.second.pipeline != VK_NULL_HANDLE) {
+                vkDestroyPipeline(device, entry.second.pipeline, nullptr);
+            }
+        }
+        variants.clear();
+        queue.clear();
+        compileTimes.clear();
+    }
+
+private:
+    enum class State {
+        Missing,
+        Compiling,
+        Ready,
+        Failed
+    };
+
+    struct Variant {
+        State state = State::Missing;
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        std::exception_ptr error; // why the variant is Failed
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    Builder builder;
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable compiled;
+    std::unordered_map<PipelineVariantKey, Variant, PipelineVariantKeyHash> variants;
+    std::deque<PipelineVariantKey> queue;
+    std::vector<PipelineCompileTime> compileTimes;
+    std::vector<std::thread> compileThreads;
+    bool stopping = false;
+
+    // Runs without the lock, the driver compile is the slow part.
+    void compile(const PipelineVariantKey& key, bool background) {
+        auto start = std::chrono::steady_clock::now();
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        std::exception_ptr error;
+        try {
+            pipeline = builder(key);
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Variant& variant = variants[key];
+            if (error) {
+                variant.state = State::Failed;
+                variant.error = error;
+            }
+            else {
+                variant.pipeline = pipeline;
+                variant.state = State::Ready;
+                compileTimes.push_back({ key.name(), milliseconds, background });
+            }
+        }
+        compiled.notify_all();
+    }
+
+    void compileLoop() {
+        while (true) {
+            PipelineVariantKey key;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                workAvailable.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping) return;
+                key = queue.front();
+                queue.pop_front();
+            }
+            compile(key, true);
+        }
+    }
+
+    void stopThreads() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (auto& thread : compileThreads) {
+            thread.join();
+        }
+        compileThreads.clear();
+    }
+};
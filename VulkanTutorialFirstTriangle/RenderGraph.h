@@ -0,0 +1,1082 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MemoryAllocator.h"
+
+// The frame as a render graph. Passes declare which images and buffers they read and write, at which pipeline stages,
+// with which access and in which image layout, and compile() derives what used to be placed by hand:
+//  - passes nothing reads from and without side effects are culled,
+//  - consecutive graphics passes become subpasses of one render pass, ordered by subpass dependencies,
+//  - the barriers in front of a pass are batched into one vkCmdPipelineBarrier, layout transitions of attachments are
+//    folded into the render pass (initialLayout / finalLayout) and load/store ops follow from who reads the image later,
+//  - images the graph creates are transient: lazily allocated memory if they never leave their render pass, and images
+//    whose lifetimes do not overlap share memory.
+// Imported resources (swap chain images, per frame slot buffers) change from frame to frame, so images are bound per
+// execute(). Buffers are synchronized with global memory barriers, drivers turn buffer barriers into those anyway.
+
+// Render passes by description, so every graph compiled with the same attachments gets the same handle and pipelines
+// built against one graph's render pass work with all the others. Owns the render passes, graphs only borrow them.
+class RenderPassCache {
+public:
+    void init(VkDevice device) {
+        this->device = device;
+    }
+
+    VkRenderPass get(const VkRenderPassCreateInfo& info) {
+        std::vector<uint64_t> description;
+        for (uint32_t i = 0; i < info.attachmentCount; i++) {
+            const VkAttachmentDescription& attachment = info.pAttachments[i];
+            description.insert(description.end(), { static_cast<uint64_t>(attachment.format), static_cast<uint64_t>(attachment.samples),
+                static_cast<uint64_t>(attachment.loadOp), static_cast<uint64_t>(attachment.storeOp), static_cast<uint64_t>(attachment.stencilLoadOp),
+                static_cast<uint64_t>(attachment.stencilStoreOp), static_cast<uint64_t>(attachment.initialLayout),
+                static_cast<uint64_t>(attachment.finalLayout) });
+        }
+        auto addReferences = [&](const VkAttachmentReference* references, uint32_t count) {
+            description.push_back(references != nullptr ? count : 0);
+            for (uint32_t i = 0; references != nullptr && i < count; i++) {
+                description.insert(description.end(), { references[i].attachment, static_cast<uint64_t>(references[i].layout) });
+            }
+        };
+        for (uint32_t i = 0; i < info.subpassCount; i++) {
+            const VkSubpassDescription& subpass = info.pSubpasses[i];
+            addReferences(subpass.pColorAttachments, subpass.colorAttachmentCount);
+            addReferences(subpass.pResolveAttachments, subpass.colorAttachmentCount);
+            addReferences(subpass.pDepthStencilAttachment, 1);
+        }
+        for (uint32_t i = 0; i < info.dependencyCount; i++) {
+            const VkSubpassDependency& dependency = info.pDependencies[i];
+            description.insert(description.end(), { dependency.srcSubpass, dependency.dstSubpass, dependency.srcStageMask, dependency.dstStageMask,
+                dependency.srcAccessMask, dependency.dstAccessMask, dependency.dependencyFlags });
+        }
+        auto cached = renderPasses.find(description);
+        if (cached != renderPasses.end()) {
+            return cached->second;
+        }
+
+        VkRenderPass renderPass;
+        if (vkCreateRenderPass(device, &info, nullptr, &renderPass) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create render pass!");
+        }
+        renderPasses[description] = renderPass;
+        return renderPass;
+    }
+
+    void destroy() {
+        for (auto& entry : renderPasses) {
+            vkDestroyRenderPass(device, entry.second, nullptr);
+        }
+        renderPasses.clear();
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    std::map<std::vector<uint64_t>, VkRenderPass> renderPasses;
+};
+
+using RenderGraphResource = uint32_t;
+
+// Where a resource is before the frame (imports) or has to be after it (exports). No stages means nothing to wait for.
+struct RenderGraphAccess {
+    VkPipelineStageFlags stages = 0;
+    VkAccessFlags access = 0;
+    VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+};
+
+// Every image of the graph is as large as the frame.
+struct RenderGraphImageDesc {
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+    VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+};
+
+// The frame execute() records.
+struct RenderGraphFrame {
+    struct BoundImage {
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+    };
+
+    uint32_t imageIndex = 0;
+    uint32_t frameSlot = 0;
+    VkCommandBufferUsageFlags usage = 0; // of the command buffer, secondary command buffers are recorded the same way
+    std::vector<BoundImage> images; // imported images by resource
+
+    void bindImage(RenderGraphResource resource, VkImage image, VkImageView view) {
+        if (images.size() <= resource) {
+            images.resize(resource + 1);
+        }
+        images[resource] = { image, view };
+    }
+};
+
+struct RenderGraphContext {
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    const RenderGraphFrame* frame = nullptr;
+    VkRenderPass renderPass = VK_NULL_HANDLE; // graphics passes only, e.g. for the inheritance info of secondary command buffers
+    VkFramebuffer framebuffer = VK_NULL_HANDLE;
+    uint32_t subpass = 0;
+};
+
+struct RenderGraphStats {
+    uint32_t passes = 0; // left after culling
+    uint32_t culledPasses = 0;
+    uint32_t renderPasses = 0;
+    uint32_t subpasses = 0;
+    uint32_t barrierBatches = 0; // vkCmdPipelineBarrier calls per frame
+    uint32_t imageBarriers = 0;
+    uint32_t transientImages = 0;
+    uint32_t aliasedImages = 0; // transient images that share their memory with another one
+    VkDeviceSize transientImageBytes = 0; // what the transient images would take without aliasing
+    VkDeviceSize transientMemoryBytes = 0; // what they take
+    bool lazyMemory = false; // a transient image got LAZILY_ALLOCATED memory
+};
+
+class RenderGraph {
+public:
+    class Pass {
+    public:
+        using Record = std::function<void(const RenderGraphContext&)>;
+
+        // Color attachment i is the i-th call. CLEAR and DONT_CARE throw away what earlier passes left in the image.
+        Pass& color(RenderGraphResource image, VkAttachmentLoadOp loadOp, VkClearColorValue clear = {}) {
+            bool load = loadOp == VK_ATTACHMENT_LOAD_OP_LOAD;
+            Use& use = addUse(image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | (load ? VK_ACCESS_COLOR_ATTACHMENT_READ_BIT : 0),
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, load, true);
+            use.attachment = Attachment::Color;
+            use.colorIndex = colorCount++;
+            use.loadOp = loadOp;
+            use.clear.color = clear;
+            return *this;
+        }
+
+        Pass& depth(RenderGraphResource image, VkAttachmentLoadOp loadOp, float clearDepth = 1.0f) {
+            Use& use = addUse(image, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                loadOp == VK_ATTACHMENT_LOAD_OP_LOAD, true);
+            use.attachment = Attachment::Depth;
+            use.loadOp = loadOp;
+            use.clear.depthStencil = { clearDepth, 0 };
+            return *this;
+        }
+
+        // Color attachment colorIndex is resolved into image at the end of the subpass, every pixel is overwritten.
+        Pass& resolve(RenderGraphResource image, uint32_t colorIndex = 0) {
+            Use& use = addUse(image, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, false, true);
+            use.attachment = Attachment::Resolve;
+            use.colorIndex = colorIndex;
+            return *this;
+        }
+
+        // layout only matters for images.
+        Pass& read(RenderGraphResource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED) {
+            addUse(resource, stages, access, layout, true, false);
+            return *this;
+        }
+
+        Pass& write(RenderGraphResource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED) {
+            addUse(resource, stages, access, layout, false, true);
+            return *this;
+        }
+
+        Pass& readWrite(RenderGraphResource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED) {
+            addUse(resource, stages, access, layout, true, true);
+            return *this;
+        }
+
+        // Never culled, e.g. because it writes queries the graph does not know about.
+        Pass& sideEffects() {
+            hasSideEffects = true;
+            return *this;
+        }
+
+        Pass& record(Record record) {
+            this->recordCommands = std::move(record);
+            return *this;
+        }
+
+        // Graphics passes: how record() fills the subpass. Asked on every execute(), so it may change between frames.
+        Pass& contents(std::function<VkSubpassContents()> contents) {
+            subpassContents = std::move(contents);
+            return *this;
+        }
+
+    private:
+        friend class RenderGraph;
+
+        enum class Attachment { None, Color, Depth, Resolve };
+
+        struct Use {
+            RenderGraphResource resource = 0;
+            VkPipelineStageFlags stages = 0;
+            VkAccessFlags access = 0;
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            bool reads = false; // needs what earlier passes wrote
+            bool writes = false;
+            Attachment attachment = Attachment::None;
+            uint32_t colorIndex = 0;
+            VkAttachmentLoadOp loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+            VkClearValue clear{};
+        };
+
+        std::string name;
+        bool graphics = false;
+        bool hasSideEffects = false;
+        std::vector<Use> uses;
+        uint32_t colorCount = 0;
+        Record recordCommands;
+        std::function<VkSubpassContents()> subpassContents;
+
+        Use& addUse(RenderGraphResource resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout, bool reads, bool writes) {
+            Use use;
+            use.resource = resource;
+            use.stages = stages;
+            use.access = access;
+            use.layout = layout;
+            use.reads = reads;
+            use.writes = writes;
+            uses.push_back(use);
+            return uses.back();
+        }
+    };
+
+    RenderGraph() = default;
+    RenderGraph(const RenderGraph&) = delete;
+    RenderGraph& operator=(const RenderGraph&) = delete;
+
+    RenderGraphResource importImage(const std::string& name, const RenderGraphImageDesc& desc, const RenderGraphAccess& initial = {}) {
+        return addResource(name, true, true, desc, initial);
+    }
+
+    RenderGraphResource importBuffer(const std::string& name, const RenderGraphAccess& initial = {}) {
+        return addResource(name, false, true, {}, initial);
+    }
+
+    // Created by compile(), alive as long as the graph. Nothing outside the frame sees it, so it starts undefined every frame.
+    RenderGraphResource createImage(const std::string& name, const RenderGraphImageDesc& desc) {
+        return addResource(name, true, false, desc, {});
+    }
+
+    // The resource is used after the frame and has to end up in the given state, e.g. the swap chain image for presentation.
+    void exportResource(RenderGraphResource resource, const RenderGraphAccess& final) {
+        resources.at(resource).exported = true;
+        resources.at(resource).final = final;
+    }
+
+    // Passes run in the order they were added.
+    Pass& addPass(const std::string& name) {
+        passes.emplace_back();
+        passes.back().name = name;
+        return passes.back();
+    }
+
+    Pass& addGraphicsPass(const std::string& name) {
+        Pass& pass = addPass(name);
+        pass.graphics = true;
+        return pass;
+    }
+
+    // Without an allocator only the render passes are built, enough to create pipelines for them.
+    void compile(VkDevice device, VkExtent2D extent, RenderPassCache& renderPassCache, MemoryAllocator* allocator = nullptr) {
+        this->device = device;
+        this->extent = extent;
+        this->allocator = allocator;
+        cullPasses();
+        buildSteps();
+        findLifetimes();
+        createImages();
+        planBarriers(renderPassCache);
+    }
+
+    void execute(VkCommandBuffer commandBuffer, const RenderGraphFrame& frame) {
+        for (Step& step : steps) {
+            recordBarriers(commandBuffer, step.barriers, frame);
+            RenderGraphContext context;
+            context.commandBuffer = commandBuffer;
+            context.frame = &frame;
+            if (!step.renderPass) {
+                const Pass& pass = passes[step.passes[0]];
+                if (pass.recordCommands) {
+                    pass.recordCommands(context);
+                }
+                continue;
+            }
+
+            context.renderPass = step.handle;
+            context.framebuffer = framebufferFor(step, frame);
+            VkRenderPassBeginInfo renderPassInfo{};
+            renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+            renderPassInfo.renderPass = step.handle;
+            renderPassInfo.framebuffer = context.framebuffer;
+            renderPassInfo.renderArea.offset = { 0, 0 };
+            renderPassInfo.renderArea.extent = extent;
+            renderPassInfo.clearValueCount = static_cast<uint32_t>(step.clearValues.size());
+            renderPassInfo.pClearValues = step.clearValues.data();
+            for (uint32_t subpass = 0; subpass < step.passes.size(); subpass++) {
+                const Pass& pass = passes[step.passes[subpass]];
+                VkSubpassContents contents = pass.subpassContents ? pass.subpassContents() : VK_SUBPASS_CONTENTS_INLINE;
+                if (subpass == 0) {
+                    vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, contents);
+                }
+                else {
+                    vkCmdNextSubpass(commandBuffer, contents);
+                }
+                context.subpass = subpass;
+                if (pass.recordCommands) {
+                    pass.recordCommands(context);
+                }
+            }
+            vkCmdEndRenderPass(commandBuffer);
+        }
+        recordBarriers(commandBuffer, finalBarriers, frame);
+    }
+
+    // The render pass the graphics pass records into.
+    VkRenderPass renderPass(const std::string& passName) const {
+        for (const Step& step : steps) {
+            for (uint32_t pass : step.passes) {
+                if (step.renderPass && passes[pass].name == passName) {
+                    return step.handle;
+                }
+            }
+        }
+        throw std::runtime_error("The render graph has no graphics pass " + passName + "!");
+    }
+
+    const RenderGraphStats& stats() const {
+        return graphStats;
+    }
+
+    // committed is what the driver actually backed of the lazily allocated memory.
+    void transientMemoryBytes(VkDeviceSize& reserved, VkDeviceSize& committed) const {
+        reserved = 0;
+        committed = 0;
+        for (const MemoryGroup& group : memoryGroups) {
+            if (group.allocation.memory == VK_NULL_HANDLE) continue;
+            reserved += group.allocation.size;
+            VkDeviceSize groupCommitted = group.allocation.size;
+            if (group.lazy) { // lazy allocations are dedicated, so the commitment is the group's alone
+                vkGetDeviceMemoryCommitment(device, group.allocation.memory, &groupCommitted);
+            }
+            committed += groupCommitted;
+        }
+    }
+
+    // Render passes belong to the RenderPassCache and stay.
+    void destroy() {
+        for (Step& step : steps) {
+            for (auto& entry : step.framebuffers) {
+                vkDestroyFramebuffer(device, entry.second, nullptr);
+            }
+            step.framebuffers.clear();
+        }
+        for (OwnedImage& image : ownedImages) {
+            if (image.view != VK_NULL_HANDLE) vkDestroyImageView(device, image.view, nullptr);
+            if (image.image != VK_NULL_HANDLE) vkDestroyImage(device, image.image, nullptr);
+            image = {};
+        }
+        for (MemoryGroup& group : memoryGroups) {
+            if (allocator != nullptr) allocator->free(group.allocation);
+        }
+        memoryGroups.clear();
+    }
+
+private:
+    static constexpr uint32_t NONE = ~0u;
+    static constexpr VkAccessFlags WRITE_ACCESS = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+    using Use = Pass::Use;
+    using Attachment = Pass::Attachment;
+
+    struct Resource {
+        std::string name;
+        bool image = false;
+        bool imported = false;
+        RenderGraphImageDesc desc;
+        RenderGraphAccess initial;
+        bool exported = false;
+        RenderGraphAccess final;
+        // found by compile()
+        uint32_t firstStep = NONE;
+        uint32_t lastStep = NONE;
+        bool discardsFirst = true; // the first use of the frame does not read, so nothing has to survive from the last frame
+        bool attachmentOnly = true;
+        uint32_t memoryGroup = NONE;
+    };
+
+    // Where the last writes and reads of a resource are while the frame is planned.
+    struct ResourceState {
+        bool initialized = false;
+        VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+        VkPipelineStageFlags writeStages = 0; // the last write or layout transition
+        VkAccessFlags writeAccess = 0;
+        VkPipelineStageFlags readStages = 0; // reads since then that no barrier waited for yet
+        VkPipelineStageFlags visibleStages = 0; // the last write is visible to these already
+        VkAccessFlags visibleAccess = 0;
+        uint32_t step = NONE; // last step and subpass that used it
+        uint32_t subpass = 0;
+    };
+
+    struct ImageBarrier {
+        RenderGraphResource resource;
+        VkAccessFlags srcAccess;
+        VkAccessFlags dstAccess;
+        VkImageLayout oldLayout;
+        VkImageLayout newLayout;
+    };
+
+    struct BarrierBatch {
+        VkPipelineStageFlags srcStages = 0;
+        VkPipelineStageFlags dstStages = 0;
+        bool memoryBarrier = false; // buffers, all in one global barrier
+        VkAccessFlags srcAccess = 0;
+        VkAccessFlags dstAccess = 0;
+        std::vector<ImageBarrier> images;
+
+        bool empty() const {
+            return !memoryBarrier && images.empty();
+        }
+    };
+
+    // One pass, or the graphics passes merged into the subpasses of one render pass.
+    struct Step {
+        std::vector<uint32_t> passes;
+        bool renderPass = false;
+        BarrierBatch barriers; // in front of the step
+        VkRenderPass handle = VK_NULL_HANDLE;
+        std::vector<RenderGraphResource> attachments;
+        std::vector<VkClearValue> clearValues;
+        std::map<std::vector<VkImageView>, VkFramebuffer> framebuffers; // by the views of imported attachments, e.g. one per swap chain image
+    };
+
+    struct OwnedImage {
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        VkMemoryRequirements requirements{};
+    };
+
+    // Transient images sharing one piece of memory, none of them is alive while another one is.
+    struct MemoryGroup {
+        std::vector<RenderGraphResource> images;
+        VkMemoryRequirements requirements{};
+        bool lazy = false;
+        Allocation allocation;
+        VkPipelineStageFlags stages = 0; // every use of every image, the previous frame's work the first use has to wait for
+        VkAccessFlags writeAccess = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    MemoryAllocator* allocator = nullptr;
+    VkExtent2D extent{};
+    std::vector<Resource> resources;
+    std::deque<Pass> passes; // references handed out by addPass() stay valid
+    std::vector<bool> alive;
+    std::vector<Step> steps;
+    BarrierBatch finalBarriers; // into the exported states
+    std::vector<OwnedImage> ownedImages; // by resource
+    std::vector<MemoryGroup> memoryGroups;
+    RenderGraphStats graphStats;
+
+    RenderGraphResource addResource(const std::string& name, bool image, bool imported, const RenderGraphImageDesc& desc, const RenderGraphAccess& initial) {
+        Resource resource;
+        resource.name = name;
+        resource.image = image;
+        resource.imported = imported;
+        resource.desc = desc;
+        resource.initial = initial;
+        resources.push_back(resource);
+        return static_cast<RenderGraphResource>(resources.size() - 1);
+    }
+
+    // Walks back from the exports: a pass stays if it writes something a later pass that stays (or the export) reads.
+    void cullPasses() {
+        std::vector<bool> needed(resources.size());
+        for (size_t i = 0; i < resources.size(); i++) {
+            needed[i] = resources[i].exported;
+        }
+        alive.assign(passes.size(), false);
+        for (size_t i = passes.size(); i-- > 0;) {
+            const Pass& pass = passes[i];
+            bool used = pass.hasSideEffects;
+            for (const Use& use : pass.uses) {
+                used = used || (use.writes && needed[use.resource]);
+            }
+            if (!used) {
+                graphStats.culledPasses++;
+                continue;
+            }
+            alive[i] = true;
+            graphStats.passes++;
+            for (const Use& use : pass.uses) {
+                if (use.reads) {
+                    needed[use.resource] = true;
+                }
+            }
+        }
+    }
+
+    void buildSteps() {
+        for (uint32_t i = 0; i < passes.size(); i++) {
+            if (!alive[i]) continue;
+            if (passes[i].graphics && !steps.empty() && steps.back().renderPass && canMerge(steps.back(), passes[i])) {
+                steps.back().passes.push_back(i);
+                continue;
+            }
+            Step step;
+            step.passes.push_back(i);
+            step.renderPass = passes[i].graphics;
+            steps.push_back(step);
+        }
+    }
+
+    // A subpass can only use an image of the render pass the way the render pass does: as an attachment. Sampling what an
+    // earlier subpass rendered, or rendering into what it sampled, needs a layout change, which ends the render pass.
+    bool canMerge(const Step& step, const Pass& pass) const {
+        for (const Use& use : pass.uses) {
+            if (!resources[use.resource].image) continue;
+            for (uint32_t merged : step.passes) {
+                for (const Use& other : passes[merged].uses) {
+                    if (other.resource == use.resource && (other.attachment == Attachment::None) != (use.attachment == Attachment::None)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void findLifetimes() {
+        for (uint32_t s = 0; s < steps.size(); s++) {
+            for (uint32_t pass : steps[s].passes) {
+                for (const Use& use : passes[pass].uses) {
+                    Resource& resource = resources[use.resource];
+                    if (resource.firstStep == NONE) {
+                        resource.firstStep = s;
+                        resource.discardsFirst = !use.reads;
+                    }
+                    resource.lastStep = s;
+                    resource.attachmentOnly = resource.attachmentOnly && use.attachment != Attachment::None;
+                }
+            }
+        }
+    }
+
+    // Whether anything after the step reads what the resource holds at its end.
+    bool readAfter(RenderGraphResource resource, uint32_t step) const {
+        const Use* next = nextUse(resource, step);
+        return next != nullptr ? next->reads : resources[resource].exported;
+    }
+
+    const Use* nextUse(RenderGraphResource resource, uint32_t step) const {
+        for (uint32_t s = step + 1; s < steps.size(); s++) {
+            for (uint32_t pass : steps[s].passes) {
+                for (const Use& use : passes[pass].uses) {
+                    if (use.resource == resource) return &use;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    bool needsStore(RenderGraphResource resource, uint32_t step) const {
+        const Resource& r = resources[resource];
+        return r.imported || r.exported || !r.discardsFirst || readAfter(resource, step);
+    }
+
+    // Never loaded or stored and only used inside one render pass, so on tiling GPUs it never leaves tile memory.
+    bool isTransientAttachment(RenderGraphResource resource) const {
+        const Resource& r = resources[resource];
+        return r.attachmentOnly && r.firstStep == r.lastStep && !needsStore(resource, r.lastStep);
+    }
+
+    static VkImageUsageFlags usageFor(const Use& use) {
+        switch (use.attachment) {
+        case Attachment::Color:
+        case Attachment::Resolve:
+            return VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        case Attachment::Depth:
+            return VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        default:
+            break;
+        }
+        VkImageUsageFlags usage = 0;
+        if (use.access & VK_ACCESS_SHADER_READ_BIT) usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+        if (use.access & VK_ACCESS_SHADER_WRITE_BIT) usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+        if (use.access & VK_ACCESS_INPUT_ATTACHMENT_READ_BIT) usage |= VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+        if (use.access & VK_ACCESS_TRANSFER_READ_BIT) usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        if (use.access & VK_ACCESS_TRANSFER_WRITE_BIT) usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        return usage;
+    }
+
+    bool lifetimesOverlap(const Resource& a, const Resource& b) const {
+        return a.firstStep <= b.lastStep && b.firstStep <= a.lastStep;
+    }
+
+    void createImages() {
+        ownedImages.assign(resources.size(), {});
+        std::vector<RenderGraphResource> transientImages;
+        for (RenderGraphResource r = 0; r < resources.size(); r++) {
+            if (resources[r].image && !resources[r].imported && resources[r].firstStep != NONE) {
+                transientImages.push_back(r);
+            }
+        }
+        graphStats.transientImages = static_cast<uint32_t>(transientImages.size());
+
+        for (RenderGraphResource r : transientImages) {
+            if (allocator == nullptr) continue; // no images, every one gets a group of its own for planning
+            VkImageUsageFlags usage = isTransientAttachment(r) ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0;
+            for (uint32_t s = resources[r].firstStep; s <= resources[r].lastStep; s++) {
+                for (uint32_t pass : steps[s].passes) {
+                    for (const Use& use : passes[pass].uses) {
+                        if (use.resource == r) usage |= usageFor(use);
+                    }
+                }
+            }
+
+            VkImageCreateInfo imageInfo{};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = resources[r].desc.format;
+            imageInfo.extent = { extent.width, extent.height, 1 };
+            imageInfo.mipLevels = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.samples = resources[r].desc.samples;
+            imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            imageInfo.usage = usage;
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            if (vkCreateImage(device, &imageInfo, nullptr, &ownedImages[r].image) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create render graph image " + resources[r].name + "!");
+            }
+            vkGetImageMemoryRequirements(device, ownedImages[r].image, &ownedImages[r].requirements);
+            graphStats.transientImageBytes += ownedImages[r].requirements.size;
+        }
+
+        // Largest first, each image goes into the first group it fits in: same kind of memory and no overlapping lifetime.
+        // Only images that start every frame from scratch can share, the others have to keep their contents.
+        std::stable_sort(transientImages.begin(), transientImages.end(), [&](RenderGraphResource a, RenderGraphResource b) {
+            return ownedImages[a].requirements.size > ownedImages[b].requirements.size;
+        });
+        for (RenderGraphResource r : transientImages) {
+            const VkMemoryRequirements& requirements = ownedImages[r].requirements;
+            // Desktop GPUs usually have no lazily allocated memory type, the image then simply lives in device local memory.
+            bool lazy = allocator != nullptr && isTransientAttachment(r) &&
+                allocator->hasMemoryType(requirements.memoryTypeBits, VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT);
+            bool aliasable = allocator != nullptr && resources[r].discardsFirst && !resources[r].exported;
+            MemoryGroup* target = nullptr;
+            for (MemoryGroup& group : memoryGroups) {
+                if (!aliasable || group.lazy != lazy || (group.requirements.memoryTypeBits & requirements.memoryTypeBits) == 0) continue;
+                bool fits = true;
+                for (RenderGraphResource member : group.images) {
+                    fits = fits && resources[member].discardsFirst && !resources[member].exported && !lifetimesOverlap(resources[member], resources[r]);
+                }
+                if (fits) {
+                    target = &group;
+                    break;
+                }
+            }
+            if (target == nullptr) {
+                memoryGroups.emplace_back();
+                target = &memoryGroups.back();
+                target->requirements = requirements;
+                target->lazy = lazy;
+            }
+            else {
+                graphStats.aliasedImages++;
+                target->requirements.size = std::max(target->requirements.size, requirements.size);
+                target->requirements.alignment = std::max(target->requirements.alignment, requirements.alignment);
+                target->requirements.memoryTypeBits &= requirements.memoryTypeBits;
+            }
+            target->images.push_back(r);
+            resources[r].memoryGroup = static_cast<uint32_t>(target - memoryGroups.data());
+        }
+
+        for (MemoryGroup& group : memoryGroups) {
+            for (RenderGraphResource r : group.images) {
+                for (uint32_t s = resources[r].firstStep; s <= resources[r].lastStep; s++) {
+                    for (uint32_t pass : steps[s].passes) {
+                        for (const Use& use : passes[pass].uses) {
+                            if (use.resource != r) continue;
+                            group.stages |= use.stages;
+                            group.writeAccess |= use.access & WRITE_ACCESS;
+                        }
+                    }
+                }
+            }
+            if (allocator == nullptr) continue;
+
+            DedicatedResource dedicated; // memory that several images alias can not be dedicated to one of them
+            if (group.images.size() == 1) {
+                dedicated.image = ownedImages[group.images[0]].image;
+            }
+            group.allocation = allocator->allocate(group.requirements, group.lazy ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                ResourceKind::Optimal, AllocationStrategy::FreeList, dedicated);
+            graphStats.transientMemoryBytes += group.allocation.size;
+            graphStats.lazyMemory = graphStats.lazyMemory || group.lazy;
+            for (RenderGraphResource r : group.images) {
+                vkBindImageMemory(device, ownedImages[r].image, group.allocation.memory, group.allocation.offset);
+
+                VkImageViewCreateInfo viewInfo{};
+                viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+                viewInfo.image = ownedImages[r].image;
+                viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+                viewInfo.format = resources[r].desc.format;
+                viewInfo.subresourceRange = { resources[r].desc.aspect, 0, 1, 0, 1 };
+                if (vkCreateImageView(device, &viewInfo, nullptr, &ownedImages[r].view) != VK_SUCCESS) {
+                    throw std::runtime_error("Failed to create render graph image view " + resources[r].name + "!");
+                }
+            }
+        }
+    }
+
+    // Updates the state for the use. Returns whether the use has to wait for earlier work, and for what in src*.
+    static bool needsBarrier(ResourceState& state, const Use& use, bool image, VkPipelineStageFlags& srcStages, VkAccessFlags& srcAccess) {
+        bool layoutChange = image && use.layout != state.layout;
+        srcStages = 0;
+        srcAccess = 0;
+        if (!use.writes && !layoutChange) { // read after read needs nothing, read after write needs the write visible
+            state.readStages |= use.stages;
+            bool visible = (use.stages & ~state.visibleStages) == 0 && (use.access & ~state.visibleAccess) == 0;
+            if (state.writeStages == 0 || visible) return false;
+            srcStages = state.writeStages;
+            srcAccess = state.writeAccess;
+            state.visibleStages |= use.stages;
+            state.visibleAccess |= use.access;
+            return true;
+        }
+
+        // Writes and layout transitions wait for every earlier write and for the reads since, unless the last barrier covered both.
+        bool ordered = state.readStages == 0 && (state.writeStages == 0 || (use.stages & ~state.visibleStages) == 0);
+        srcStages = state.writeStages | state.readStages;
+        srcAccess = state.writeAccess;
+        if (image) {
+            state.layout = use.layout;
+        }
+        state.writeStages = use.stages;
+        state.writeAccess = use.access & WRITE_ACCESS;
+        state.readStages = use.writes ? 0 : use.stages;
+        state.visibleStages = use.writes ? 0 : use.stages;
+        state.visibleAccess = use.writes ? 0 : use.access;
+        return layoutChange || !ordered;
+    }
+
+    ResourceState& stateFor(std::vector<ResourceState>& states, std::vector<bool>& groupUsed, std::vector<MemoryGroup>& groupsThisFrame, RenderGraphResource r) {
+        ResourceState& state = states[r];
+        if (state.initialized) return state;
+        state.initialized = true;
+        const Resource& resource = resources[r];
+        if (resource.imported) {
+            state.layout = resource.initial.layout;
+            state.writeStages = resource.initial.stages;
+            state.writeAccess = resource.initial.access;
+            return state;
+        }
+        // The memory was last used by an image of the group earlier this frame, or in the last frame by any of them.
+        uint32_t g = resource.memoryGroup;
+        const MemoryGroup& previous = groupUsed[g] ? groupsThisFrame[g] : memoryGroups[g];
+        state.writeStages = previous.stages;
+        state.writeAccess = previous.writeAccess;
+        return state;
+    }
+
+    void addBarrier(BarrierBatch& batch, const Use& use, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess, VkImageLayout oldLayout) {
+        batch.srcStages |= srcStages;
+        batch.dstStages |= use.stages;
+        if (resources[use.resource].image) {
+            batch.images.push_back({ use.resource, srcAccess, use.access, oldLayout, use.layout });
+            return;
+        }
+        batch.memoryBarrier = true;
+        batch.srcAccess |= srcAccess;
+        batch.dstAccess |= use.access;
+    }
+
+    void planBarriers(RenderPassCache& renderPassCache) {
+        std::vector<ResourceState> states(resources.size());
+        std::vector<bool> groupUsed(memoryGroups.size(), false);
+        std::vector<MemoryGroup> groupsThisFrame(memoryGroups.size()); // stages and writes of the group's images so far
+        auto noteUse = [&](const Use& use) {
+            uint32_t g = resources[use.resource].memoryGroup;
+            if (g == NONE) return;
+            groupUsed[g] = true;
+            groupsThisFrame[g].stages |= use.stages;
+            groupsThisFrame[g].writeAccess |= use.access & WRITE_ACCESS;
+        };
+
+        for (uint32_t s = 0; s < steps.size(); s++) {
+            Step& step = steps[s];
+            if (!step.renderPass) {
+                for (const Use& use : passes[step.passes[0]].uses) {
+                    ResourceState& state = stateFor(states, groupUsed, groupsThisFrame, use.resource);
+                    VkImageLayout oldLayout = state.layout;
+                    VkPipelineStageFlags srcStages;
+                    VkAccessFlags srcAccess;
+                    if (needsBarrier(state, use, resources[use.resource].image, srcStages, srcAccess)) {
+                        addBarrier(step.barriers, use, srcStages, srcAccess, oldLayout);
+                    }
+                    state.step = s;
+                    noteUse(use);
+                }
+                continue;
+            }
+            planRenderPass(s, states, groupUsed, groupsThisFrame, noteUse, renderPassCache);
+        }
+
+        for (RenderGraphResource r = 0; r < resources.size(); r++) {
+            const Resource& resource = resources[r];
+            if (!resource.exported) continue;
+            ResourceState& state = stateFor(states, groupUsed, groupsThisFrame, r);
+            bool layoutChange = resource.image && resource.final.layout != VK_IMAGE_LAYOUT_UNDEFINED && resource.final.layout != state.layout;
+            if (!layoutChange && resource.final.access == 0) continue; // e.g. presentation, the semaphore takes care of it
+            Use use;
+            use.resource = r;
+            use.stages = resource.final.stages != 0 ? resource.final.stages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+            use.access = resource.final.access;
+            use.layout = layoutChange ? resource.final.layout : state.layout;
+            use.reads = true;
+            VkImageLayout oldLayout = state.layout;
+            VkPipelineStageFlags srcStages;
+            VkAccessFlags srcAccess;
+            if (needsBarrier(state, use, resource.image, srcStages, srcAccess)) {
+                addBarrier(finalBarriers, use, srcStages, srcAccess, oldLayout);
+            }
+        }
+
+        for (const Step& step : steps) {
+            graphStats.barrierBatches += step.barriers.empty() ? 0 : 1;
+            graphStats.imageBarriers += static_cast<uint32_t>(step.barriers.images.size());
+        }
+        graphStats.barrierBatches += finalBarriers.empty() ? 0 : 1;
+        graphStats.imageBarriers += static_cast<uint32_t>(finalBarriers.images.size());
+    }
+
+    template <typename NoteUse>
+    void planRenderPass(uint32_t s, std::vector<ResourceState>& states, std::vector<bool>& groupUsed, std::vector<MemoryGroup>& groupsThisFrame,
+        NoteUse& noteUse, RenderPassCache& renderPassCache) {
+        Step& step = steps[s];
+        struct SubpassReferences {
+            std::vector<VkAttachmentReference> colors;
+            std::vector<VkAttachmentReference> resolves;
+            VkAttachmentReference depth{ VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED };
+            bool resolved = false;
+        };
+        std::vector<VkAttachmentDescription> attachments;
+        std::map<RenderGraphResource, uint32_t> attachmentIndices;
+        std::vector<SubpassReferences> references(step.passes.size());
+        std::map<std::pair<uint32_t, uint32_t>, VkSubpassDependency> dependencies;
+        auto dependency = [&](uint32_t src, uint32_t dst) -> VkSubpassDependency& {
+            VkSubpassDependency& entry = dependencies[{ src, dst }];
+            entry.srcSubpass = src;
+            entry.dstSubpass = dst;
+            return entry;
+        };
+
+        for (uint32_t subpass = 0; subpass < step.passes.size(); subpass++) {
+            const Pass& pass = passes[step.passes[subpass]];
+            references[subpass].colors.assign(pass.colorCount, { VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED });
+            references[subpass].resolves.assign(pass.colorCount, { VK_ATTACHMENT_UNUSED, VK_IMAGE_LAYOUT_UNDEFINED });
+            for (const Use& use : pass.uses) {
+                const Resource& resource = resources[use.resource];
+                ResourceState& state = stateFor(states, groupUsed, groupsThisFrame, use.resource);
+                bool inRenderPass = state.step == s; // used by an earlier subpass, or earlier in this one
+                uint32_t previousSubpass = state.subpass;
+                VkImageLayout oldLayout = state.layout;
+                VkPipelineStageFlags srcStages;
+                VkAccessFlags srcAccess;
+                bool barrier = needsBarrier(state, use, resource.image, srcStages, srcAccess);
+                state.step = s;
+                state.subpass = subpass;
+                noteUse(use);
+
+                if (use.attachment == Attachment::None) { // e.g. indirect draws and vertex buffers, made visible before the render pass
+                    if (barrier && inRenderPass) {
+                        if (previousSubpass == subpass) continue;
+                        VkSubpassDependency& entry = dependency(previousSubpass, subpass);
+                        entry.srcStageMask |= srcStages;
+                        entry.srcAccessMask |= srcAccess;
+                        entry.dstStageMask |= use.stages;
+                        entry.dstAccessMask |= use.access;
+                    }
+                    else if (barrier) {
+                        addBarrier(step.barriers, use, srcStages, srcAccess, oldLayout);
+                    }
+                    continue;
+                }
+
+                auto found = attachmentIndices.find(use.resource);
+                uint32_t index;
+                if (found != attachmentIndices.end()) {
+                    index = found->second;
+                }
+                else {
+                    index = static_cast<uint32_t>(attachments.size());
+                    attachmentIndices[use.resource] = index;
+                    VkAttachmentDescription description{};
+                    description.format = resource.desc.format;
+                    description.samples = resource.desc.samples;
+                    description.loadOp = use.loadOp; // what to do with the attachment before rendering: CLEAR, or keep (LOAD) what earlier passes left
+                    description.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+                    description.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+                    // If the old contents are not needed, UNDEFINED lets the driver skip preserving them in the transition
+                    description.initialLayout = use.loadOp == VK_ATTACHMENT_LOAD_OP_LOAD ? oldLayout : VK_IMAGE_LAYOUT_UNDEFINED;
+                    attachments.push_back(description);
+                    step.attachments.push_back(use.resource);
+                    step.clearValues.push_back(use.clear);
+                }
+                // Nothing to wait for: the implicit dependency does the layout transition
+                if (barrier && srcStages != 0 && !(inRenderPass && previousSubpass == subpass)) {
+                    VkSubpassDependency& entry = dependency(inRenderPass ? previousSubpass : VK_SUBPASS_EXTERNAL, subpass);
+                    entry.srcStageMask |= srcStages;
+                    entry.srcAccessMask |= srcAccess;
+                    entry.dstStageMask |= use.stages;
+                    entry.dstAccessMask |= use.access;
+                    if (inRenderPass) {
+                        entry.dependencyFlags |= VK_DEPENDENCY_BY_REGION_BIT; // pixel to pixel, a tiler keeps going tile by tile
+                    }
+                }
+
+                VkAttachmentReference reference{ index, use.layout };
+                if (use.attachment == Attachment::Color) {
+                    references[subpass].colors[use.colorIndex] = reference;
+                }
+                else if (use.attachment == Attachment::Resolve) {
+                    references[subpass].resolves.at(use.colorIndex) = reference;
+                    references[subpass].resolved = true;
+                }
+                else {
+                    references[subpass].depth = reference;
+                }
+            }
+        }
+
+        // Store only what somebody looks at later. The next use's layout becomes the final layout and the dependency that
+        // makes the attachment's writes visible to it leaves the render pass with it, so there is no barrier afterwards.
+        for (uint32_t i = 0; i < attachments.size(); i++) {
+            RenderGraphResource r = step.attachments[i];
+            ResourceState& state = states[r];
+            attachments[i].storeOp = needsStore(r, s) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+            attachments[i].finalLayout = state.layout;
+
+            const Use* next = nextUse(r, s);
+            RenderGraphAccess after;
+            if (next != nullptr && next->attachment == Attachment::None) {
+                after = { next->stages, next->access, next->layout };
+            }
+            else if (next == nullptr && resources[r].exported) {
+                after = resources[r].final;
+            }
+            else {
+                continue; // unused, or the next render pass transitions it itself
+            }
+            if (after.layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+                attachments[i].finalLayout = after.layout;
+            }
+            VkSubpassDependency& entry = dependency(state.subpass, VK_SUBPASS_EXTERNAL);
+            entry.srcStageMask |= state.writeStages | state.readStages;
+            entry.srcAccessMask |= state.writeAccess;
+            entry.dstStageMask |= after.stages != 0 ? after.stages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+            entry.dstAccessMask |= after.access;
+            state.layout = attachments[i].finalLayout;
+            state.readStages = 0;
+            state.visibleStages = after.stages;
+            state.visibleAccess = after.access;
+        }
+
+        std::vector<VkSubpassDescription> subpasses(step.passes.size());
+        for (uint32_t subpass = 0; subpass < step.passes.size(); subpass++) {
+            SubpassReferences& subpassReferences = references[subpass];
+            VkSubpassDescription& description = subpasses[subpass];
+            description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+            description.colorAttachmentCount = static_cast<uint32_t>(subpassReferences.colors.size());
+            description.pColorAttachments = subpassReferences.colors.data(); // "layout(location = 0) out vec4 outColor" indexes here
+            description.pResolveAttachments = subpassReferences.resolved ? subpassReferences.resolves.data() : nullptr; // without a round trip through memory on tilers
+            description.pDepthStencilAttachment = subpassReferences.depth.attachment != VK_ATTACHMENT_UNUSED ? &subpassReferences.depth : nullptr;
+        }
+        std::vector<VkSubpassDependency> dependencyList;
+        for (auto& entry : dependencies) {
+            dependencyList.push_back(entry.second);
+        }
+
+        VkRenderPassCreateInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+        renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+        renderPassInfo.pAttachments = attachments.data();
+        renderPassInfo.subpassCount = static_cast<uint32_t>(subpasses.size());
+        renderPassInfo.pSubpasses = subpasses.data();
+        renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencyList.size());
+        renderPassInfo.pDependencies = dependencyList.data();
+        step.handle = renderPassCache.get(renderPassInfo);
+        graphStats.renderPasses++;
+        graphStats.subpasses += static_cast<uint32_t>(subpasses.size());
+    }
+
+    RenderGraphFrame::BoundImage imageOf(RenderGraphResource resource, const RenderGraphFrame& frame) const {
+        if (!resources[resource].imported) {
+            return { ownedImages[resource].image, ownedImages[resource].view };
+        }
+        if (resource >= frame.images.size() || frame.images[resource].image == VK_NULL_HANDLE) {
+            throw std::runtime_error("Render graph image " + resources[resource].name + " is not bound!");
+        }
+        return frame.images[resource];
+    }
+
+    void recordBarriers(VkCommandBuffer commandBuffer, const BarrierBatch& batch, const RenderGraphFrame& frame) const {
+        if (batch.empty()) return;
+        VkMemoryBarrier memoryBarrier{};
+        memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        memoryBarrier.srcAccessMask = batch.srcAccess;
+        memoryBarrier.dstAccessMask = batch.dstAccess;
+        std::vector<VkImageMemoryBarrier> imageBarriers;
+        for (const ImageBarrier& barrier : batch.images) {
+            VkImageMemoryBarrier imageBarrier{};
+            imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            imageBarrier.srcAccessMask = barrier.srcAccess;
+            imageBarrier.dstAccessMask = barrier.dstAccess;
+            imageBarrier.oldLayout = barrier.oldLayout;
+            imageBarrier.newLayout = barrier.newLayout;
+            imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageBarrier.image = imageOf(barrier.resource, frame).image;
+            imageBarrier.subresourceRange = { resources[barrier.resource].desc.aspect, 0, 1, 0, 1 };
+            imageBarriers.push_back(imageBarrier);
+        }
+        VkPipelineStageFlags srcStages = batch.srcStages != 0 ? batch.srcStages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT); // a transition out of nothing
+        vkCmdPipelineBarrier(commandBuffer, srcStages, batch.dstStages, 0, batch.memoryBarrier ? 1 : 0, &memoryBarrier, 0, nullptr,
+            static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+    }
+
+    VkFramebuffer framebufferFor(Step& step, const RenderGraphFrame& frame) {
+        std::vector<VkImageView> views; // same order as the attachments of the render pass
+        for (RenderGraphResource r : step.attachments) {
+            views.push_back(imageOf(r, frame).view);
+        }
+        auto cached = step.framebuffers.find(views);
+        if (cached != step.framebuffers.end()) {
+            return cached->second;
+        }
+
+        VkFramebufferCreateInfo framebufferInfo{};
+        framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        framebufferInfo.renderPass = step.handle;
+        framebufferInfo.attachmentCount = static_cast<uint32_t>(views.size());
+        framebufferInfo.pAttachments = views.data();
+        framebufferInfo.width = extent.width;
+        framebufferInfo.height = extent.height;
+        framebufferInfo.layers = 1;
+        VkFramebuffer framebuffer;
+        if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &framebuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create framebuffer!");
+        }
+        step.framebuffers[views] = framebuffer;
+        return framebuffer;
+    }
+};
@@ -0,0 +1,246 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX // windows.h would break std::min and std::max
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Loads SPIR-V files into VkShaderModules once and keeps them until destroy(), so rebuilding a pipeline does not read
+// and parse the same file again. Files are memory mapped, which hands the driver page aligned words straight from the
+// page cache instead of copying them through an ifstream into a char buffer that vkCreateShaderModule may not even like.
+// Identical code under different file names ends up as one module. The library keeps a copy of the code of every
+// module, so a hash collision can never hand out the module of a different shader.
+
+// Read only view of a whole file, unmapped when it goes out of scope.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // Returns false if the file does not exist or can not be mapped (empty files can not be mapped either).
+    bool open(const std::string& path) {
+        close();
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            close();
+            return false;
+        }
+        mappedData = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        mappedSize = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) return false;
+        struct stat fileInfo;
+        if (fstat(descriptor, &fileInfo) != 0 || fileInfo.st_size == 0) {
+            ::close(descriptor);
+            return false;
+        }
+        void* address = mmap(nullptr, static_cast<size_t>(fileInfo.st_size), PROT_READ, MAP_PRIVATE, descriptor, 0);
+        ::close(descriptor); // the mapping keeps its own reference to the file
+        mappedData = address == MAP_FAILED ? nullptr : address;
+        mappedSize = static_cast<size_t>(fileInfo.st_size);
+#endif
+        if (mappedData == nullptr) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#if defined(_WIN32)
+        if (mappedData != nullptr) UnmapViewOfFile(mappedData);
+        if (mapping != nullptr) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (mappedData != nullptr) munmap(mappedData, mappedSize);
+#endif
+        mappedData = nullptr;
+        mappedSize = 0;
+    }
+
+    const void* data() const {
+        return mappedData;
+    }
+
+    size_t size() const {
+        return mappedSize;
+    }
+
+private:
+    void* mappedData = nullptr;
+    size_t mappedSize = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+struct ShaderLibraryStats {
+    uint32_t moduleCount = 0; // live VkShaderModules
+    uint32_t filesLoaded = 0;
+    uint32_t duplicateFiles = 0; // files whose code was already loaded under another name
+    uint32_t cacheHits = 0; // load() calls answered without touching the file
+    size_t bytesLoaded = 0;
+    double loadMs = 0.0; // reading, validating and vkCreateShaderModule
+};
+
+class ShaderLibrary {
+public:
+    static constexpr uint32_t SPIRV_MAGIC = 0x07230203;
+    static constexpr size_t SPIRV_HEADER_WORDS = 5; // magic, version, generator, bound, schema
+
+    void init(VkDevice device) {
+        this->device = device;
+    }
+
+    // The module stays valid until destroy(), don't destroy it yourself. Safe to call from several threads.
+    VkShaderModule load(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto cached = modulesByPath.find(path);
+        if (cached != modulesByPath.end()) {
+            loadStats.cacheHits++;
+            return cached->second;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        MappedFile file;
+        std::vector<uint32_t> fallback; // only if the file can not be mapped
+        const uint32_t* code = nullptr;
+        size_t codeSize = 0;
+        if (file.open(path)) {
+            code = static_cast<const uint32_t*>(file.data()); // mappings start on a page boundary
+            codeSize = file.size();
+        }
+        else {
+            fallback = readWords(path, codeSize);
+            code = fallback.data();
+        }
+        validate(path, code, codeSize);
+
+        VkShaderModule module = VK_NULL_HANDLE;
+        std::vector<CachedModule>& candidates = modulesByHash[hash(code, codeSize)];
+        for (const CachedModule& candidate : candidates) {
+            if (candidate.code.size() * 4 == codeSize && memcmp(candidate.code.data(), code, codeSize) == 0) {
+                module = candidate.module;
+                loadStats.duplicateFiles++;
+                break;
+            }
+        }
+        if (module == VK_NULL_HANDLE) {
+            VkShaderModuleCreateInfo createInfo{};
+            createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            createInfo.codeSize = codeSize;
+            createInfo.pCode = code;
+            if (vkCreateShaderModule(device, &createInfo, nullptr, &module) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create shader module from " + path + "!");
+            }
+            candidates.push_back({ std::vector<uint32_t>(code, code + codeSize / 4), module });
+            loadStats.moduleCount++;
+        }
+        modulesByPath[path] = module;
+        loadStats.filesLoaded++;
+        loadStats.bytesLoaded += codeSize;
+        loadStats.loadMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return module;
+    }
+
+    ShaderLibraryStats stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return loadStats;
+    }
+
+    // Only once no pipeline is being created from the modules anymore. Pipelines that were created stay valid.
+    void destroy() {
+        for (auto& entry : modulesByHash) {
+            for (const CachedModule& cached : entry.second) {
+                vkDestroyShaderModule(device, cached.module, nullptr);
+            }
+        }
+        modulesByHash.clear();
+        modulesByPath.clear();
+        loadStats = {};
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    std::mutex mutex;
+    std::unordered_map<std::string, VkShaderModule> modulesByPath;
+    struct CachedModule {
+        std::vector<uint32_t> code;
+        VkShaderModule module;
+    };
+    std::unordered_map<uint64_t, std::vector<CachedModule>> modulesByHash; // hash of the code, including its size
+    ShaderLibraryStats loadStats;
+
+    static std::vector<uint32_t> readWords(const std::string& path, size_t& byteCount) {
+        std::ifstream file(path, std::ios::ate | std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Failed to open shader file " + path + "!");
+        }
+        byteCount = static_cast<size_t>(file.tellg());
+        std::vector<uint32_t> words((byteCount + 3) / 4);
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(words.data()), byteCount);
+        return words;
+    }
+
+    static void validate(const std::string& path, const uint32_t* code, size_t byteCount) {
+        if (byteCount % 4 != 0 || byteCount < SPIRV_HEADER_WORDS * 4) {
+            throw std::runtime_error("Shader file " + path + " is not SPIR-V, it is too short or not a whole number of words!");
+        }
+        uint32_t magic;
+        memcpy(&magic, code, sizeof(magic));
+        if (magic == ((SPIRV_MAGIC >> 24) | ((SPIRV_MAGIC >> 8) & 0xFF00) | ((SPIRV_MAGIC << 8) & 0xFF0000) | (SPIRV_MAGIC << 24))) {
+            throw std::runtime_error("Shader file " + path + " is SPIR-V of the wrong endianness!");
+        }
+        if (magic != SPIRV_MAGIC) {
+            throw std::runtime_error("Shader file " + path + " is not SPIR-V, run compile.bat!");
+        }
+    }
+
+    // FNV-1a over the words, seeded with the size so a prefix of another shader gets a different hash.
+    static uint64_t hash(const uint32_t* code, size_t byteCount) {
+        uint64_t value = 14695981039346656037ULL ^ byteCount;
+        for (size_t i = 0; i < byteCount / 4; i++) {
+            value ^= code[i];
+            value *= 1099511628211ULL;
+        }
+        return value;
+    }
+};
@@ -0,0 +1,406 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Work-stealing task scheduler. A frame is described as a graph of tasks with dependencies. Every thread owns a deque,
+// pushes the tasks it makes ready onto the back and pops from the back (the data is still in its cache), idle threads
+// steal from the front of the other deques. The thread calling run() works along and is the only one that executes
+// MainThread tasks, for everything that has to stay on the main thread (GLFW).
+// The graph is built once and run every frame, a frame builds no std::function and copies no task name.
+
+enum class TaskAffinity {
+    Any,
+    MainThread
+};
+
+struct TaskTiming {
+    std::string name;
+    double startMs; // relative to the start of run()
+    double durationMs;
+    uint32_t thread; // worker index, workerCount() for the main thread
+};
+
+class TaskScheduler {
+public:
+    using TaskId = uint32_t;
+    using Clock = std::chrono::steady_clock;
+
+    TaskScheduler() {
+        start(0);
+    }
+
+    ~TaskScheduler() {
+        stop();
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    // Only call between run()s.
+    void resize(uint32_t workerCount) {
+        if (workerCount == workerThreadCount) return;
+        stop();
+        start(workerCount);
+    }
+
+    uint32_t workerCount() const {
+        return workerThreadCount;
+    }
+
+    // Dependencies have to be added before the tasks that depend on them, which also keeps the graph free of cycles.
+    // Only call between run()s, the tasks stay in the graph until clear().
+    TaskId addTask(std::string name, std::function<void()> work, std::initializer_list<TaskId> dependencies = {}, TaskAffinity affinity = TaskAffinity::Any) {
+        TaskId id = static_cast<TaskId>(tasks.size());
+        auto task = std::make_unique<Task>();
+        task->name = std::move(name);
+        task->work = std::move(work);
+        task->affinity = affinity;
+        task->dependencies = dependencies;
+        for (TaskId dependency : dependencies) {
+            if (dependency >= id) {
+                throw std::runtime_error("Task dependency has to be added before the task depending on it!");
+            }
+            tasks[dependency]->successors.push_back(id);
+        }
+        tasks.push_back(std::move(task));
+        return id;
+    }
+
+    // Removes every task, for building a different graph. Only call between run()s.
+    void clear() {
+        tasks.clear();
+        lastTimings.clear();
+    }
+
+    uint32_t taskCount() const {
+        return static_cast<uint32_t>(tasks.size());
+    }
+
+    const std::string& taskName(TaskId id) const {
+        return tasks[id]->name;
+    }
+
+    // Runs all tasks of the graph and blocks until they are done. Rethrows the first exception a task threw, tasks that
+    // would have run after it are skipped.
+    void run() {
+        runStart = Clock::now();
+        remainingTasks = static_cast<uint32_t>(tasks.size());
+        failed = false;
+        firstError = nullptr;
+        for (auto& task : tasks) {
+            task->pendingDependencies = static_cast<uint32_t>(task->dependencies.size());
+        }
+
+        int previousQueue = currentQueue();
+        currentQueue() = static_cast<int>(mainQueueIndex());
+        for (auto& task : tasks) {
+            if (task->dependencies.empty()) {
+                schedule(task.get());
+            }
+        }
+        helpUntil([this] { return remainingTasks.load() == 0; });
+        currentQueue() = previousQueue;
+
+        collectTimings();
+        if (firstError) {
+            std::rethrow_exception(firstError);
+        }
+    }
+
+    // Runs body(0) ... body(count - 1), possibly in parallel, and helps until all are done. Can be called from inside a task.
+    // body is called through a plain function pointer, no std::function is built per call.
+    template <typename Body>
+    void parallelFor(uint32_t count, const Body& body) {
+        if (count == 0) return;
+        if (count == 1 || workerThreadCount == 0) {
+            for (uint32_t i = 0; i < count; i++) {
+                body(i);
+            }
+            return;
+        }
+
+        ParallelFor loop{ [](const void* context, uint32_t index) { (*static_cast<const Body*>(context))(index); }, &body, { count }, nullptr, {} };
+        for (uint32_t i = 1; i < count; i++) {
+            push({ nullptr, &loop, i }, false);
+        }
+        execute({ nullptr, &loop, 0 }); // the calling thread takes the first one itself
+        helpUntil([&loop] { return loop.remaining.load() == 0; });
+        if (loop.error) {
+            std::rethrow_exception(loop.error);
+        }
+    }
+
+    // Timings of the tasks of the last run(), in the order they were added.
+    const std::vector<TaskTiming>& timings() const {
+        return lastTimings;
+    }
+
+    // Longest chain of dependent tasks in the last run(). No matter how many threads there are, the frame can not get faster than this.
+    double criticalPathMs() const {
+        return lastCriticalPathMs;
+    }
+
+private:
+    struct Task {
+        std::string name;
+        std::function<void()> work;
+        TaskAffinity affinity = TaskAffinity::Any;
+        std::vector<TaskId> dependencies;
+        std::vector<TaskId> successors;
+        std::atomic<uint32_t> pendingDependencies{ 0 };
+        Clock::time_point start;
+        Clock::time_point end;
+        uint32_t thread = 0;
+    };
+
+    struct ParallelFor {
+        void (*invoke)(const void* body, uint32_t index);
+        const void* body;
+        std::atomic<uint32_t> remaining;
+        std::exception_ptr error;
+        std::mutex errorMutex;
+    };
+
+    // Either a graph task or one index of a parallelFor.
+    struct WorkItem {
+        Task* task;
+        ParallelFor* loop;
+        uint32_t index;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<WorkItem> items;
+    };
+
+    std::vector<std::thread> workers;
+    uint32_t workerThreadCount = 0; // set before the workers start, so they never look at the vector while it grows
+    std::vector<std::unique_ptr<WorkQueue>> queues; // one per worker + one for the main thread (last)
+    WorkQueue mainThreadQueue; // MainThread tasks, first in first out
+    std::atomic<uint32_t> stealableItems{ 0 };
+    std::atomic<uint32_t> mainThreadItems{ 0 };
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    std::vector<std::unique_ptr<Task>> tasks;
+    std::atomic<uint32_t> remainingTasks{ 0 };
+    std::atomic<bool> failed{ false };
+    std::exception_ptr firstError;
+    std::mutex errorMutex;
+    Clock::time_point runStart;
+    std::vector<TaskTiming> lastTimings;
+    std::vector<double> finishMs; // per task: length of the longest chain ending with it
+    double lastCriticalPathMs = 0.0;
+
+    static int& currentQueue() {
+        static thread_local int queueIndex = -1; // -1 for threads that are neither a worker nor inside run()
+        return queueIndex;
+    }
+
+    uint32_t mainQueueIndex() const {
+        return workerThreadCount;
+    }
+
+    bool isMainThread() const {
+        return currentQueue() < 0 || currentQueue() == static_cast<int>(mainQueueIndex());
+    }
+
+    void start(uint32_t workerCount) {
+        stopping = false;
+        workerThreadCount = workerCount;
+        queues.clear();
+        for (uint32_t i = 0; i <= workerCount; i++) {
+            queues.push_back(std::make_unique<WorkQueue>());
+        }
+        for (uint32_t i = 0; i < workerCount; i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        workerThreadCount = 0;
+    }
+
+    // Taking the lock before notifying makes sure a thread that just checked its wait condition is really waiting and gets the wakeup.
+    void notifyAll() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+    }
+
+    void push(WorkItem item, bool mainThreadOnly) {
+        if (mainThreadOnly) {
+            std::lock_guard<std::mutex> lock(mainThreadQueue.mutex);
+            mainThreadQueue.items.push_back(item);
+            mainThreadItems++;
+        }
+        else {
+            WorkQueue& queue = *queues[currentQueue() < 0 ? mainQueueIndex() : static_cast<uint32_t>(currentQueue())];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.items.push_back(item);
+            stealableItems++;
+        }
+        notifyAll();
+    }
+
+    void schedule(Task* task) {
+        push({ task, nullptr, 0 }, task->affinity == TaskAffinity::MainThread);
+    }
+
+    bool tryPop(WorkItem& item) {
+        if (isMainThread() && mainThreadItems.load() > 0) {
+            std::lock_guard<std::mutex> lock(mainThreadQueue.mutex);
+            if (!mainThreadQueue.items.empty()) {
+                item = mainThreadQueue.items.front();
+                mainThreadQueue.items.pop_front();
+                mainThreadItems--;
+                return true;
+            }
+        }
+        if (stealableItems.load() == 0) return false;
+
+        uint32_t ownIndex = currentQueue() < 0 ? mainQueueIndex() : static_cast<uint32_t>(currentQueue());
+        {
+            WorkQueue& own = *queues[ownIndex];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.items.empty()) {
+                item = own.items.back();
+                own.items.pop_back();
+                stealableItems--;
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); offset++) {
+            WorkQueue& victim = *queues[(ownIndex + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.items.empty()) {
+                item = victim.items.front(); // the oldest item, likely the biggest chunk of remaining work
+                victim.items.pop_front();
+                stealableItems--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(const WorkItem& item) {
+        if (item.loop != nullptr) {
+            try {
+                item.loop->invoke(item.loop->body, item.index);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(item.loop->errorMutex);
+                if (!item.loop->error) {
+                    item.loop->error = std::current_exception();
+                }
+            }
+            if (--item.loop->remaining == 0) {
+                notifyAll();
+            }
+            return;
+        }
+
+        Task& task = *item.task;
+        task.thread = currentQueue() < 0 ? mainQueueIndex() : static_cast<uint32_t>(currentQueue());
+        task.start = Clock::now();
+        if (!failed) {
+            try {
+                task.work();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!firstError) {
+                    firstError = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+        task.end = Clock::now();
+
+        // successors are scheduled before this task counts as done, so run() can not return while they are still missing
+        for (TaskId successor : task.successors) {
+            if (--tasks[successor]->pendingDependencies == 0) {
+                schedule(tasks[successor].get());
+            }
+        }
+        if (--remainingTasks == 0) {
+            notifyAll();
+        }
+    }
+
+    template <typename Predicate>
+    void helpUntil(Predicate done) {
+        WorkItem item;
+        while (!done()) {
+            if (tryPop(item)) {
+                execute(item);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [&] { return done() || stealableItems.load() > 0 || (isMainThread() && mainThreadItems.load() > 0); });
+        }
+    }
+
+    void workerLoop(uint32_t workerIndex) {
+        currentQueue() = static_cast<int>(workerIndex);
+        WorkItem item;
+        while (true) {
+            if (tryPop(item)) {
+                execute(item);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || stealableItems.load() > 0; });
+            if (stopping) return;
+        }
+    }
+
+    void collectTimings() {
+        if (lastTimings.size() != tasks.size()) { // the names only have to be copied once per graph
+            lastTimings.clear();
+            for (const auto& task : tasks) {
+                lastTimings.push_back({ task->name, 0.0, 0.0, 0 });
+            }
+            finishMs.assign(tasks.size(), 0.0);
+        }
+        lastCriticalPathMs = 0.0;
+        for (size_t i = 0; i < tasks.size(); i++) {
+            const Task& task = *tasks[i];
+            double durationMs = std::chrono::duration<double, std::milli>(task.end - task.start).count();
+            lastTimings[i].startMs = std::chrono::duration<double, std::milli>(task.start - runStart).count();
+            lastTimings[i].durationMs = durationMs;
+            lastTimings[i].thread = task.thread;
+
+            double longestDependencyMs = 0.0;
+            for (TaskId dependency : task.dependencies) {
+                longestDependencyMs = std::max(longestDependencyMs, finishMs[dependency]);
+            }
+            finishMs[i] = longestDependencyMs + durationMs;
+            lastCriticalPathMs = std::max(lastCriticalPathMs, finishMs[i]);
+        }
+    }
+};
@@ -0,0 +1,164 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Queue synchronization with one timeline semaphore per queue (VK_KHR_timeline_semaphore, core in Vulkan 1.2). Every
+// submit to a queue signals the next value of its timeline, so "is this work done" is a comparison against a counter:
+// no fence per frame that has to be reset, and another queue waits for a value instead of a binary semaphore that has
+// to be signaled and consumed exactly once.
+
+// The instance is Vulkan 1.0, so the extension's entry points come from vkGetDeviceProcAddr.
+struct TimelineFunctions {
+    PFN_vkWaitSemaphoresKHR waitSemaphores = nullptr;
+    PFN_vkGetSemaphoreCounterValueKHR getSemaphoreCounterValue = nullptr;
+
+    void load(VkDevice device) {
+        waitSemaphores = (PFN_vkWaitSemaphoresKHR)vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+        getSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
+        if (waitSemaphores == nullptr || getSemaphoreCounterValue == nullptr) {
+            throw std::runtime_error("Timeline semaphore functions are missing, is VK_KHR_timeline_semaphore enabled?");
+        }
+    }
+};
+
+// The timeline of one queue. Values start at 1 with the first submit, 0 is always complete, so 0 works as "never used".
+// Thread safe as long as the submits themselves are ordered, several tasks may ask whether a value is complete.
+class QueueTimeline {
+public:
+    void init(VkDevice device, const TimelineFunctions& functions) {
+        this->device = device;
+        this->functions = functions;
+
+        VkSemaphoreTypeCreateInfo typeInfo{};
+        typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+        typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+        typeInfo.initialValue = 0;
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        semaphoreInfo.pNext = &typeInfo;
+        if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &timelineSemaphore) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create timeline semaphore!");
+        }
+        submitted = 0;
+        completed = 0;
+    }
+
+    // The value the next submit to the queue signals. Values have to reach the queue in increasing order, so only
+    // commitSubmitted() moves on to the next one: if vkQueueSubmit fails, nothing waits for a value that never comes.
+    uint64_t peekNextValue() const {
+        return submitted + 1;
+    }
+
+    // Call once the vkQueueSubmit signaling peekNextValue() succeeded.
+    void commitSubmitted(uint64_t value) {
+        submitted = value;
+    }
+
+    // Everything submitted so far is done once this value is reached.
+    uint64_t lastSubmittedValue() const {
+        return submitted;
+    }
+
+    // Never blocks.
+    bool isComplete(uint64_t value) {
+        if (value <= completed) return true;
+        uint64_t current = 0;
+        if (functions.getSemaphoreCounterValue(device, timelineSemaphore, &current) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to read timeline semaphore value!");
+        }
+        raiseCompleted(current);
+        return value <= current;
+    }
+
+    void wait(uint64_t value) {
+        if (isComplete(value)) return;
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &timelineSemaphore;
+        waitInfo.pValues = &value;
+        if (functions.waitSemaphores(device, &waitInfo, UINT64_MAX) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to wait for timeline semaphore!");
+        }
+        raiseCompleted(value);
+    }
+
+    void waitIdle() {
+        wait(submitted);
+    }
+
+    VkSemaphore semaphore() const {
+        return timelineSemaphore;
+    }
+
+    void destroy() {
+        if (timelineSemaphore != VK_NULL_HANDLE) {
+            vkDestroySemaphore(device, timelineSemaphore, nullptr);
+            timelineSemaphore = VK_NULL_HANDLE;
+        }
+    }
+
+private:
+    VkDevice device = VK_NULL_HANDLE;
+    TimelineFunctions functions;
+    VkSemaphore timelineSemaphore = VK_NULL_HANDLE;
+    std::atomic<uint64_t> submitted{ 0 };
+    std::atomic<uint64_t> completed{ 0 }; // last value we saw the GPU reach, saves asking the driver again
+
+    void raiseCompleted(uint64_t value) {
+        uint64_t known = completed.load();
+        while (known < value && !completed.compare_exchange_weak(known, value)) {
+        }
+    }
+};
+
+// The semaphores of one vkQueueSubmit. Timeline semaphores wait for and signal a value, binary ones (swap chain acquire
+// and present) get 0, which the driver ignores. Keep it alive and unchanged until vkQueueSubmit returned.
+class SubmitSync {
+public:
+    void wait(VkSemaphore semaphore, VkPipelineStageFlags stage, uint64_t value = 0) {
+        auto existing = std::find(waitSemaphores.begin(), waitSemaphores.end(), semaphore);
+        if (existing != waitSemaphores.end()) { // one wait per semaphore, for the highest value and at the earliest stage
+            size_t index = existing - waitSemaphores.begin();
+            waitValues[index] = std::max(waitValues[index], value);
+            waitStages[index] |= stage;
+            return;
+        }
+        waitSemaphores.push_back(semaphore);
+        waitStages.push_back(stage);
+        waitValues.push_back(value);
+    }
+
+    void signal(VkSemaphore semaphore, uint64_t value = 0) {
+        signalSemaphores.push_back(semaphore);
+        signalValues.push_back(value);
+    }
+
+    void apply(VkSubmitInfo& submitInfo) {
+        timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+        timelineInfo.pWaitSemaphoreValues = waitValues.data();
+        timelineInfo.signalSemaphoreValueCount = static_cast<uint32_t>(signalValues.size());
+        timelineInfo.pSignalSemaphoreValues = signalValues.data();
+
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+        submitInfo.pWaitSemaphores = waitSemaphores.data();
+        submitInfo.pWaitDstStageMask = waitStages.data();
+        submitInfo.signalSemaphoreCount = static_cast<uint32_t>(signalSemaphores.size());
+        submitInfo.pSignalSemaphores = signalSemaphores.data();
+    }
+
+private:
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<VkPipelineStageFlags> waitStages;
+    std::vector<uint64_t> waitValues;
+    std::vector<VkSemaphore> signalSemaphores;
+    std::vector<uint64_t> signalValues;
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+};
@@ -0,0 +1,17 @@
+@echo off
+rem golden.sh for Windows. Needs lavapipe from a Mesa build, registered as a Vulkan driver (e.g. through VK_DRIVER_FILES).
+rem The first run captures golden\lavapipe.ppm, every later run compares the last frame against it. Goldens are per machine.
+rem Usage: golden.bat path\to\VulkanTutorialFirstTriangle.exe [more options]
+set APP=%~f1
+set ARGS=
+:args
+shift
+if "%~1"=="" goto run
+set ARGS=%ARGS% %1
+goto args
+:run
+cd /d "%~dp0"
+if not exist golden mkdir golden
+set MODE=--golden-compare
+if not exist golden\lavapipe.ppm set MODE=--golden-capture
+"%APP%" --device llvmpipe %MODE% golden\lavapipe.ppm --report-file golden\report.json%ARGS%
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Golden image check on lavapipe (Mesa's CPU Vulkan driver), so it runs without a GPU.
+# The first run captures golden/lavapipe.ppm, every later run compares the last frame against it.
+# Goldens are made per machine and not committed: another Mesa version may round a few pixels differently.
+# On a mismatch the actual frame and a diff image are written next to the golden image and the script fails.
+# Usage: golden.sh path/to/VulkanTutorialFirstTriangle [more options, e.g. --culling gpu]
+set -e
+[ $# -ge 1 ] || { echo "usage: $0 path/to/VulkanTutorialFirstTriangle [options]" >&2; exit 1; }
+APP="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+shift
+cd "$(dirname "$0")" # the app loads shaders/*.spv relative to the working directory
+mkdir -p golden
+MODE=--golden-compare
+[ -f golden/lavapipe.ppm ] || MODE=--golden-capture
+exec "$APP" --device llvmpipe $MODE golden/lavapipe.ppm --report-file golden/report.json "$@"
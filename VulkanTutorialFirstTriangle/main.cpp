@@ -5,19 +5,46 @@
 #include <stdexcept>
 #include <cstdlib>
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <cstddef>
+#include <cmath>
 #include <cstring>
+#include <cstdio>
 #include <optional>
 #include <set>
+#include <map>
+#include <memory>
 #include <fstream>
+#include <limits>
+#include <functional>
+#include <deque>
+#include <string>
+#include <thread>
+
+#include "Benchmark.h"
+#include "CullingKernels.h"
+#include "Descriptors.h"
+#include "DeviceSelection.h"
+#include "FrameReadback.h"
+#include "FrameEncoder.h"
+#include "ImageCompare.h"
+#include "MemoryAllocator.h"
+#include "PipelineVariants.h"
+#include "RenderGraph.h"
+#include "ShaderLibrary.h"
+#include "TaskScheduler.h"
+#include "TimelineSync.h"
 
 
 struct QueueFamilyIndices {
     std::optional<uint32_t> graphicsFamily;
     std::optional<uint32_t> presentationFamily;
+    std::optional<uint32_t> transferFamily; // a family without graphics whose copies run next to rendering, empty = copy on the graphics queue
 
-    bool isComplete() {
-        return graphicsFamily.has_value() && presentationFamily.has_value();
+    bool isComplete(bool needsPresentation = true) {
+        // Headless rendering never presents, so a graphics queue is all we need there.
+        return graphicsFamily.has_value() && (presentationFamily.has_value() || !needsPresentation);
     }
 };
 
@@ -27,37 +54,404 @@ struct SwapChainSupportDetails {
     std::vector<VkPresentModeKHR> presentModes;
 };
 
+struct Vertex {
+    float position[2];
+    float color[3];
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 0;
+        bindingDescription.stride = sizeof(Vertex);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX; // move to the next entry after each vertex (not after each instance)
+        return bindingDescription;
+    }
+
+    static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+        attributeDescriptions[0].binding = 0;
+        attributeDescriptions[0].location = 0; // layout(location = 0) in the vertex shader
+        attributeDescriptions[0].format = VK_FORMAT_R32G32_SFLOAT; // vec2
+        attributeDescriptions[0].offset = offsetof(Vertex, position);
+
+        attributeDescriptions[1].binding = 0;
+        attributeDescriptions[1].location = 1;
+        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT; // vec3
+        attributeDescriptions[1].offset = offsetof(Vertex, color);
+        return attributeDescriptions;
+    }
+};
+
+// The triangle the vertex shader used to hard-code. With an index buffer, vertices shared by several triangles are stored (and shaded) only once.
+const std::vector<Vertex> vertices = {
+    {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+    {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+    {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}}
+};
+
+const std::vector<uint16_t> indices = {
+    0, 1, 2
+};
+
+// Per-instance attributes, read from binding 1 once per instance instead of once per vertex.
+struct InstanceData {
+    float transform[4]; // xy offset, z scale, w rotation in radians
+    float color[3]; // multiplied with the vertex color
+
+    static VkVertexInputBindingDescription getBindingDescription() {
+        VkVertexInputBindingDescription bindingDescription{};
+        bindingDescription.binding = 1;
+        bindingDescription.stride = sizeof(InstanceData);
+        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+        return bindingDescription;
+    }
+
+    static std::array<VkVertexInputAttributeDescription, 2> getAttributeDescriptions() {
+        std::array<VkVertexInputAttributeDescription, 2> attributeDescriptions{};
+        attributeDescriptions[0].binding = 1;
+        attributeDescriptions[0].location = 2; // 0 and 1 are taken by Vertex
+        attributeDescriptions[0].format = VK_FORMAT_R32G32B32A32_SFLOAT; // vec4
+        attributeDescriptions[0].offset = offsetof(InstanceData, transform);
+
+        attributeDescriptions[1].binding = 1;
+        attributeDescriptions[1].location = 3;
+        attributeDescriptions[1].format = VK_FORMAT_R32G32B32_SFLOAT; // vec3
+        attributeDescriptions[1].offset = offsetof(InstanceData, color);
+        return attributeDescriptions;
+    }
+};
+
+// What gets drawn every frame: one copy of the mesh per instance, all of them in a single draw call.
+// Stored as structure of arrays, so the culling and transform kernels stream through just the fields they need, several
+// instances per SIMD instruction. The instance buffers get the InstanceData layout the vertex input wants from pack().
+// Every change bumps the version, so an unchanged scene is not copied into the instance buffers again.
+struct Scene {
+    AlignedVector<float> positionX; // also the bounding circle centers
+    AlignedVector<float> positionY;
+    AlignedVector<float> scale;
+    AlignedVector<float> rotation; // radians
+    AlignedVector<float> boundingRadius; // meshRadius * scale
+    AlignedVector<float> colorR;
+    AlignedVector<float> colorG;
+    AlignedVector<float> colorB;
+    float meshRadius = 1.0f; // bounding circle of the mesh at scale 1, set before submitting
+    uint64_t version = 0;
+
+    size_t size() const {
+        return positionX.size();
+    }
+
+    void clear() {
+        for (AlignedVector<float>* array : arrays()) {
+            array->clear();
+        }
+        version++;
+    }
+
+    void submit(const InstanceData& instance) {
+        append(instance);
+        version++;
+    }
+
+    void submit(const InstanceData* data, size_t count) {
+        for (AlignedVector<float>* array : arrays()) {
+            array->reserve(array->size() + count);
+        }
+        for (size_t i = 0; i < count; i++) {
+            append(data[i]);
+        }
+        version++;
+    }
+
+    // Writes instances [first, first + count) to out in the vertex buffer layout.
+    void pack(size_t first, size_t count, InstanceData* out) const {
+        for (size_t i = first; i < first + count; i++) {
+            *out++ = instance(i);
+        }
+    }
+
+    // Same for a list of instances, e.g. the ones that survived culling.
+    void pack(const uint32_t* indices, size_t count, InstanceData* out) const {
+        for (size_t i = 0; i < count; i++) {
+            *out++ = instance(indices[i]);
+        }
+    }
+
+    InstanceData instance(size_t i) const {
+        return { { positionX[i], positionY[i], scale[i], rotation[i] }, { colorR[i], colorG[i], colorB[i] } };
+    }
+
+    // Call after changing instances in place.
+    void markChanged() {
+        version++;
+    }
+
+private:
+    std::array<AlignedVector<float>*, 8> arrays() {
+        return { &positionX, &positionY, &scale, &rotation, &boundingRadius, &colorR, &colorG, &colorB };
+    }
+
+    void append(const InstanceData& instance) {
+        positionX.push_back(instance.transform[0]);
+        positionY.push_back(instance.transform[1]);
+        scale.push_back(instance.transform[2]);
+        rotation.push_back(instance.transform[3]);
+        boundingRadius.push_back(meshRadius * instance.transform[2]);
+        colorR.push_back(instance.color[0]);
+        colorG.push_back(instance.color[1]);
+        colorB.push_back(instance.color[2]);
+    }
+};
+
+// Radius of the circle around the origin that contains the whole mesh, instances rotate around the origin.
+float boundingRadius(const std::vector<Vertex>& mesh) {
+    float radius = 0.0f;
+    for (const Vertex& vertex : mesh) {
+        radius = std::max(radius, std::sqrt(vertex.position[0] * vertex.position[0] + vertex.position[1] * vertex.position[1]));
+    }
+    return radius;
+}
+
+// Lays out count instances on a square grid covering the screen. A single instance is the plain, untinted triangle.
+// With a worldSize above 1 the grid goes past the screen edges, only about 1 / worldSize^2 of the instances are visible.
+void fillInstanceGrid(Scene& scene, uint32_t count, float worldSize = 1.0f) {
+    scene.clear();
+    uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(count))));
+    float cellSize = 2.0f * worldSize / side; // clip space goes from -1 to 1
+    std::vector<InstanceData> grid;
+    grid.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t x = i % side;
+        uint32_t y = i / side;
+        float u = side > 1 ? static_cast<float>(x) / (side - 1) : 1.0f;
+        float v = side > 1 ? static_cast<float>(y) / (side - 1) : 1.0f;
+        InstanceData instance{};
+        instance.transform[0] = -worldSize + cellSize * (x + 0.5f);
+        instance.transform[1] = -worldSize + cellSize * (y + 0.5f);
+        instance.transform[2] = cellSize * 0.5f; // the triangle is one unit wide, so this leaves a gap between the cells
+        instance.transform[3] = 0.0f;
+        instance.color[0] = 1.0f;
+        instance.color[1] = u;
+        instance.color[2] = v;
+        grid.push_back(instance);
+    }
+    scene.submit(grid.data(), grid.size());
+}
+
+// Instance counts of the --instance-sweep benchmark, one pass each.
+const std::vector<uint32_t> instanceSweepCounts = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation",
 
 };
 
 std::vector<const char*> requiredDeviceExtensions = {
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME, // dedicated allocations for render targets, see MemoryAllocator.h
+    VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME,
+    VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, // frame and queue synchronization, see TimelineSync.h
     #ifdef __APPLE__
     VK_KHR_PORTABILITY_SUBSET_EXTENSION_NAME,
     #endif
 };
 
+// Only needed when we present to a window. Headless rendering leaves these out so software ICDs without a WSI work too.
+const std::vector<const char*> presentationDeviceExtensions = {
+    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+};
+
+enum class RecordMode {
+    Dynamic,     // reset and re-record the frame's command buffer every frame
+    Prerecorded, // one command buffer per framebuffer, recorded once and only re-recorded when it got dirty
+};
+
+enum class CullMode {
+    None, // draw every instance
+    Cpu,  // SIMD kernels drop the instances outside the screen before they are copied into the instance buffer
+    Gpu,  // a compute shader drops the instances outside the screen and writes the indirect draws
+};
+
+static const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+static const uint32_t MAX_SUPPORTED_FRAMES_IN_FLIGHT = 8;
+static const uint32_t DEFAULT_SWAPCHAIN_IMAGE_COUNT = 3; // for Triple Buffering we need at least 3 images ^^
+static const uint32_t MAX_SUPPORTED_SWAPCHAIN_IMAGES = 16; // prerecorded frames use one frame slot per image, the uniform ring has room for this many
+
+VkPresentModeKHR parsePresentMode(const std::string& name) {
+    if (name == "immediate") return VK_PRESENT_MODE_IMMEDIATE_KHR;
+    if (name == "mailbox") return VK_PRESENT_MODE_MAILBOX_KHR;
+    if (name == "fifo") return VK_PRESENT_MODE_FIFO_KHR;
+    if (name == "fifo_relaxed") return VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+    throw std::runtime_error("Unknown present mode: " + name + " (expected immediate, mailbox, fifo or fifo_relaxed)");
+}
+
+std::string presentModeName(VkPresentModeKHR presentMode) {
+    switch (presentMode) {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+    case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo_relaxed";
+    default: return "unknown";
+    }
+}
+
+enum class GoldenMode {
+    None,
+    Capture, // write the last frame as the new golden image
+    Compare  // fail the run if the last frame differs from the golden image
+};
+
+struct AppConfig {
+    bool headless = false;  // render into our own VkImages instead of a GLFW window + swap chain
+    uint32_t frameCount = 0; // stop after this many frames, 0 means run until the window is closed
+    uint32_t benchmarkFrames = 0; // > 0 enables the benchmark: run warmupFrames + benchmarkFrames frames and report the timings
+    uint32_t warmupFrames = 0;
+    ReportFormat reportFormat = ReportFormat::Json;
+    std::string reportPath; // empty means stdout
+    bool startupReport = false; // report how long initialization took, even without --bench
+    std::string pipelineCachePath = "pipeline_cache.bin"; // empty disables the on-disk pipeline cache
+    RecordMode recordMode = RecordMode::Dynamic;
+    bool compareRecordModes = false; // benchmark the dynamic and the prerecorded path one after the other
+    uint32_t framesInFlight = 0; // 0 = DEFAULT_FRAMES_IN_FLIGHT (or 1 in low latency mode)
+    uint32_t swapchainImageCount = 0; // 0 = DEFAULT_SWAPCHAIN_IMAGE_COUNT (or as few as possible in low latency mode)
+    std::optional<VkPresentModeKHR> presentMode; // empty = mailbox if available, else fifo
+    bool lowLatency = false; // shallow queue, input is sampled after waiting for the frame
+    uint32_t instanceCount = 1; // triangles drawn with one instanced draw call
+    bool instanceSweep = false; // benchmark every count in instanceSweepCounts
+    uint32_t drawCount = 1; // the instances are split into this many draw calls, the draw list the recording threads share
+    uint32_t recordThreads = 0; // 0 = record inline, otherwise the draw list is recorded into this many secondary command buffers in parallel
+    bool threadSweep = false; // benchmark recording with 0, 1, 2, 4, ... threads up to the core count
+    uint32_t workerThreads = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0; // the main thread works along
+    bool animate = false; // rotate every instance each frame, gives the scene update task something to do
+    float worldSize = 1.0f; // the instance grid spans worldSize x worldSize screens
+    CullMode cullMode = CullMode::None;
+    bool compareCullModes = false; // benchmark drawing everything, CPU and GPU culling one after the other
+    std::optional<SimdLevel> simdLevel; // empty = the best the CPU supports
+    bool cullMicrobenchmark = false; // only run the culling kernel microbenchmark, no window or device needed
+    bool transferQueue = true; // upload on a dedicated transfer (or compute) queue if the device has one
+    uint32_t streamMegabytes = 0; // streamed through the transfer queue every frame to measure upload throughput
+    float zoom = 1.0f; // > 1 magnifies, < 1 shows more of the world
+    bool cameraPan = false; // move the camera in a circle over the instance grid, per-frame data for the uniform ring
+    bool shadeDraws = false; // tint every draw call differently through push constants, shows how the draw list is split
+    PipelineVariantKey pipelineVariant; // blend, face culling, sample count and shader features of the pipeline to draw with
+    bool depth = true; // transient depth attachment, tested with LESS_OR_EQUAL so flat scenes still draw in submission order
+    bool msaaSweep = false; // benchmark every sample count the device supports, one pass each
+    bool variantSweep = false; // switch to another pipeline variant every VARIANT_SWEEP_INTERVAL frames, compiled in the background
+    std::string deviceSelector; // index, UUID or part of the name of the GPU to use, empty = the suitable one with the best score
+    bool listDevices = false; // print every device with its score and exit
+    bool deviceSweep = false; // run once on every suitable device, one report each
+    GoldenMode goldenMode = GoldenMode::None;
+    std::string goldenPath; // PPM file of the golden image
+    uint32_t goldenTolerance = 2; // per channel, rasterizers may round differently after a harmless change
+    double goldenMaxMismatchPercent = 0.0; // of the pixels allowed to be off by more than goldenTolerance
+    bool readback = false; // copy every frame into host memory on the GPU timeline, a background thread consumes it
+    std::string readbackPath; // frames are streamed into this file or named pipe, "-" is stdout, empty = only read the pixels
+    std::optional<FrameOutputFormat> readbackFormat; // empty = from the file extension
+    uint32_t readbackFps = 60; // frame rate in the Y4M header
+    float fixedTimestep = 0.0f; // > 0: the scene advances by this many seconds per frame instead of the measured time, the same frames every run
+};
+
+inline const char* cullModeName(CullMode mode) {
+    switch (mode) {
+    case CullMode::Cpu: return "cpu";
+    case CullMode::Gpu: return "gpu";
+    default: return "none";
+    }
+}
+
+// Prints the report to stdout or writes it to --report-file.
+void writeReport(const BenchmarkReport& report, const AppConfig& config) {
+    if (config.reportPath.empty()) {
+        report.write(std::cout, config.reportFormat);
+        return;
+    }
+    std::ofstream file(config.reportPath);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open benchmark report file: " + config.reportPath);
+    }
+    report.write(file, config.reportFormat);
+}
+
+// One benchmark run can consist of several passes, setup() switches the renderer into the configuration to measure.
+struct BenchmarkPass {
+    std::string name;
+    std::function<void()> setup;
+};
+
+// Every combination of an outer and an inner pass, e.g. each record mode with each instance count. Names become "<outer>.<inner>".
+std::vector<BenchmarkPass> combinePasses(const std::vector<BenchmarkPass>& outer, const std::vector<BenchmarkPass>& inner) {
+    std::vector<BenchmarkPass> combined;
+    for (const BenchmarkPass& outerPass : outer) {
+        for (const BenchmarkPass& innerPass : inner) {
+            std::string name = outerPass.name.empty() ? innerPass.name : outerPass.name + "." + innerPass.name;
+            std::function<void()> outerSetup = outerPass.setup;
+            std::function<void()> innerSetup = innerPass.setup;
+            combined.push_back({ name, [outerSetup, innerSetup] {
+                if (outerSetup) outerSetup();
+                if (innerSetup) innerSetup();
+            } });
+        }
+    }
+    return combined;
+}
+
+static const uint32_t DEFAULT_HEADLESS_FRAME_COUNT = 1000; // headless has no window to close, so it needs a frame limit
+static const uint32_t DEFAULT_GOLDEN_FRAME_COUNT = 60; // enough for animation and camera to move, short enough for a software rasterizer
+
 
 class HelloTriangleApplication {
     
 public:
     static const uint32_t WIDTH = 800;
     static const uint32_t HEIGHT = 600;
-    static const int MAX_FRAMES_IN_FLIGHT = 2;
 
+    
     #ifdef NDEBUG
         static const bool enableValidationLayers = false;
     #else
         static const bool enableValidationLayers = true;
     #endif
+
+    explicit HelloTriangleApplication(const AppConfig& config) : config(config) {
+        // Low latency trades throughput for latency: with only one frame in flight the CPU never runs ahead of the GPU.
+        maxFramesInFlight = config.framesInFlight > 0 ? config.framesInFlight : (config.lowLatency ? 1 : DEFAULT_FRAMES_IN_FLIGHT);
+    }
     
+    // Creates an instance just to look at the devices, prints them with their scores if asked to. Headless suitability
+    // only, without a window there is no surface to check presentation against.
+    std::vector<PhysicalDeviceInfo> listDevices(bool print) {
+        config.headless = true;
+        createInstance();
+        std::vector<PhysicalDeviceInfo> devices = queryPhysicalDevices();
+        std::vector<PhysicalDeviceInfo> suitableDevices;
+        for (const PhysicalDeviceInfo& info : devices) {
+            bool suitable = isDeviceSuitable(info.device);
+            if (print) {
+                std::cout << info.index << ": " << describeDevice(info) << " score " << deviceScorer(info)
+                    << (info.uuid.empty() ? "" : " uuid " + info.uuid) << (suitable ? "" : " (not suitable)") << "\n";
+            }
+            if (suitable) {
+                suitableDevices.push_back(info);
+            }
+        }
+        vkDestroyInstance(instance, nullptr);
+        instance = VK_NULL_HANDLE;
+        return suitableDevices;
+    }
+
     void run() {
-        initWindow();
+        if (!config.headless) {
+            initWindow();
+        }
         initVulkan();
         mainLoop();
+        checkGoldenImage();
+        writeBenchmarkReport();
+        savePipelineCache();
         cleanup(); }
+
+    // False if the last frame did not match the golden image (only in GoldenMode::Compare).
+    bool passed() const {
+        return goldenPassed;
+    }
 private:
     static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(
         VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, //VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT | VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT
@@ -70,75 +464,359 @@ private:
         return VK_FALSE;    //Call the Vulkan call True or False!
     }
 
-    static std::vector<char> readFile(const std::string& filename) {
-        std::ifstream file(filename, std::ios::ate | std::ios::binary); //ate seeks to the end of the file. We do that so that we can query the filesize via the read position of the file.
-
-        if (!file.is_open()) {
-            throw std::runtime_error("Failed to open file to read!");
-        }
-
-        size_t fileSize = (size_t)file.tellg();
-        std::vector<char> buffer(fileSize);
-
-        file.seekg(0);
-        file.read(buffer.data(), fileSize);
-        file.close();
+    AppConfig config;
 
-        return buffer;
-    }
-
-    GLFWwindow* window;
+    GLFWwindow* window = nullptr;
     VkInstance instance;
     VkDebugUtilsMessengerEXT debugMessenger;
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+    PhysicalDeviceInfo physicalDeviceInfo; // what pickPhysicalDevice() chose and why
+    int64_t physicalDeviceScore = 0;
+    DeviceScorer deviceScorer = defaultDeviceScore;
+    bool deviceIdsSupported = false; // the instance can tell us device UUIDs
     VkDevice device;
+    MemoryAllocator allocator; // every buffer and image gets its memory from here
+    ShaderLibrary shaderLibrary; // every VkShaderModule, alive until cleanup so pipelines can be rebuilt without reading the files again
     VkQueue graphicsQueue;
     VkQueue presentationQueue;
 
-    VkSwapchainKHR swapChain;
-    std::vector<VkImage> swapChainImages;
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+    std::vector<VkImage> swapChainImages; // in headless mode these are our own offscreen images, so everything after createSwapChain() does not care
+    std::vector<Allocation> offscreenImageAllocations;
     VkFormat swapChainImageFormat;
     VkExtent2D swapChainExtent;
 
     std::vector<VkImageView> swapChainImageViews;
-    std::vector<VkFramebuffer> swapChainFramebuffers;
-    
-    VkRenderPass renderPass;
-    VkPipelineLayout pipelineLayout;
-    VkPipeline graphicsPipeline;
+
+    // The render pass, its framebuffers, the barriers around it and the attachments that only live inside it (the
+    // multisampled color image and depth, transient and never stored) all come from the frame graph, see buildFrameGraph().
+    RenderPassCache renderPassCache; // owns every render pass
+    std::shared_ptr<RenderGraph> frameGraph; // rebuilt when the swap chain, the sample count or the culling mode changes
+    RenderGraphResource swapChainTarget = 0; // the swap chain image in the frame graph, bound per frame
+    std::map<VkSampleCountFlagBits, VkRenderPass> renderPasses; // built before the pipeline compile threads start, they only read it
+    VkSampleCountFlagBits msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED; // UNDEFINED = no depth attachment
+    VkPipelineLayout pipelineLayout; // owned by descriptorLayoutCache
+    VkPipeline graphicsPipeline; // the variant the command buffers bind, owned by pipelineVariants
+
+    // Per-frame data reaches the shaders through a uniform ring: every frame slot writes its FrameUniforms to the start of
+    // its own region of one persistently mapped buffer and binds it with a dynamic offset. Since the frame uniforms are
+    // always pushed first, a slot's offset never changes and prerecorded command buffers stay valid.
+    struct FrameUniforms { // FrameUniforms in first_shader.vert and cull.comp, std140
+        float viewOffset[2]; // world position in the center of the screen
+        float viewScale; // world to clip space
+        float time; // seconds since startup
+    };
+    struct DrawPushConstants { // DrawParameters in first_shader.frag
+        float tint[4];
+    };
+    static constexpr VkDeviceSize UNIFORM_RING_BYTES_PER_FRAME = 16 * 1024;
+    static constexpr uint32_t UNIFORM_RING_FRAME_CAPACITY = std::max(MAX_SUPPORTED_SWAPCHAIN_IMAGES, MAX_SUPPORTED_FRAMES_IN_FLIGHT); // every possible frame slot
+    static constexpr float CAMERA_PAN_RADIANS_PER_SECOND = 0.25f;
+    DescriptorLayoutCache descriptorLayoutCache;
+    DescriptorAllocator descriptorAllocator;
+    UniformRing uniformRing;
+    VkBuffer uniformRingBuffer = VK_NULL_HANDLE;
+    Allocation uniformRingAllocation;
+    VkDescriptorSetLayout frameDescriptorSetLayout = VK_NULL_HANDLE;
+    VkDescriptorSet frameDescriptorSet = VK_NULL_HANDLE; // written once, every frame slot binds it with its own dynamic offset
+    std::vector<uint32_t> frameUniformOffsets; // by frame slot
+    float sceneSeconds = 0.0f;
+    float viewOffset[2] = { 0.0f, 0.0f };
+    uint64_t viewVersion = 0; // bumped whenever the camera moved
+
+    // Every graphics pipeline variant we drew with so far. A requested variant is compiled in the background, the frames keep
+    // drawing with boundPipelineVariant until it is done.
+    static constexpr uint32_t PIPELINE_COMPILE_THREAD_COUNT = 1;
+    static constexpr uint32_t VARIANT_SWEEP_INTERVAL = 60; // frames
+    PipelineVariants pipelineVariants;
+    PipelineVariantKey requestedPipelineVariant;
+    PipelineVariantKey boundPipelineVariant;
+    std::vector<PipelineVariantKey> variantSweepKeys;
+    size_t variantSweepIndex = 0;
+    uint32_t framesSinceVariantSwitch = 0;
+    VkPipelineCache pipelineCache = VK_NULL_HANDLE;
 
     VkCommandPool commandPool;
     std::vector<VkCommandBuffer> commandBuffers;
+
+    // Uploads go through a persistently mapped HOST_VISIBLE staging ring and are copied into DEVICE_LOCAL buffers on the transfer queue.
+    // The copies are submitted in batches, each signals the next value of the transfer timeline. Ring space is reused as soon as the batch using it is done,
+    // only when the ring is full do we wait for the oldest batch.
+    static constexpr VkDeviceSize DEFAULT_STAGING_RING_SIZE = 4 * 1024 * 1024;
+    static constexpr VkDeviceSize STAGING_ALIGNMENT = 16;
+    VkDeviceSize stagingRingSize = DEFAULT_STAGING_RING_SIZE;
+    VkBuffer stagingRingBuffer = VK_NULL_HANDLE;
+    Allocation stagingRingAllocation;
+    char* stagingRingData = nullptr;
+    VkDeviceSize stagingRingHead = 0; // where the next copy goes
+    VkDeviceSize stagingRingUsed = 0; // bytes of unfinished batches in front of the head, padding at the end of the ring included
+    VkDeviceSize uploadedBytes = 0;
+
+    // With a dedicated transfer family the buffers change queue family ownership: the batch releases them on the transfer queue, the first
+    // graphics submit after the batch finished waits for its timeline value and acquires them. Without one, transferQueue is the graphics queue.
+    struct BufferOwnershipTransfer {
+        VkBuffer buffer;
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+    struct UploadBatch {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        uint64_t timelineValue = 0; // of transferTimeline, the batch is done once it is reached
+        VkDeviceSize ringBytes = 0;
+        VkDeviceSize copiedBytes = 0;
+        std::vector<BufferOwnershipTransfer> transfers; // ranges the graphics queue reads
+    };
+    VkQueue transferQueue = VK_NULL_HANDLE;
+    uint32_t graphicsQueueFamily = 0;
+    uint32_t transferQueueFamily = 0;
+    VkCommandPool transferCommandPool = VK_NULL_HANDLE;
+    UploadBatch recordingBatch; // commandBuffer stays VK_NULL_HANDLE until the first copy is recorded
+    std::deque<UploadBatch> submittedBatches; // in submission order, so they also free the ring in order
+    std::vector<UploadBatch> pendingAcquires; // finished, the next graphics submit acquires their buffers
+    std::vector<UploadBatch> freeBatches;
+    std::vector<VkCommandBuffer> ownershipCommandBuffers; // per frame in flight, holds the acquire barriers
+    // Written by the upload path, which runs in the stream_assets and queue_submit tasks on workers. The main thread only
+    // takes them in publishUploadStats(), after frameScheduler.run() joined.
+    struct UploadStats {
+        double stallMs = 0.0; // waited for staging ring space
+        uint64_t retiredBytes = 0; // copied by the batches that finished
+    };
+    UploadStats pendingUploadStats;
+    uint64_t measuredStreamBytes = 0; // bytes finished while the profiler was recording, main thread only
+
+    // --readback: one persistently mapped buffer per frame slot that the frame's command buffer copies its image into
+    std::vector<VkBuffer> readbackBuffers;
+    std::vector<Allocation> readbackAllocations;
+    ReadbackWriter readbackWriter;
+    FrameEncoder frameEncoder;
+    uint64_t readbackFrameNumber = 0;
+    uint64_t readbackChecksum = 0; // keeps the reads from being optimized away when nothing is written
+    double frameReadbackStallMs = 0.0; // time this frame waited for the writer to give its buffer back, written by upload_instances, read after run()
+    bool readbackMemoryCached = false;
+
+    // --stream-mb: a device local buffer the transfer queue rewrites every frame, like assets being streamed in. Nothing draws from it.
+    VkBuffer streamBuffer = VK_NULL_HANDLE;
+    Allocation streamBufferAllocation;
+    std::vector<char> streamSourceData;
+
+    VkBuffer vertexBuffer = VK_NULL_HANDLE;
+    Allocation vertexBufferAllocation;
+    VkBuffer indexBuffer = VK_NULL_HANDLE;
+    Allocation indexBufferAllocation;
+    uint32_t indexCount = 0;
+
+    // The CPU rewrites the instance data while older frames are still being rendered, so every frame slot has its own host visible buffer.
+    Scene scene;
+    std::vector<VkBuffer> instanceBuffers;
+    std::vector<Allocation> instanceBufferAllocations;
+    std::vector<size_t> instanceBufferCapacities; // in instances
+    std::vector<uint64_t> instanceBufferVersions; // instanceDataVersion() each buffer holds
+    uint32_t recordedInstanceCount = 0; // instance count the prerecorded command buffers were recorded with
+
+    // The frame is a graph of tasks (wait, update, upload, record, submit, present) run by a work-stealing scheduler,
+    // so e.g. the scene update for this frame overlaps with waiting for the GPU to finish the frame that used this slot before.
+    // The graph is built once by buildFrameTaskGraph(), the tasks pass the frame's image and command buffer through frameTasks.
+    TaskScheduler frameScheduler;
+    struct FrameTaskState {
+        uint32_t imageIndex = 0;
+        bool imageAcquired = false;
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkResult presentResult = VK_SUCCESS;
+        bool measured = false; // profiler.isRecording() for this frame, the tasks on workers must not ask the profiler
+    };
+    FrameTaskState frameTasks;
+    std::vector<std::string> taskSeriesNames; // "<task>_ms" per task of the graph
+    BenchmarkClock::time_point lastSceneUpdate = BenchmarkClock::now();
+    static constexpr float ANIMATION_RADIANS_PER_SECOND = 1.0f;
+    static constexpr uint32_t SCENE_UPDATE_CHUNK_SIZE = 16384; // instances per parallel update task
+    static constexpr size_t INSTANCE_UPLOAD_CHUNK_SIZE = 32768; // instances per parallel pack task
+
+    // CullMode::Cpu: the cull task tests the bounding circles in parallel chunks, each chunk writes the indices of its visible
+    // instances to its own part of cullVisibleIndices. The upload packs them chunk by chunk to chunkVisibleOffsets in the instance buffer.
+    static constexpr uint32_t CULL_CHUNK_SIZE = 16384; // a multiple of every SIMD width, so the chunks stay aligned
+    CullingKernels cullKernels = selectCullingKernels(SimdLevel::Scalar);
+    Frustum2D viewFrustum = Frustum2D::clipSpace();
+    std::vector<uint32_t> cullVisibleIndices;
+    std::vector<size_t> chunkVisibleCounts;
+    std::vector<size_t> chunkVisibleOffsets;
+    size_t visibleInstanceCount = 0;
+    uint64_t culledSceneVersion = ~0ULL;
+    uint64_t culledViewVersion = ~0ULL;
+    uint64_t cullResultVersion = 0; // bumped whenever the visible instances were recomputed
+
+    // Multithreaded recording: the draw list is split into slices, each recorded into its own secondary command buffer by a scheduler task.
+    // A command pool must only be used by one thread at a time, so each slice has its own pool per frame slot, reset as a whole once per frame.
+    struct ThreadRecordingResources {
+        VkCommandPool commandPool;
+        VkCommandBuffer commandBuffer;
+    };
+    uint32_t recordThreadCount = 0; // number of slices
+    std::vector<std::vector<ThreadRecordingResources>> threadRecordingResources; // [frame slot][slice]
+    bool inheritedQueriesSupported = false; // secondary command buffers may only run inside a pipeline statistics query with this feature
+
+    // CullMode::Gpu: before the render pass a compute shader tests every instance against the screen, compacts the visible ones into
+    // the frame slot's visible instance buffer and counts them into its indirect draw commands. The CPU records the same handful of
+    // commands no matter how many instances there are, see shaders/cull.comp.
+    struct CullingSlot {
+        VkBuffer visibleInstances = VK_NULL_HANDLE; // bound as instance vertex buffer instead of the instance buffer
+        Allocation visibleInstancesAllocation;
+        size_t visibleInstancesCapacity = 0;
+        VkBuffer drawCommands = VK_NULL_HANDLE; // one VkDrawIndexedIndirectCommand per draw of the draw list
+        Allocation drawCommandsAllocation;
+        uint32_t drawCommandsCapacity = 0;
+        VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
+        VkBuffer boundInstanceBuffer = VK_NULL_HANDLE; // the descriptor set is rewritten when one of its buffers was replaced
+        bool descriptorSetDirty = true;
+    };
+    struct CullingPushConstants { // CullParameters in cull.comp
+        uint32_t instanceCount;
+        uint32_t drawCount;
+        uint32_t indexCount;
+        float boundingRadius;
+    };
+    static constexpr uint32_t CULLING_WORKGROUP_SIZE = 64;
+    CullMode cullMode = CullMode::None;
+    bool gpuCullingSupported = false;
+    bool multiDrawIndirectSupported = false;
+    VkDescriptorSetLayout cullingDescriptorSetLayout = VK_NULL_HANDLE; // layouts are owned by descriptorLayoutCache
+    VkPipelineLayout cullingPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline cullingPipeline = VK_NULL_HANDLE;
+    std::vector<CullingSlot> cullingSlots;
+    float meshBoundingRadius = 0.0f;
+
+    // RecordMode::Prerecorded: one command buffer per framebuffer, only re-recorded when the scene or swap chain changed
+    RecordMode recordMode = RecordMode::Dynamic;
+    std::vector<VkCommandBuffer> prerecordedCommandBuffers;
+    std::vector<bool> prerecordedDirty;
+    std::vector<uint64_t> imageTimelineValues; // graphics timeline value of the frame that last rendered to each image, 0 = none
+
+    // Resources that may still be used by frames in flight are destroyed once those frames are known to be done.
+    struct DeferredDestruction {
+        uint64_t retireAtValue; // graphics timeline value after which nothing uses it anymore
+        std::function<void()> destroy;
+    };
+    std::deque<DeferredDestruction> deferredDestructions;
+    bool framebufferResized = false;
     
+    // One timeline semaphore per queue instead of a fence per frame. Binary semaphores are only left where the swap chain needs them.
+    TimelineFunctions timelineFunctions;
+    QueueTimeline graphicsTimeline;
+    QueueTimeline dedicatedTransferTimeline; // only created with a dedicated transfer queue
+    QueueTimeline* transferTimeline = &graphicsTimeline; // the timeline of transferQueue
+    std::vector<uint64_t> frameTimelineValues; // per frame in flight: graphics timeline value of its last submit, 0 = none yet
     std::vector <VkSemaphore> imageAvailableSemaphores;
     std::vector <VkSemaphore> renderFinishedSemaphores;
-    std::vector <VkFence> inFlightFences; // we should always let the GPU fly with only one image! And wait until that one is done.
 
+    // GPU timings, one query pool per frame in flight so reading frame N never waits on frame N+1
+    static const uint32_t TIMESTAMP_QUERY_COUNT = 3; // before culling, before and after the render pass
+    static const uint32_t PIPELINE_STATISTIC_COUNT = 2; // vertex and fragment shader invocations
+    static const VkQueryPipelineStatisticFlags PIPELINE_STATISTICS_FLAGS = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT | VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+    bool gpuTimestampsSupported = false;
+    bool pipelineStatisticsSupported = false;
+    float timestampPeriod = 1.0f; // nanoseconds per timestamp tick
+    uint64_t timestampMask = ~0ULL;
+    std::vector<VkQueryPool> timestampQueryPools;
+    std::vector<VkQueryPool> pipelineStatisticsQueryPools;
+    std::vector<uint64_t> querySlotTimelineValues; // per frame slot: timeline value of the last frame that wrote its query pools, 0 for none
+    struct GpuQuerySample {
+        const char* series;
+        double value;
+    };
+    std::vector<GpuQuerySample> gpuQuerySamples; // read back by the frame that reuses the pools, handed to the profiler on the main thread
+
+    uint32_t maxFramesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
     uint32_t currentFrame = 0;
+    uint32_t headlessImageIndex = 0;
+    uint32_t lastSubmittedImage = 0; // the image of the newest frame, what a golden check reads back
+    bool goldenPassed = true;
+    VkPresentModeKHR activePresentMode = VK_PRESENT_MODE_FIFO_KHR;
+    BenchmarkClock::time_point inputSampleTime;
+
+    FrameProfiler profiler;
 
     void initWindow(){
         glfwInit(); //initialize GLFW library
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API); //do not create OpenGL context
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE); //disable window resizing
         window = glfwCreateWindow(WIDTH, HEIGHT, "VulkanFirstTriangle", nullptr, nullptr);
         //width, height, title, specify monitor, smt OpenGL
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+    }
+
+    static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+        // Not every driver reports VK_ERROR_OUT_OF_DATE_KHR after a resize, so we remember it ourselves.
+        auto app = reinterpret_cast<HelloTriangleApplication*>(glfwGetWindowUserPointer(window));
+        app->framebufferResized = true;
     }
     
     void initVulkan() {
+        auto initStart = BenchmarkClock::now();
         createInstance();
         setupDebugMessenger();
-        createSurface();
+        if (!config.headless) {
+            createSurface();
+        }
         pickPhysicalDevice();
         createLogicalDevice();
-        createSwapChain();
+        createTimelines();
+        allocator.init(physicalDevice, device);
+        shaderLibrary.init(device);
+        descriptorLayoutCache.init(device);
+        descriptorAllocator.init(device);
+        renderPassCache.init(device);
+        if (config.headless) {
+            createOffscreenImages();
+        }
+        else {
+            createSwapChain();
+        }
         createImageViews();
-        createRenderPass();
+        createRenderPasses();
+
+        auto stepStart = BenchmarkClock::now();
+        createPipelineCache();
+        recordStartupTime("load_pipeline_cache", stepStart);
+        stepStart = BenchmarkClock::now();
         createGraphicsPipeline();
-        createFramebuffers();
+        recordStartupTime("create_graphics_pipeline", stepStart);
+        if (config.cullMode == CullMode::Gpu || config.compareCullModes) {
+            createCullingPipeline();
+        }
+        ShaderLibraryStats shaderStats = shaderLibrary.stats();
+        profiler.report.setMetric("startup_load_shaders_ms", shaderStats.loadMs);
+        profiler.report.setMetric("shader_modules", shaderStats.moduleCount);
+        profiler.report.setMetric("shader_bytes", static_cast<double>(shaderStats.bytesLoaded));
+
         createCommandPool();
+        createTransferResources();
+        createUniformRing();
+
+        stepStart = BenchmarkClock::now();
+        createGeometryBuffers();
+        recordStartupTime("upload_geometry", stepStart);
+
         createCommandBuffers();
         createSyncObjects();
+        createReadbackBuffers();
+        createQueryPools();
+        cullKernels = selectCullingKernels(config.simdLevel.value_or(bestSimdLevel()));
+        fillInstanceGrid(scene, config.instanceCount, config.worldSize);
+        resetCamera();
+        frameScheduler.resize(config.workerThreads);
+        setRecordThreadCount(config.recordThreads);
+        imageTimelineValues.assign(swapChainImages.size(), 0);
+        setRecordMode(config.recordMode);
+        setCullMode(config.cullMode);
+        rebuildFrameGraph();
+        buildFrameTaskGraph();
+        recordStartupTime("init_vulkan", initStart);
+    }
+
+    void recordStartupTime(const std::string& step, BenchmarkClock::time_point start) {
+        // Startup numbers are single values per run, compare a cold run (no pipeline cache file) with a warm one.
+        profiler.report.setMetric("startup_" + step + "_ms", millisecondsSince(start));
     }
     
     void createInstance(){
@@ -149,12 +827,15 @@ private:
         vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, supportedExtensions.data());
         
         //set requiered Extensions
-        uint32_t glfwExtensionCount = 0;
-        const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
         std::vector<const char*> requiredExtensions;
-        
-        for(uint32_t i = 0; i < glfwExtensionCount; i++) {
-            requiredExtensions.emplace_back(glfwExtensions[i]);
+
+        if (!config.headless) { // without a window we do not need any surface extensions
+            uint32_t glfwExtensionCount = 0;
+            const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+
+            for(uint32_t i = 0; i < glfwExtensionCount; i++) {
+                requiredExtensions.emplace_back(glfwExtensions[i]);
+            }
         }
         requiredExtensions.emplace_back(VK_KHR_PORTABILITY_ENUMERATION_EXTENSION_NAME);
         requiredExtensions.emplace_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
@@ -178,6 +859,14 @@ private:
                 throw std::runtime_error(std::string("Required Extension missing: ").append(requiredExtension));
             }
         }
+
+        // Device UUIDs (VkPhysicalDeviceIDProperties) need this one on a 1.0 instance, nice to have for --device
+        deviceIdsSupported = std::any_of(supportedExtensions.begin(), supportedExtensions.end(), [](const VkExtensionProperties& extension) {
+            return std::strcmp(extension.extensionName, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME) == 0;
+        });
+        if (deviceIdsSupported) {
+            requiredExtensions.emplace_back(VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME);
+        }
         
         //create Instance
         VkApplicationInfo appInfo{};
@@ -207,7 +896,7 @@ private:
         
         VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
         if(result!=VK_SUCCESS){
-            std::cout<<result<<std::endl; //-9 -> Incompatible Driver Error
+            std::cerr<<result<<std::endl; //-9 -> Incompatible Driver Error
             throw std::runtime_error("Failed to create Vulkan instance!");
         }
     }
@@ -267,7 +956,7 @@ private:
         }
     }
 
-    void pickPhysicalDevice() {
+    std::vector<PhysicalDeviceInfo> queryPhysicalDevices() {
         uint32_t deviceCount = 0;
         vkEnumeratePhysicalDevices(instance, &deviceCount,nullptr);
 
@@ -278,40 +967,73 @@ private:
         std::vector<VkPhysicalDevice> devices(deviceCount);
         vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
-        for (const auto& device : devices) {
-            if (isDeviceSuitable(device)) {
-                physicalDevice = device;
-                break;
+        auto getProperties2 = deviceIdsSupported
+            ? (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceProperties2KHR")
+            : nullptr;
+        std::vector<PhysicalDeviceInfo> infos;
+        for (uint32_t i = 0; i < deviceCount; i++) {
+            infos.push_back(queryPhysicalDevice(devices[i], i, getProperties2));
+        }
+        return infos;
+    }
+
+    // The suitable device with the best score, or the one --device / VK_TRIANGLE_DEVICE names.
+    void pickPhysicalDevice() {
+        std::vector<PhysicalDeviceInfo> devices = queryPhysicalDevices();
+
+        std::optional<int64_t> bestScore;
+        for (const PhysicalDeviceInfo& info : devices) {
+            if (!config.deviceSelector.empty() && !matchesDeviceSelector(info, config.deviceSelector)) continue;
+            if (!isDeviceSuitable(info.device)) {
+                if (!config.deviceSelector.empty()) {
+                    std::cerr << "Device " << info.index << " matches " << config.deviceSelector << " but is not suitable: " << describeDevice(info) << std::endl;
+                }
+                continue;
+            }
+            int64_t score = deviceScorer(info);
+            if (!bestScore.has_value() || score > bestScore.value()) {
+                bestScore = score;
+                physicalDevice = info.device;
+                physicalDeviceInfo = info;
             }
         }
 
         if (physicalDevice == VK_NULL_HANDLE) {
+            if (!config.deviceSelector.empty()) {
+                throw std::runtime_error("Failed to find a suitable GPU matching " + config.deviceSelector + "!");
+            }
             throw std::runtime_error("Failed to find a suitable GPU!");
         }
+        physicalDeviceScore = bestScore.value();
+        std::cerr << "Using device " << physicalDeviceInfo.index << ": " << describeDevice(physicalDeviceInfo) << " score " << physicalDeviceScore << std::endl;
     }
 
+    // Only what we can not run without, everything nice to have goes into the score.
     bool isDeviceSuitable(VkPhysicalDevice device) {
-        // We can check in this function if the device supports every feature we need.
-        // We should also rank the devices and pick the best one according to some score!
-        // For now we don't care as all VkPhysicalDevices support Vulkan we are good to go!
-        /*VkPhysicalDeviceProperties deviceProperties;
-        VkPhysicalDeviceFeatures deviceFeatures;
-        vkGetPhysicalDeviceProperties(device, &deviceProperties);
-        vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
-
-        return deviceFeatures.geometryShader && deviceProperties.deviceType==VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU*/;
-
         QueueFamilyIndices indices = findQueueFamilies(device);
         bool extensionsSupported = checkDeviceExtensionSupport(device);
-        bool swapChainAdequate = false;
+        bool swapChainAdequate = config.headless; // no swap chain, nothing to check
 
-        if (extensionsSupported) {  //only query for SwapChain if the extensions are supported
+        if (extensionsSupported && !config.headless) {  //only query for SwapChain if the extensions are supported
             SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
             //ensuring that there is at least one supported image format and presentation mode is enough
             swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
         }
 
-        return indices.isComplete() && extensionsSupported && swapChainAdequate;
+        return indices.isComplete(!config.headless) && extensionsSupported && swapChainAdequate && timelineSemaphoresSupported(device);
+    }
+
+    // The extension alone is not enough, the feature has to be there as well.
+    bool timelineSemaphoresSupported(VkPhysicalDevice device) {
+        auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+        if (getFeatures2 == nullptr) return false;
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+        timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineFeatures;
+        getFeatures2(device, &features2);
+        return timelineFeatures.timelineSemaphore == VK_TRUE;
     }
 
     QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device) {
@@ -331,14 +1053,16 @@ private:
                 indices.graphicsFamily = i;
             }
 
-            VkBool32 presentationSupport = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
+            if (!config.headless) {
+                VkBool32 presentationSupport = false;
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
 
-            if (presentationSupport) {
-                indices.presentationFamily = i;
+                if (presentationSupport) {
+                    indices.presentationFamily = i;
+                }
             }
 
-            if (indices.isComplete()) {
+            if (indices.isComplete(!config.headless)) {
                 //when we found all queues we needed we don't have to change them up with redundant ones!
                 break;
             }
@@ -346,6 +1070,18 @@ private:
             i++;
         }
 
+        // A transfer only family is usually a DMA engine of its own, an async compute family still runs next to the graphics queue.
+        for (uint32_t family = 0; config.transferQueue && family < queueFamilyCount; family++) {
+            VkQueueFlags flags = queueFamilies[family].queueFlags;
+            if ((flags & VK_QUEUE_GRAPHICS_BIT) || queueFamilies[family].queueCount == 0) continue;
+            if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_COMPUTE_BIT)) {
+                indices.transferFamily = family;
+                break;
+            }
+            if ((flags & VK_QUEUE_COMPUTE_BIT) && !indices.transferFamily.has_value()) { // compute queues can always copy
+                indices.transferFamily = family;
+            }
+        }
 
         return indices;
     }
@@ -357,7 +1093,8 @@ private:
         std::vector<VkExtensionProperties> availableExtensions(extensionCount);
         vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-        std::set<std::string> requiredExtensionsSet(requiredDeviceExtensions.begin(), requiredDeviceExtensions.end());
+        std::vector<const char*> deviceExtensions = getRequiredDeviceExtensions();
+        std::set<std::string> requiredExtensionsSet(deviceExtensions.begin(), deviceExtensions.end());
 
         for (const auto& extension : availableExtensions) {
             requiredExtensionsSet.erase(extension.extensionName);
@@ -366,6 +1103,14 @@ private:
         return requiredExtensionsSet.empty();
     }
 
+    std::vector<const char*> getRequiredDeviceExtensions() {
+        std::vector<const char*> extensions = requiredDeviceExtensions;
+        if (!config.headless) {
+            extensions.insert(extensions.end(), presentationDeviceExtensions.begin(), presentationDeviceExtensions.end());
+        }
+        return extensions;
+    }
+
     SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device) {
         SwapChainSupportDetails details;
 
@@ -394,7 +1139,13 @@ private:
         QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
         std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-        std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(),indices.presentationFamily.value() };
+        std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value() };
+        if (indices.presentationFamily.has_value()) {
+            uniqueQueueFamilies.insert(indices.presentationFamily.value());
+        }
+        if (indices.transferFamily.has_value()) {
+            uniqueQueueFamilies.insert(indices.transferFamily.value());
+        }
         
         //this variable is not in the for loop to retain its lifetime
         float queuePriority = 1.0f;
@@ -410,17 +1161,41 @@ private:
             queueCreateInfos.push_back(queueCreateInfo);
         }
 
-        //currently we need no VulkanFeature, but we will come back here:
+        VkPhysicalDeviceFeatures supportedFeatures;
+        vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+
         VkPhysicalDeviceFeatures deviceFeatures{};
-        
+        // Pipeline statistics are only needed for the benchmark and not every (software) device has them.
+        pipelineStatisticsSupported = isBenchmarking() && supportedFeatures.pipelineStatisticsQuery;
+        deviceFeatures.pipelineStatisticsQuery = pipelineStatisticsSupported ? VK_TRUE : VK_FALSE;
+        inheritedQueriesSupported = pipelineStatisticsSupported && supportedFeatures.inheritedQueries;
+        deviceFeatures.inheritedQueries = inheritedQueriesSupported ? VK_TRUE : VK_FALSE;
+
+        // GPU culling dispatches on the graphics queue and its indirect draws start at firstInstance != 0.
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+        bool graphicsQueueCanCompute = queueFamilies[indices.graphicsFamily.value()].queueFlags & VK_QUEUE_COMPUTE_BIT;
+        gpuCullingSupported = graphicsQueueCanCompute && supportedFeatures.drawIndirectFirstInstance;
+        deviceFeatures.drawIndirectFirstInstance = gpuCullingSupported ? VK_TRUE : VK_FALSE;
+        multiDrawIndirectSupported = supportedFeatures.multiDrawIndirect; // otherwise one vkCmdDrawIndexedIndirect per draw
+        deviceFeatures.multiDrawIndirect = multiDrawIndirectSupported ? VK_TRUE : VK_FALSE;
+
+
+        VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{}; // isDeviceSuitable() made sure it is there
+        timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+        timelineFeatures.timelineSemaphore = VK_TRUE;
 
         VkDeviceCreateInfo createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+        createInfo.pNext = &timelineFeatures;
         createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
         createInfo.pQueueCreateInfos = queueCreateInfos.data();
         createInfo.pEnabledFeatures = &deviceFeatures;
-        createInfo.enabledExtensionCount = (uint32_t)requiredDeviceExtensions.size();
-        createInfo.ppEnabledExtensionNames= requiredDeviceExtensions.data();
+        std::vector<const char*> deviceExtensions = getRequiredDeviceExtensions();
+        createInfo.enabledExtensionCount = (uint32_t)deviceExtensions.size();
+        createInfo.ppEnabledExtensionNames= deviceExtensions.data();
         
         if (enableValidationLayers) {
             createInfo.enabledLayerCount = static_cast<uint32_t>(validationLayers.size());
@@ -436,7 +1211,25 @@ private:
 
         // 0 is the index of the the Queues we gonna use. We hard code 0 here as we only have one Queue for each family.
         vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
-        vkGetDeviceQueue(device, indices.presentationFamily.value(), 0, &presentationQueue);
+        if (!config.headless) {
+            vkGetDeviceQueue(device, indices.presentationFamily.value(), 0, &presentationQueue);
+        }
+        graphicsQueueFamily = indices.graphicsFamily.value();
+        transferQueueFamily = indices.transferFamily.value_or(graphicsQueueFamily);
+        vkGetDeviceQueue(device, transferQueueFamily, 0, &transferQueue);
+    }
+
+    // Before anything is uploaded, the upload batches signal the transfer timeline.
+    void createTimelines() {
+        timelineFunctions.load(device);
+        graphicsTimeline.init(device, timelineFunctions);
+        if (hasDedicatedTransferQueue()) {
+            dedicatedTransferTimeline.init(device, timelineFunctions);
+            transferTimeline = &dedicatedTransferTimeline;
+        }
+        else { // one queue, one timeline: batches and frames signal it in the order they are submitted
+            transferTimeline = &graphicsTimeline;
+        }
     }
 
     void createSwapChain(){
@@ -445,12 +1238,8 @@ private:
         VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
         VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);
         VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
-
-        
-        uint32_t imageCount = std::clamp((uint32_t)3, swapChainSupport.capabilities.minImageCount, (uint32_t)3); // for Triple Buffering we need at least 3 images ^^
-        if (swapChainSupport.capabilities.maxImageCount > 0 && imageCount > swapChainSupport.capabilities.maxImageCount) {
-            imageCount = swapChainSupport.capabilities.maxImageCount;
-        }
+        uint32_t imageCount = chooseSwapImageCount(swapChainSupport.capabilities);
+        activePresentMode = presentMode;
 
         VkSwapchainCreateInfoKHR createInfo{};
         createInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -479,7 +1268,7 @@ private:
         createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR; // We do not want that our application blends with other applications: VkCompositeAlphaFlagBitsKHR.
         createInfo.presentMode = presentMode;
         createInfo.clipped = VK_TRUE; // this options says we do not care about pixels who might be under a different window. If this is needed we should disable this ^^. But it increases performance of course.
-        createInfo.oldSwapchain = VK_NULL_HANDLE; // if the window is resized or moved to a different monitor we might need to create a new swap chain and should state the old swap chain here. For now we will not do that ^^.
+        createInfo.oldSwapchain = swapChain; // VK_NULL_HANDLE the first time. When recreating after a resize, the driver can reuse resources of the old one and it stays valid for frames still in flight.
 
         if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS) {
             throw std::runtime_error("Failed to create swap chain!");
@@ -493,6 +1282,109 @@ private:
         swapChainExtent = extent;
     }   
 
+    void createOffscreenImages() {
+        // Headless replacement for createSwapChain(): we own the color targets ourselves and nobody presents them.
+        swapChainImageFormat = chooseOffscreenFormat();
+        swapChainExtent = { WIDTH, HEIGHT };
+
+        // There is no surface to ask, so we just honor the requested count.
+        uint32_t imageCount = config.swapchainImageCount > 0 ? config.swapchainImageCount : DEFAULT_SWAPCHAIN_IMAGE_COUNT;
+        swapChainImages.resize(imageCount);
+        offscreenImageAllocations.resize(imageCount);
+
+        for (uint32_t i = 0; i < imageCount; i++) {
+            VkImageCreateInfo imageInfo{};
+            imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            imageInfo.imageType = VK_IMAGE_TYPE_2D;
+            imageInfo.format = swapChainImageFormat;
+            imageInfo.extent = { swapChainExtent.width, swapChainExtent.height, 1 };
+            imageInfo.mipLevels = 1;
+            imageInfo.arrayLayers = 1;
+            imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+            imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT; // TRANSFER_SRC so the pixels can be copied out later
+            imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+            if (vkCreateImage(device, &imageInfo, nullptr, &swapChainImages[i]) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create offscreen image!");
+            }
+
+            offscreenImageAllocations[i] = allocator.allocateForImage(swapChainImages[i], VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+    }
+
+    VkFormat chooseOffscreenFormat() {
+        // Prefer the same format chooseSwapSurfaceFormat() prefers so headless output matches the windowed one.
+        const VkFormat candidates[] = { VK_FORMAT_B8G8R8A8_SRGB, VK_FORMAT_R8G8B8A8_SRGB, VK_FORMAT_B8G8R8A8_UNORM, VK_FORMAT_R8G8B8A8_UNORM };
+        for (VkFormat format : candidates) {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+            if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT) {
+                return format;
+            }
+        }
+        throw std::runtime_error("Failed to find a color attachment format for offscreen rendering!");
+    }
+
+    void recreateSwapChain() {
+        int width = 0, height = 0;
+        glfwGetFramebufferSize(window, &width, &height);
+        while (width == 0 || height == 0) { // minimized, there is nothing to render to until the window comes back
+            if (glfwWindowShouldClose(window)) {
+                return;
+            }
+            glfwWaitEvents();
+            glfwGetFramebufferSize(window, &width, &height);
+        }
+
+        // No vkDeviceWaitIdle here: frames in flight keep using the old objects, which are destroyed once the graphics timeline passed them.
+        VkSwapchainKHR oldSwapChain = swapChain;
+        std::vector<VkImageView> oldImageViews = swapChainImageViews;
+        std::vector<VkCommandBuffer> oldPrerecordedCommandBuffers = prerecordedCommandBuffers;
+
+        createSwapChain(); // passes the old swap chain as oldSwapchain
+        createImageViews();
+        rebuildFrameGraph(); // transient attachments sized like the swap chain, the old graph goes with the old images
+
+        deferDestruction([this, oldSwapChain, oldImageViews, oldPrerecordedCommandBuffers]() {
+            if (!oldPrerecordedCommandBuffers.empty()) {
+                vkFreeCommandBuffers(device, commandPool, (uint32_t)oldPrerecordedCommandBuffers.size(), oldPrerecordedCommandBuffers.data());
+            }
+            for (auto imageView : oldImageViews) {
+                vkDestroyImageView(device, imageView, nullptr);
+            }
+            vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+        });
+
+        // The image count may have changed and the old values say nothing about the new images.
+        imageTimelineValues.assign(swapChainImages.size(), 0);
+        createQueryPoolsForSlots();
+        prerecordedCommandBuffers.clear();
+        setRecordMode(recordMode);
+    }
+
+    // Only for objects that no frame submitted from now on uses, every frame submitted so far may still be using it.
+    void deferDestruction(std::function<void()> destroy) {
+        deferredDestructions.push_back({ graphicsTimeline.lastSubmittedValue(), std::move(destroy) });
+    }
+
+    void destroyRetiredResources() {
+        // Values only grow, so the front is always the first to be free. Never blocks.
+        while (!deferredDestructions.empty() && graphicsTimeline.isComplete(deferredDestructions.front().retireAtValue)) {
+            deferredDestructions.front().destroy();
+            deferredDestructions.pop_front();
+        }
+    }
+
+    void flushDeferredDestructions() {
+        // Only valid when the device is idle.
+        for (auto& deferred : deferredDestructions) {
+            deferred.destroy();
+        }
+        deferredDestructions.clear();
+    }
+
     VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats) {
         for (const auto& availableFormat : availableFormats) {
             if (availableFormat.format == VK_FORMAT_B8G8R8A8_SRGB && availableFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
@@ -501,12 +1393,41 @@ private:
         }
 
 
-        std::cout << "using random Swap Surface Format as we did not find 24+8Bit Alpha SRGB! Could also be that there isn't even a Format available!" << std::endl;
+        std::cerr << "using random Swap Surface Format as we did not find 24+8Bit Alpha SRGB! Could also be that there isn't even a Format available!" << std::endl;
         //If we do not find what we get we just use whatever, we should score each format and pick the next best one but I and the tutorial are to lazy!
         return availableFormats[0];
     }
 
+    uint32_t chooseSwapImageCount(const VkSurfaceCapabilitiesKHR& capabilities) {
+        // More images let the CPU run further ahead (throughput), fewer images mean a shorter queue in front of the display (latency).
+        uint32_t desiredCount = config.swapchainImageCount;
+        if (desiredCount == 0) {
+            desiredCount = config.lowLatency ? 2 : DEFAULT_SWAPCHAIN_IMAGE_COUNT;
+        }
+
+        uint32_t imageCount = std::max(desiredCount, capabilities.minImageCount);
+        if (capabilities.maxImageCount > 0 && imageCount > capabilities.maxImageCount) { // maxImageCount 0 means no limit
+            imageCount = capabilities.maxImageCount;
+        }
+        if (imageCount > MAX_SUPPORTED_SWAPCHAIN_IMAGES) {
+            throw std::runtime_error("Failed to create swap chain, the surface needs more than " + std::to_string(MAX_SUPPORTED_SWAPCHAIN_IMAGES) + " images!");
+        }
+        if (config.swapchainImageCount > 0 && imageCount != config.swapchainImageCount) {
+            std::cerr << "Requested " << config.swapchainImageCount << " swap chain images, but the surface supports "
+                << capabilities.minImageCount << " to " << capabilities.maxImageCount << ". Using " << imageCount << "." << std::endl;
+        }
+        return imageCount;
+    }
+
     VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes) {
+        if (config.presentMode.has_value()) {
+            if (std::find(availablePresentModes.begin(), availablePresentModes.end(), config.presentMode.value()) != availablePresentModes.end()) {
+                return config.presentMode.value();
+            }
+            std::cerr << "Present mode " << presentModeName(config.presentMode.value()) << " is not supported by the surface, falling back to fifo." << std::endl;
+            return VK_PRESENT_MODE_FIFO_KHR;
+        }
+
         for (const auto& availablePresentMode : availablePresentModes) {
             if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) { //this is Gaming mode ^^
                 return availablePresentMode;
@@ -561,69 +1482,207 @@ private:
         }
     }
 
-    void createRenderPass() {
-        VkAttachmentDescription colorAttachment{};
-        colorAttachment.format = swapChainImageFormat;
-        colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT; // Single color buffer represented by one image of the swap chain
-        //loadOp & storeOp affect color and depth data:
-        colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR; // What to do with the attachment before it is being rendered. CLEAR means black framebuffer!
-        colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; // What to do with the attachment after it has been rendered. STORE so that we can see what we render on scren ^^.
-        //senctilLoad & Store affect stencil data:
-        colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-        colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-        colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; // We do not care what the previous image layout is before the render pass. Thus we also do not care if the image will be preserved or not!
-        colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR; // Image is to be presented in the Swap Chain
+    // One render pass per sample count a benchmark pass may switch to, so the compile threads always find the one of their variant.
+    void createRenderPasses() {
+        msaaSamples = usableSampleCount(config.pipelineVariant.samples);
+        if (msaaSamples != config.pipelineVariant.samples) {
+            std::cerr << "The device does not support " << config.pipelineVariant.samples << "x MSAA, using " << msaaSamples << "x." << std::endl;
+            config.pipelineVariant.samples = msaaSamples;
+        }
+        depthFormat = config.depth ? chooseDepthFormat() : VK_FORMAT_UNDEFINED;
+
+        std::vector<VkSampleCountFlagBits> sampleCounts = config.msaaSweep ? supportedSampleCounts() : std::vector<VkSampleCountFlagBits>{ msaaSamples };
+        for (VkSampleCountFlagBits samples : sampleCounts) {
+            // Only the render pass is needed, so the graph is compiled without images. The cache hands the frame graph the same one later.
+            std::shared_ptr<RenderGraph> graph = buildFrameGraph(samples, false);
+            renderPasses[samples] = graph->renderPass("scene");
+            graph->destroy();
+        }
+    }
+
+    // Frames in flight keep the old graph's framebuffers and attachments, they go once the timeline passed them.
+    void rebuildFrameGraph() {
+        std::shared_ptr<RenderGraph> oldGraph = frameGraph;
+        frameGraph = buildFrameGraph(msaaSamples, true);
+        if (oldGraph) {
+            deferDestruction([oldGraph]() { oldGraph->destroy(); });
+        }
+        markCommandBuffersDirty();
+    }
+
+    // The frame as a render graph: GPU culling, the scene and the readback copy. Each pass only says what it reads and
+    // writes, the graph works out the barriers between them, the render pass with its layouts and load/store ops, and the
+    // transient attachments with their memory.
+    std::shared_ptr<RenderGraph> buildFrameGraph(VkSampleCountFlagBits samples, bool allocate) {
+        auto graph = std::make_shared<RenderGraph>();
+
+        // Windowed, the acquire semaphore orders us after the presentation engine. Offscreen images are ours, so wait for the last frame's color writes.
+        RenderGraphAccess beforeFrame{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, config.headless ? static_cast<VkAccessFlags>(VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT) : 0, VK_IMAGE_LAYOUT_UNDEFINED };
+        // Nobody presents offscreen images, but we may want to copy them out
+        RenderGraphAccess afterFrame{ VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, config.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR };
+        swapChainTarget = graph->importImage("swap_chain_image", { swapChainImageFormat, VK_SAMPLE_COUNT_1_BIT, VK_IMAGE_ASPECT_COLOR_BIT }, beforeFrame);
+        graph->exportResource(swapChainTarget, afterFrame);
+
+        // The frame slot's buffers: the slot waited for its last frame, so nothing on the GPU uses them before the frame.
+        RenderGraphResource drawCommands = 0;
+        RenderGraphResource visibleInstances = 0;
+        if (cullMode == CullMode::Gpu) {
+            drawCommands = graph->importBuffer("draw_commands");
+            visibleInstances = graph->importBuffer("visible_instances");
+            graph->addPass("clear_draw_commands")
+                .write(drawCommands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT)
+                .record([this](const RenderGraphContext& context) {
+                    VkBuffer buffer = cullingSlots[context.frame->frameSlot].drawCommands;
+                    vkCmdFillBuffer(context.commandBuffer, buffer, 0, drawListSize() * sizeof(VkDrawIndexedIndirectCommand), 0); // the shader counts from zero
+                });
+            graph->addPass("cull")
+                .readWrite(drawCommands, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT)
+                .write(visibleInstances, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT)
+                .record([this](const RenderGraphContext& context) {
+                    recordCullingPass(context.commandBuffer, context.frame->frameSlot);
+                    if (gpuTimestampsSupported) {
+                        vkCmdWriteTimestamp(context.commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPools[context.frame->frameSlot], 1); // once culling is done
+                    }
+                });
+        }
 
-        VkAttachmentReference colorAttachmentRef{};
-        colorAttachmentRef.attachment = 0; // Reference the target AttachmentDescription by index
-        colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL; // Performant color buffer
+        // Single sampled we render straight into the swap chain image, multisampled into a transient image resolved into it.
+        VkClearColorValue black = { { 0.0f, 0.0f, 0.0f, 1.0f } };
+        RenderGraph::Pass& scene = graph->addGraphicsPass("scene");
+        if (samples != VK_SAMPLE_COUNT_1_BIT) {
+            scene.color(graph->createImage("msaa_color", { swapChainImageFormat, samples, VK_IMAGE_ASPECT_COLOR_BIT }), VK_ATTACHMENT_LOAD_OP_CLEAR, black);
+        }
+        else {
+            scene.color(swapChainTarget, VK_ATTACHMENT_LOAD_OP_CLEAR, black);
+        }
+        if (depthFormat != VK_FORMAT_UNDEFINED) { // every attachment of a subpass has the same sample count
+            scene.depth(graph->createImage("depth", { depthFormat, samples, VK_IMAGE_ASPECT_DEPTH_BIT }), VK_ATTACHMENT_LOAD_OP_CLEAR, 1.0f); // the far plane
+        }
+        if (samples != VK_SAMPLE_COUNT_1_BIT) {
+            scene.resolve(swapChainTarget);
+        }
+        if (cullMode == CullMode::Gpu) {
+            scene.read(drawCommands, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT)
+                .read(visibleInstances, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+        }
+        scene.contents([this]() { return recordThreadCount > 0 ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE; })
+            .record([this](const RenderGraphContext& context) { recordScene(context); });
+
+        if (config.readback) {
+            RenderGraphResource readbackBuffer = graph->importBuffer("readback_buffer"); // the writer is done with the slot's buffer, see prepareFrameResources()
+            graph->exportResource(readbackBuffer, { VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT });
+            graph->addPass("readback")
+                .read(swapChainTarget, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+                .write(readbackBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT)
+                .record([this](const RenderGraphContext& context) { recordReadback(context.commandBuffer, context.frame->imageIndex, context.frame->frameSlot); });
+        }
 
-        VkSubpassDescription subpass{};
-        subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpass.colorAttachmentCount = 1;
-        subpass.pColorAttachments = &colorAttachmentRef; // "layout(location = 0) out vec4 outColor" indexes here location=0 because we only have one attachment!
+        graph->compile(device, swapChainExtent, renderPassCache, allocate ? &allocator : nullptr);
+        return graph;
+    }
 
-        VkSubpassDependency dependency{};
-        dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-        dependency.dstSubpass = 0;
-        dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;    // We want to wait for the color output of the previous image before starting our render pass.
-        dependency.srcAccessMask = 0;
-        dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-        dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    // Sample counts every attachment of the render pass supports, 1x to 8x (more is rarely supported and never worth it here).
+    std::vector<VkSampleCountFlagBits> supportedSampleCounts() const {
+        const VkPhysicalDeviceLimits& limits = physicalDeviceInfo.properties.limits;
+        VkSampleCountFlags counts = limits.framebufferColorSampleCounts;
+        if (config.depth) {
+            counts &= limits.framebufferDepthSampleCounts;
+        }
+        std::vector<VkSampleCountFlagBits> result;
+        for (VkSampleCountFlagBits samples : { VK_SAMPLE_COUNT_1_BIT, VK_SAMPLE_COUNT_2_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_8_BIT }) {
+            if (counts & samples) {
+                result.push_back(samples);
+            }
+        }
+        return result;
+    }
 
-        VkRenderPassCreateInfo renderPassInfo{};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-        renderPassInfo.attachmentCount = 1;
-        renderPassInfo.pAttachments = &colorAttachment;
-        renderPassInfo.subpassCount = 1;
-        renderPassInfo.pSubpasses = &subpass;
-        renderPassInfo.dependencyCount = 1;
-        renderPassInfo.pDependencies = &dependency;
+    // The highest supported sample count that is not above the requested one.
+    VkSampleCountFlagBits usableSampleCount(VkSampleCountFlagBits requested) const {
+        VkSampleCountFlagBits usable = VK_SAMPLE_COUNT_1_BIT;
+        for (VkSampleCountFlagBits samples : supportedSampleCounts()) {
+            if (samples <= requested) {
+                usable = samples;
+            }
+        }
+        return usable;
+    }
 
-        if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create render pass!");
+    VkFormat chooseDepthFormat() {
+        const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D16_UNORM };
+        for (VkFormat format : candidates) {
+            VkFormatProperties properties;
+            vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &properties);
+            if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+                return format;
+            }
         }
+        throw std::runtime_error("Failed to find a depth attachment format!");
+    }
+
+    // Benchmark pass setup, the device is idle. Everything that depends on the sample count is rebuilt.
+    void setSampleCount(VkSampleCountFlagBits samples) {
+        msaaSamples = samples;
+        rebuildFrameGraph();
+
+        // The bound variant belongs to another render pass, so there is nothing to fall back to: wait for the compile.
+        requestedPipelineVariant.samples = samples;
+        boundPipelineVariant = requestedPipelineVariant;
+        graphicsPipeline = pipelineVariants.get(boundPipelineVariant);
     }
     
     void createGraphicsPipeline() {
-        std::vector<char> vertShaderByteCode = readFile("shaders/vert.spv");
-        std::vector<char> fragShaderByteCode = readFile("shaders/frag.spv");
+        // set 0: the frame uniforms, per draw data goes through push constants
+        VkDescriptorSetLayoutBinding frameUniformsBinding{};
+        frameUniformsBinding.binding = 0;
+        frameUniformsBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        frameUniformsBinding.descriptorCount = 1;
+        frameUniformsBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        frameDescriptorSetLayout = descriptorLayoutCache.getSetLayout({ frameUniformsBinding });
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(DrawPushConstants); // 128 bytes are guaranteed, keep it small
+        pipelineLayout = descriptorLayoutCache.getPipelineLayout({ frameDescriptorSetLayout }, { pushConstantRange });
+
+        pipelineVariants.init(device, [this](const PipelineVariantKey& key) { return createPipelineVariant(key); }, PIPELINE_COMPILE_THREAD_COUNT);
+        requestedPipelineVariant = config.pipelineVariant;
+        boundPipelineVariant = config.pipelineVariant;
+        graphicsPipeline = pipelineVariants.get(boundPipelineVariant); // the first frame can not fall back to anything
+        if (config.variantSweep) {
+            variantSweepKeys = pipelineVariantSweep();
+        }
+    }
 
-        VkShaderModule vertShaderModule = createShaderModule(vertShaderByteCode);
-        VkShaderModule fragShaderModule = createShaderModule(fragShaderByteCode);
+    // Called by the compile threads of pipelineVariants, so it must only read state that stays the same while they run.
+    VkPipeline createPipelineVariant(const PipelineVariantKey& key) {
+        // owned by the shader library, which keeps them around for the next pipeline that needs them
+        VkShaderModule vertShaderModule = shaderLibrary.load("shaders/vert.spv");
+        VkShaderModule fragShaderModule = shaderLibrary.load("shaders/frag.spv");
+
+        // The same constants go to both stages, each shader only declares the ones it uses.
+        PipelineVariantKey::SpecializationData specializationData = key.specializationData();
+        std::array<VkSpecializationMapEntry, 2> specializationEntries = PipelineVariantKey::specializationMapEntries();
+        VkSpecializationInfo specializationInfo{};
+        specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+        specializationInfo.pMapEntries = specializationEntries.data();
+        specializationInfo.dataSize = sizeof(specializationData);
+        specializationInfo.pData = &specializationData;
 
         VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
         vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
         vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
         vertShaderStageInfo.module = vertShaderModule;
         vertShaderStageInfo.pName = "main";
-        vertShaderStageInfo.pSpecializationInfo = nullptr; // We can provide shader constants here for better perfomance. This is nullptr by default
+        vertShaderStageInfo.pSpecializationInfo = &specializationInfo; // shader constants, the driver compiles the disabled features out
 
         VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
         fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
         fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
         fragShaderStageInfo.module = fragShaderModule;
         fragShaderStageInfo.pName = "main";
+        fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
 
         VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo,fragShaderStageInfo };
 
@@ -637,16 +1696,26 @@ private:
         dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
         dynamicState.pDynamicStates = dynamicStates.data();
 
+        // binding 0 advances per vertex, binding 1 per instance
+        std::array<VkVertexInputBindingDescription, 2> bindingDescriptions = { Vertex::getBindingDescription(), InstanceData::getBindingDescription() };
+        std::vector<VkVertexInputAttributeDescription> attributeDescriptions;
+        for (const auto& attribute : Vertex::getAttributeDescriptions()) {
+            attributeDescriptions.push_back(attribute);
+        }
+        for (const auto& attribute : InstanceData::getAttributeDescriptions()) {
+            attributeDescriptions.push_back(attribute);
+        }
+
         VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
         vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-        vertexInputInfo.vertexBindingDescriptionCount = 0;
-        vertexInputInfo.vertexAttributeDescriptionCount = 0;
-        vertexInputInfo.pVertexAttributeDescriptions = nullptr; // Here struct Arrays can be specified on how to load the verticies. We do not load any verticies at the moment though!
-        vertexInputInfo.pVertexBindingDescriptions = nullptr;
+        vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
+        vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
+        vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data(); // how to read one vertex out of the vertex buffer
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 
         VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
         inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // This will use every 3 verticies to draw one rectangle. No verticies are reused for other triangles!
+        inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST; // This will use every 3 indices to draw one triangle. Vertices are shared between triangles through the index buffer.
         inputAssembly.primitiveRestartEnable = VK_FALSE; // We draw only triangles, no meshes, models, ... Thus we do not need this optimization. This should definetly enabled for Games though!
 
         VkPipelineViewportStateCreateInfo viewportState{};
@@ -660,23 +1729,30 @@ private:
         rasterizer.rasterizerDiscardEnable = VK_FALSE; // If True, Geometry won't be rasterized thus we won't see our Triangle.
         rasterizer.polygonMode = VK_POLYGON_MODE_FILL; // We want to fill our Trianlges, could also show only the points or edges. Not using fill requires a GPU Feature to be enabled.
         rasterizer.lineWidth = 1.0f; // Set the width of drawn lines to "1 pixel". Larger values than 1 require the "wideLines" GPU Feature to be enabled.
-        rasterizer.cullMode = VK_CULL_MODE_BACK_BIT; // We only want to see Faces from the front.
+        rasterizer.cullMode = key.cullMode; // Back by default, we only want to see Faces from the front.
         rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE; // Faces with positives areas are considered front facing, could also be set the other way around.
         rasterizer.depthBiasEnable = VK_FALSE; // We do not want to alter depth values, thus set to false.
 
         VkPipelineMultisampleStateCreateInfo multisampling{};
         multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
         multisampling.sampleShadingEnable = VK_FALSE; 
-        multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT; // We disable Antialising for now.
+        multisampling.rasterizationSamples = key.samples; // Has to match the render pass.
 
-        // VkPipelineDepthStencilStateCreateInfo If we want to use a depth or stencil buffer we could add that here
+        // LESS_OR_EQUAL: the triangles are all at the same depth, so they keep drawing over each other in submission order
+        VkPipelineDepthStencilStateCreateInfo depthStencil{};
+        depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+        depthStencil.depthTestEnable = VK_TRUE;
+        depthStencil.depthWriteEnable = key.blend ? VK_FALSE : VK_TRUE; // translucent geometry must not hide what is drawn behind it later
+        depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+        depthStencil.depthBoundsTestEnable = VK_FALSE;
+        depthStencil.stencilTestEnable = VK_FALSE;
 
         VkPipelineColorBlendAttachmentState colorBlendAttachment{};
         colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-        colorBlendAttachment.blendEnable = VK_FALSE; // We shall not blend just draw it without belnding anything -> just use the new thing from the fragment shader
+        colorBlendAttachment.blendEnable = key.blend ? VK_TRUE : VK_FALSE; // Without blending we just use the new thing from the fragment shader
         colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-        colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
-        colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ZERO; // Do not give a fuck about the value already in the framebuffer
+        colorBlendAttachment.srcColorBlendFactor = key.blend ? VK_BLEND_FACTOR_SRC_ALPHA : VK_BLEND_FACTOR_ONE;
+        colorBlendAttachment.dstColorBlendFactor = key.blend ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA : VK_BLEND_FACTOR_ZERO; // Opaque does not give a fuck about the value already in the framebuffer
         colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
         colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
         colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
@@ -687,14 +1763,6 @@ private:
         colorBlending.attachmentCount = 1;
         colorBlending.pAttachments = &colorBlendAttachment;
 
-        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO; 
-        // Uniforms have to be bound here but we do not have any.
-
-        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create pipeline layout!");
-        }
-
         VkGraphicsPipelineCreateInfo pipelineInfo{};
         pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
         pipelineInfo.stageCount = 2;
@@ -704,236 +1772,1868 @@ private:
         pipelineInfo.pViewportState = &viewportState;
         pipelineInfo.pRasterizationState = &rasterizer;
         pipelineInfo.pMultisampleState = &multisampling;
-        pipelineInfo.pDepthStencilState = nullptr;
+        pipelineInfo.pDepthStencilState = depthFormat != VK_FORMAT_UNDEFINED ? &depthStencil : nullptr;
         pipelineInfo.pColorBlendState = &colorBlending;
         pipelineInfo.pDynamicState = &dynamicState;
         pipelineInfo.layout = pipelineLayout;
-        pipelineInfo.renderPass = renderPass;
+        pipelineInfo.renderPass = renderPasses.at(key.samples); // any render pass with the same attachments works with the pipeline
         pipelineInfo.subpass = 0; // index of subpass we want to use
         
 
-        if(vkCreateGraphicsPipelines(device,VK_NULL_HANDLE,1,&pipelineInfo,nullptr,&graphicsPipeline)!=VK_SUCCESS){
-            throw std::runtime_error("Failed to create graphics pipeline!");
+        // the pipeline cache is internally synchronized, several compile threads can use it at once
+        VkPipeline pipeline;
+        if(vkCreateGraphicsPipelines(device,pipelineCache,1,&pipelineInfo,nullptr,&pipeline)!=VK_SUCCESS){
+            throw std::runtime_error("Failed to create graphics pipeline variant " + key.name() + "!");
         }
-
-        // The shader modules can be destroyed after the creation of the GraphicsPipeline:
-        vkDestroyShaderModule(device,vertShaderModule,nullptr); 
-        vkDestroyShaderModule(device,fragShaderModule,nullptr); 
+        return pipeline;
     }
 
-    VkShaderModule createShaderModule(const std::vector<char>& byteCode) {
-        VkShaderModuleCreateInfo createInfo{};
-        createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-        createInfo.codeSize = byteCode.size();
-        createInfo.pCode = reinterpret_cast<const uint32_t*>(byteCode.data()); //reinterpret_cast does not cast and just treats it as the new type. Thus this line is hella sus!
+    // Every blend, face culling and shader feature combination at the configured sample count.
+    std::vector<PipelineVariantKey> pipelineVariantSweep() const {
+        std::vector<PipelineVariantKey> keys;
+        for (bool blend : { false, true }) {
+            for (VkCullModeFlags cullMode : { VK_CULL_MODE_BACK_BIT, VK_CULL_MODE_NONE }) {
+                for (uint32_t features = 0; features <= SHADER_FEATURE_ALL; features++) {
+                    PipelineVariantKey key = config.pipelineVariant;
+                    key.blend = blend;
+                    key.cullMode = cullMode;
+                    key.shaderFeatures = features;
+                    keys.push_back(key);
+                }
+            }
+        }
+        return keys;
+    }
 
-        VkShaderModule shaderModule;
-        if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create shader module!");
+    // Switches to the requested pipeline variant once it is compiled, until then the frames draw with the one bound before.
+    void updatePipelineVariant() {
+        if (!variantSweepKeys.empty() && ++framesSinceVariantSwitch >= VARIANT_SWEEP_INTERVAL) {
+            framesSinceVariantSwitch = 0;
+            variantSweepIndex = (variantSweepIndex + 1) % variantSweepKeys.size();
+            requestedPipelineVariant = variantSweepKeys[variantSweepIndex];
+            requestedPipelineVariant.samples = msaaSamples; // the sweep may run inside an MSAA sweep pass
         }
-        //the byteCodeBuffer can not be freed!
 
-        return shaderModule;
-    }
+        bool fallback = false;
+        if (requestedPipelineVariant != boundPipelineVariant) {
+            try {
+                // A golden run never draws with a fallback, the image would depend on how fast the driver compiles.
+                VkPipeline pipeline = config.goldenMode != GoldenMode::None ? pipelineVariants.get(requestedPipelineVariant) : pipelineVariants.request(requestedPipelineVariant);
+                if (pipeline != VK_NULL_HANDLE) {
+                    graphicsPipeline = pipeline;
+                    boundPipelineVariant = requestedPipelineVariant;
+                    markCommandBuffersDirty();
+                }
+                else {
+                    fallback = true;
+                }
+            }
+            catch (const std::exception& e) {
+                // One broken variant must not end the run: keep drawing with the bound one and never ask for the broken one again.
+                std::cerr << "Pipeline variant " << requestedPipelineVariant.name() << " failed to compile, keeping "
+                    << boundPipelineVariant.name() << ": " << e.what() << std::endl;
+                if (!variantSweepKeys.empty()) { // the sweep asked for variantSweepKeys[variantSweepIndex], skip it from now on
+                    variantSweepKeys.erase(variantSweepKeys.begin() + variantSweepIndex);
+                    variantSweepIndex = variantSweepIndex > 0 ? variantSweepIndex - 1 : variantSweepKeys.size() - 1; // the next switch moves on to the one after it
+                }
+                requestedPipelineVariant = boundPipelineVariant;
+            }
+        }
+        profiler.recordSample("pipeline_fallback_frames", fallback ? 1.0 : 0.0);
 
-    VkViewport createViewport() {
-        VkViewport viewport{};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = static_cast<float>(swapChainExtent.width);
-        viewport.height = static_cast<float>(swapChainExtent.height);
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-        return viewport;
+        // compiles finish whenever they finish, so they are reported even during warmup
+        for (const PipelineCompileTime& time : pipelineVariants.takeCompileTimes()) {
+            if (!profiler.isEnabled()) continue;
+            profiler.report.addSample(profiler.seriesName(time.background ? "pipeline_compile_ms" : "pipeline_blocking_compile_ms"), time.milliseconds);
+        }
     }
 
-    VkRect2D createScissor() {
+    void createCullingPipeline() {
+        if (!gpuCullingSupported) {
+            std::cerr << "GPU culling needs compute on the graphics queue and drawIndirectFirstInstance, drawing every instance instead." << std::endl;
+            return;
+        }
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        if (config.drawCount > deviceProperties.limits.maxComputeWorkGroupCount[1]) { // the culling dispatch has one row of work groups per draw
+            throw std::runtime_error("Too many draws for GPU culling, the device dispatches at most " + std::to_string(deviceProperties.limits.maxComputeWorkGroupCount[1]) + " (maxComputeWorkGroupCount[1])!");
+        }
+        if (multiDrawIndirectSupported && config.drawCount > deviceProperties.limits.maxDrawIndirectCount) {
+            throw std::runtime_error("Too many draws for GPU culling, one indirect draw call takes at most " + std::to_string(deviceProperties.limits.maxDrawIndirectCount) + " (maxDrawIndirectCount)!");
+        }
+
+        // binding 0: all instances, 1: the visible ones, 2: the indirect draw commands, 3: the frame uniforms with the camera
+        std::vector<VkDescriptorSetLayoutBinding> bindings(4);
+        for (uint32_t i = 0; i < bindings.size(); i++) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = i < 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+        cullingDescriptorSetLayout = descriptorLayoutCache.getSetLayout(bindings);
+
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(CullingPushConstants);
+        cullingPipelineLayout = descriptorLayoutCache.getPipelineLayout({ cullingDescriptorSetLayout }, { pushConstantRange });
+
+        VkShaderModule cullShaderModule = shaderLibrary.load("shaders/cull.spv");
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = cullShaderModule;
+        pipelineInfo.stage.pName = "main";
+        pipelineInfo.layout = cullingPipelineLayout;
+        if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &cullingPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create culling pipeline!");
+        }
+    }
+
+    void createPipelineCache() {
+        std::vector<char> cacheData;
+        if (!config.pipelineCachePath.empty()) {
+            std::ifstream file(config.pipelineCachePath, std::ios::ate | std::ios::binary);
+            if (file.is_open()) {
+                cacheData.resize((size_t)file.tellg());
+                file.seekg(0);
+                file.read(cacheData.data(), cacheData.size());
+            }
+        }
+
+        if (!cacheData.empty() && !isPipelineCacheCompatible(cacheData)) {
+            std::cerr << "Discarding pipeline cache " << config.pipelineCachePath << " as it was written by a different device or driver." << std::endl;
+            cacheData.clear();
+        }
+        profiler.report.setMetric("pipeline_cache_loaded_bytes", static_cast<double>(cacheData.size()));
+
+        VkPipelineCacheCreateInfo cacheInfo{};
+        cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+        cacheInfo.initialDataSize = cacheData.size();
+        cacheInfo.pInitialData = cacheData.empty() ? nullptr : cacheData.data();
+
+        if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create pipeline cache!");
+        }
+    }
+
+    bool isPipelineCacheCompatible(const std::vector<char>& cacheData) {
+        // The driver should reject foreign blobs by itself, but not all of them do it gracefully. So we check the header ourselves.
+        VkPipelineCacheHeaderVersionOne header;
+        if (cacheData.size() < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, cacheData.data(), sizeof(header));
+
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+
+        return header.headerSize >= sizeof(header) &&
+            header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+            header.vendorID == deviceProperties.vendorID &&
+            header.deviceID == deviceProperties.deviceID &&
+            std::memcmp(header.pipelineCacheUUID, deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+    }
+
+    void savePipelineCache() {
+        if (config.pipelineCachePath.empty()) return;
+
+        size_t dataSize = 0;
+        if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+            return;
+        }
+        std::vector<char> cacheData(dataSize);
+        if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, cacheData.data()) != VK_SUCCESS) {
+            std::cerr << "Could not read back the pipeline cache!" << std::endl;
+            return;
+        }
+
+        // Write to a temporary file first, so a crash while writing never leaves a half written cache behind.
+        std::string tempPath = config.pipelineCachePath + ".tmp";
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                std::cerr << "Could not write pipeline cache to " << tempPath << std::endl;
+                return;
+            }
+            file.write(cacheData.data(), dataSize);
+        }
+        std::remove(config.pipelineCachePath.c_str()); // rename does not overwrite on Windows
+        if (std::rename(tempPath.c_str(), config.pipelineCachePath.c_str()) != 0) {
+            std::cerr << "Could not write pipeline cache to " << config.pipelineCachePath << std::endl;
+        }
+    }
+
+    VkViewport createViewport() {
+        VkViewport viewport{};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = static_cast<float>(swapChainExtent.width);
+        viewport.height = static_cast<float>(swapChainExtent.height);
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+        return viewport;
+    }
+
+    VkRect2D createScissor() {
         VkRect2D scissor{};
         scissor.offset = { 0,0 };
         scissor.extent = swapChainExtent;
         return scissor;
     }
 
-    void createFramebuffers() {
-        swapChainFramebuffers.resize(swapChainImageViews.size());
-        for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-            VkImageView attachments[] = {
-                swapChainImageViews[i]
-            };
+    void createCommandPool() {
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;   //learn more here: https://registry.khronos.org/vulkan/specs/1.3-extensions/man/html/VkCommandPoolCreateFlagBits.html
+        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create command pool!");
+        }
+    }
+
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Allocation& allocation,
+        AllocationStrategy strategy = AllocationStrategy::FreeList) {
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; // faster than CONCURRENT, uploads hand buffers over to the graphics queue explicitly
+
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create buffer!");
+        }
+
+        allocation = allocator.allocateForBuffer(buffer, properties, strategy);
+    }
+
+    bool hasDedicatedTransferQueue() const {
+        return transferQueueFamily != graphicsQueueFamily;
+    }
+
+    void createTransferResources() {
+        // Room for two frames of streaming, so the next frame can copy while the transfer queue still works on the last one.
+        VkDeviceSize streamBytes = static_cast<VkDeviceSize>(config.streamMegabytes) * 1024 * 1024;
+        stagingRingSize = std::max(DEFAULT_STAGING_RING_SIZE, 2 * streamBytes);
+
+        // HOST_COHERENT so we do not have to flush the mapped range after every memcpy. Linear since it lives as long as the app.
+        createBuffer(stagingRingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            stagingRingBuffer, stagingRingAllocation, AllocationStrategy::Linear);
+        stagingRingData = static_cast<char*>(stagingRingAllocation.mapped); // the allocator keeps host visible memory mapped
+
+        // Command buffers can only be submitted to queues of the family their pool was created for.
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+        poolInfo.queueFamilyIndex = transferQueueFamily;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to create transfer command pool!");
+        }
+
+        if (hasDedicatedTransferQueue()) {
+            ownershipCommandBuffers.resize(maxFramesInFlight);
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = maxFramesInFlight;
+            if (vkAllocateCommandBuffers(device, &allocInfo, ownershipCommandBuffers.data()) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to allocate ownership command buffers!");
+            }
+        }
+
+        if (streamBytes > 0) {
+            createBuffer(streamBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, streamBuffer, streamBufferAllocation);
+            streamSourceData.resize(static_cast<size_t>(streamBytes));
+            for (size_t i = 0; i < streamSourceData.size(); i++) {
+                streamSourceData[i] = static_cast<char>(i * 31); // anything but zeros, some drivers special case those
+            }
+        }
+    }
+
+    UploadBatch& beginUploadBatch() {
+        if (recordingBatch.commandBuffer != VK_NULL_HANDLE) return recordingBatch;
+
+        UploadBatch batch;
+        if (!freeBatches.empty()) {
+            batch = std::move(freeBatches.back());
+            freeBatches.pop_back();
+        }
+        else {
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = transferCommandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            allocInfo.commandBufferCount = 1;
+            if (vkAllocateCommandBuffers(device, &allocInfo, &batch.commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to allocate transfer command buffer!");
+            }
+        }
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to begin recording the transfer command buffer!");
+        }
+
+        // An earlier batch may still be writing the same range (streaming rewrites its buffer every frame).
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        recordingBatch = std::move(batch);
+        return recordingBatch;
+    }
+
+    // Finds size contiguous bytes in the staging ring, returns false if the ring is too full right now.
+    bool reserveStagingSpace(VkDeviceSize size, VkDeviceSize& offset, VkDeviceSize& consumed) {
+        size = (size + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+        if (stagingRingUsed == 0) {
+            stagingRingHead = 0; // empty, start at the front so nothing has to wrap
+        }
+        VkDeviceSize tail = (stagingRingHead + stagingRingSize - stagingRingUsed) % stagingRingSize; // oldest byte still in use
+
+        VkDeviceSize padding = 0;
+        if (stagingRingUsed > 0 && stagingRingHead <= tail) { // the used part wraps around, only the gap up to the tail is free
+            if (tail - stagingRingHead < size) return false;
+            offset = stagingRingHead;
+        }
+        else if (stagingRingSize - stagingRingHead >= size) {
+            offset = stagingRingHead;
+        }
+        else if (tail >= size) { // not enough room before the end, skip it and continue at the front
+            padding = stagingRingSize - stagingRingHead;
+            offset = 0;
+        }
+        else {
+            return false;
+        }
+
+        consumed = padding + size;
+        stagingRingHead = (offset + size) % stagingRingSize;
+        stagingRingUsed += consumed;
+        return true;
+    }
+
+    // Copies data into dstBuffer on the transfer queue. The copies are submitted by submitUploads() (or when the ring runs full).
+    // If the graphics queue reads the buffer, it acquires it with the first submit after the batch is done, see acquireFinishedUploads().
+    void uploadToBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0, bool usedByGraphics = true) {
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            // uploads larger than a quarter of the ring are split, so several batches can be in flight
+            VkDeviceSize chunkSize = std::min(size, stagingRingSize / 4);
+            VkDeviceSize ringOffset = 0;
+            VkDeviceSize consumed = 0;
+            while (!reserveStagingSpace(chunkSize, ringOffset, consumed)) {
+                waitForStagingSpace();
+            }
+            memcpy(stagingRingData + ringOffset, bytes, static_cast<size_t>(chunkSize));
+
+            UploadBatch& batch = beginUploadBatch();
+            VkBufferCopy copyRegion{};
+            copyRegion.srcOffset = ringOffset;
+            copyRegion.dstOffset = dstOffset;
+            copyRegion.size = chunkSize;
+            vkCmdCopyBuffer(batch.commandBuffer, stagingRingBuffer, dstBuffer, 1, &copyRegion);
+            batch.ringBytes += consumed;
+            batch.copiedBytes += chunkSize;
+            if (usedByGraphics) {
+                batch.transfers.push_back({ dstBuffer, dstOffset, chunkSize });
+            }
+
+            uploadedBytes += chunkSize;
+            bytes += chunkSize;
+            dstOffset += chunkSize;
+            size -= chunkSize;
+        }
+    }
+
+    // Submits the recorded copies to the transfer queue without waiting for them.
+    void submitUploads() {
+        if (recordingBatch.commandBuffer == VK_NULL_HANDLE) return;
+        UploadBatch batch = std::move(recordingBatch);
+        recordingBatch = UploadBatch();
+
+        if (hasDedicatedTransferQueue() && !batch.transfers.empty()) {
+            // Release half of the ownership transfer. The acquire on the graphics queue repeats the same ranges and family indices.
+            std::vector<VkBufferMemoryBarrier> barriers;
+            for (const BufferOwnershipTransfer& transfer : batch.transfers) {
+                VkBufferMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = 0; // ignored for a release, the acquire makes the data visible
+                barrier.srcQueueFamilyIndex = transferQueueFamily;
+                barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+                barrier.buffer = transfer.buffer;
+                barrier.offset = transfer.offset;
+                barrier.size = transfer.size;
+                barriers.push_back(barrier);
+            }
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+                0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+        }
+        else if (!batch.transfers.empty()) {
+            // Same queue: make the copies visible to the vertex input stage of everything submitted after this.
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+            vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+
+        if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to record transfer command buffer!");
+        }
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &batch.commandBuffer;
+        SubmitSync sync;
+        batch.timelineValue = transferTimeline->peekNextValue();
+        sync.signal(transferTimeline->semaphore(), batch.timelineValue);
+        sync.apply(submitInfo);
+
+        if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit transfer command buffer!");
+        }
+        transferTimeline->commitSubmitted(batch.timelineValue);
+        submittedBatches.push_back(std::move(batch));
+    }
+
+    void recycleUploadBatch(UploadBatch batch) {
+        batch.timelineValue = 0;
+        batch.ringBytes = 0;
+        batch.copiedBytes = 0;
+        batch.transfers.clear();
+        freeBatches.push_back(std::move(batch));
+    }
+
+    // Never blocks: frees the ring space of every batch the transfer queue has finished.
+    void retireFinishedUploads() {
+        while (!submittedBatches.empty() && transferTimeline->isComplete(submittedBatches.front().timelineValue)) {
+            UploadBatch batch = std::move(submittedBatches.front());
+            submittedBatches.pop_front();
+            stagingRingUsed -= batch.ringBytes;
+            pendingUploadStats.retiredBytes += batch.copiedBytes;
+
+            if (hasDedicatedTransferQueue() && !batch.transfers.empty()) {
+                pendingAcquires.push_back(std::move(batch)); // the graphics queue still has to acquire its buffers
+            }
+            else {
+                recycleUploadBatch(std::move(batch));
+            }
+        }
+    }
+
+    // The ring is full: wait for the oldest batch. This is the only way uploads can hold up a frame.
+    void waitForStagingSpace() {
+        auto waitStart = BenchmarkClock::now();
+        if (submittedBatches.empty()) {
+            if (recordingBatch.commandBuffer == VK_NULL_HANDLE) {
+                throw std::runtime_error("Staging ring is full without any pending uploads!");
+            }
+            submitUploads(); // the batch we are recording holds the whole ring
+        }
+        transferTimeline->wait(submittedBatches.front().timelineValue);
+        retireFinishedUploads();
+        pendingUploadStats.stallMs += millisecondsSince(waitStart);
+    }
+
+    // Submits and waits for everything uploaded so far, only meant for startup.
+    void waitForUploads() {
+        submitUploads();
+        transferTimeline->waitIdle();
+        retireFinishedUploads();
+    }
+
+    // Records the acquire half of the ownership transfers of all finished batches into this frame's ownership command buffer and makes
+    // the submit wait for the transfer timeline value of the last one. The batches are done already, so the graphics queue never
+    // actually waits for the transfer queue. Returns VK_NULL_HANDLE if there is nothing to acquire. Call releaseAcquiredUploads() once
+    // the submit went out.
+    VkCommandBuffer acquireFinishedUploads(SubmitSync& sync) {
+        retireFinishedUploads();
+        if (pendingAcquires.empty()) return VK_NULL_HANDLE;
+
+        std::vector<VkBufferMemoryBarrier> barriers;
+        for (const UploadBatch& batch : pendingAcquires) {
+            for (const BufferOwnershipTransfer& transfer : batch.transfers) {
+                VkBufferMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+                barrier.srcAccessMask = 0; // ignored for an acquire, the timeline wait already made the copies available
+                barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+                barrier.srcQueueFamilyIndex = transferQueueFamily;
+                barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+                barrier.buffer = transfer.buffer;
+                barrier.offset = transfer.offset;
+                barrier.size = transfer.size;
+                barriers.push_back(barrier);
+            }
+            sync.wait(transferTimeline->semaphore(), VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, batch.timelineValue); // merged into one wait for the highest value
+        }
+
+        VkCommandBuffer commandBuffer = ownershipCommandBuffers[currentFrame]; // the frame slot's last submit was waited for, so it is not in use anymore
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to begin recording the ownership command buffer!");
+        }
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+            0, nullptr, static_cast<uint32_t>(barriers.size()), barriers.data(), 0, nullptr);
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to record ownership command buffer!");
+        }
+        return commandBuffer;
+    }
+
+    void releaseAcquiredUploads() {
+        // The transfer queue is done with them and there is no binary semaphore left to consume, so they are free right away.
+        for (UploadBatch& batch : pendingAcquires) {
+            recycleUploadBatch(std::move(batch));
+        }
+        pendingAcquires.clear();
+    }
+
+    // Benchmark load for the transfer queue, also submits whatever else was uploaded this frame.
+    void streamAssets() {
+        retireFinishedUploads();
+        if (!streamSourceData.empty()) {
+            uploadToBuffer(streamBuffer, streamSourceData.data(), streamSourceData.size(), 0, false); // stays with the transfer queue
+        }
+        submitUploads();
+    }
+
+    void createGeometryBuffers() {
+        // DEVICE_LOCAL is the fastest memory for the GPU to read but usually not host visible, hence the staging copy.
+        VkDeviceSize vertexBufferSize = sizeof(vertices[0]) * vertices.size();
+        createBuffer(vertexBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vertexBuffer, vertexBufferAllocation);
+        uploadToBuffer(vertexBuffer, vertices.data(), vertexBufferSize);
+
+        VkDeviceSize indexBufferSize = sizeof(indices[0]) * indices.size();
+        createBuffer(indexBufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferAllocation);
+        uploadToBuffer(indexBuffer, indices.data(), indexBufferSize);
+        indexCount = static_cast<uint32_t>(indices.size());
+        meshBoundingRadius = boundingRadius(vertices);
+        scene.meshRadius = meshBoundingRadius;
+
+        // The first frame needs the geometry, waiting here only blocks the CPU during startup, not the graphics queue.
+        waitForUploads();
+        profiler.report.setMetric("upload_bytes", static_cast<double>(uploadedBytes));
+    }
+
+    // Makes sure the instance buffer of a frame slot holds the current scene. The slot must not be in use by the GPU.
+    void updateInstanceBuffer(uint32_t slot) {
+        if (instanceBuffers.size() <= slot) {
+            instanceBuffers.resize(frameSlotCount(), VK_NULL_HANDLE);
+            instanceBufferAllocations.resize(frameSlotCount());
+            instanceBufferCapacities.resize(frameSlotCount(), 0);
+            instanceBufferVersions.resize(frameSlotCount(), ~0ULL);
+        }
+
+        size_t instanceCount = cullMode == CullMode::Cpu ? visibleInstanceCount : scene.size();
+        if (instanceBuffers[slot] == VK_NULL_HANDLE || instanceCount > instanceBufferCapacities[slot]) {
+            if (instanceBuffers[slot] != VK_NULL_HANDLE) {
+                destroyBufferLater(instanceBuffers[slot], instanceBufferAllocations[slot]); // prerecorded command buffers of other images may still reference it
+            }
+            size_t capacity = std::max<size_t>({ instanceCount, instanceBufferCapacities[slot] * 2, 1 }); // doubling so a growing scene does not reallocate every frame
+            // STORAGE for the culling shader, which reads it instead of the vertex input
+            createBuffer(capacity * sizeof(InstanceData), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, instanceBuffers[slot], instanceBufferAllocations[slot]);
+            instanceBufferCapacities[slot] = capacity;
+            instanceBufferVersions[slot] = ~0ULL;
+            markCommandBuffersDirty();
+        }
+
+        if (instanceBufferVersions[slot] != instanceDataVersion()) {
+            // a million instances are ~28 MB, packed in parallel chunks
+            InstanceData* destination = static_cast<InstanceData*>(instanceBufferAllocations[slot].mapped);
+            if (cullMode == CullMode::Cpu) {
+                frameScheduler.parallelFor(static_cast<uint32_t>(chunkVisibleCounts.size()), [&](uint32_t chunk) {
+                    scene.pack(cullVisibleIndices.data() + chunk * CULL_CHUNK_SIZE, chunkVisibleCounts[chunk], destination + chunkVisibleOffsets[chunk]);
+                });
+            }
+            else {
+                uint32_t chunkCount = static_cast<uint32_t>((instanceCount + INSTANCE_UPLOAD_CHUNK_SIZE - 1) / INSTANCE_UPLOAD_CHUNK_SIZE);
+                frameScheduler.parallelFor(chunkCount, [&](uint32_t chunk) {
+                    size_t first = chunk * INSTANCE_UPLOAD_CHUNK_SIZE;
+                    scene.pack(first, std::min(INSTANCE_UPLOAD_CHUNK_SIZE, instanceCount - first), destination + first);
+                });
+            }
+            instanceBufferVersions[slot] = instanceDataVersion();
+        }
+        if (recordedInstanceCount != instanceCount) {
+            recordedInstanceCount = static_cast<uint32_t>(instanceCount); // the count is baked into vkCmdDrawIndexed
+            markCommandBuffersDirty();
+        }
+        if (cullMode == CullMode::Gpu) {
+            updateCullingSlot(slot);
+        }
+    }
+
+    void destroyBufferLater(VkBuffer buffer, Allocation allocation) {
+        deferDestruction([this, buffer, allocation]() mutable {
+            vkDestroyBuffer(device, buffer, nullptr);
+            allocator.free(allocation);
+        });
+    }
+
+    // Makes sure the culling output of a frame slot fits the scene and its descriptor set points at the current buffers.
+    void updateCullingSlot(uint32_t slot) {
+        if (cullingSlots.size() <= slot) {
+            cullingSlots.resize(frameSlotCount());
+        }
+        CullingSlot& culling = cullingSlots[slot];
+
+        if (culling.visibleInstances == VK_NULL_HANDLE || culling.visibleInstancesCapacity < instanceBufferCapacities[slot]) {
+            if (culling.visibleInstances != VK_NULL_HANDLE) {
+                destroyBufferLater(culling.visibleInstances, culling.visibleInstancesAllocation);
+            }
+            culling.visibleInstancesCapacity = instanceBufferCapacities[slot];
+            createBuffer(culling.visibleInstancesCapacity * sizeof(InstanceData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culling.visibleInstances, culling.visibleInstancesAllocation);
+            culling.descriptorSetDirty = true;
+        }
+        if (culling.drawCommands == VK_NULL_HANDLE || culling.drawCommandsCapacity < drawListSize()) {
+            if (culling.drawCommands != VK_NULL_HANDLE) {
+                destroyBufferLater(culling.drawCommands, culling.drawCommandsAllocation);
+            }
+            culling.drawCommandsCapacity = std::max(config.drawCount, 1u); // the most the draw list can ever hold
+            createBuffer(culling.drawCommandsCapacity * sizeof(VkDrawIndexedIndirectCommand),
+                VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, culling.drawCommands, culling.drawCommandsAllocation);
+            culling.descriptorSetDirty = true;
+        }
+        if (culling.descriptorSet == VK_NULL_HANDLE) {
+            culling.descriptorSet = descriptorAllocator.allocatePersistentSet(cullingDescriptorSetLayout);
+        }
+
+        if (!culling.descriptorSetDirty && culling.boundInstanceBuffer == instanceBuffers[slot]) return;
+        // Only this slot's command buffers use the set and the slot is not in use by the GPU right now.
+        std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+        bufferInfos[0] = { instanceBuffers[slot], 0, VK_WHOLE_SIZE };
+        bufferInfos[1] = { culling.visibleInstances, 0, VK_WHOLE_SIZE };
+        bufferInfos[2] = { culling.drawCommands, 0, VK_WHOLE_SIZE };
+        bufferInfos[3] = { uniformRing.buffer(), 0, sizeof(FrameUniforms) }; // the dynamic offset picks the frame
+        std::array<VkWriteDescriptorSet, 4> writes{};
+        for (uint32_t i = 0; i < writes.size(); i++) {
+            writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[i].dstSet = culling.descriptorSet;
+            writes[i].dstBinding = i;
+            writes[i].descriptorCount = 1;
+            writes[i].descriptorType = i < 3 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            writes[i].pBufferInfo = &bufferInfos[i];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+        culling.boundInstanceBuffer = instanceBuffers[slot];
+        culling.descriptorSetDirty = false;
+        markCommandBuffersDirty(); // command buffers that bound the set are invalid after an update
+    }
+
+    void createCommandBuffers() {
+        commandBuffers.resize(maxFramesInFlight);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate command buffers!");
+        }
+    }
+
+    void createPrerecordedCommandBuffers() {
+        prerecordedCommandBuffers.resize(swapChainImages.size());
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t)prerecordedCommandBuffers.size();
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, prerecordedCommandBuffers.data()) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate prerecorded command buffers!");
+        }
+        prerecordedDirty.assign(prerecordedCommandBuffers.size(), true); // recorded lazily on first use
+    }
+
+    void updateScene() {
+        auto now = BenchmarkClock::now();
+        float deltaSeconds = config.fixedTimestep > 0.0f ? config.fixedTimestep : std::chrono::duration<float>(now - lastSceneUpdate).count();
+        lastSceneUpdate = now;
+        sceneSeconds += deltaSeconds;
+        updateCamera();
+        if (!config.animate || scene.size() == 0) return;
+
+        uint32_t instanceCount = static_cast<uint32_t>(scene.size());
+        uint32_t chunkCount = (instanceCount + SCENE_UPDATE_CHUNK_SIZE - 1) / SCENE_UPDATE_CHUNK_SIZE;
+        frameScheduler.parallelFor(chunkCount, [&](uint32_t chunk) {
+            uint32_t first = chunk * SCENE_UPDATE_CHUNK_SIZE;
+            cullKernels.advanceRotations(scene.rotation.data(), first, std::min(SCENE_UPDATE_CHUNK_SIZE, instanceCount - first),
+                ANIMATION_RADIANS_PER_SECOND * deltaSeconds);
+        });
+        scene.markChanged();
+    }
+
+    // Circles over the grid close to its edge, so the culling has to find a different set of instances every frame.
+    void updateCamera() {
+        if (!config.cameraPan) return;
+        float radius = std::max(0.0f, config.worldSize - 1.0f / config.zoom);
+        float angle = sceneSeconds * CAMERA_PAN_RADIANS_PER_SECOND;
+        viewOffset[0] = radius * std::cos(angle);
+        viewOffset[1] = radius * std::sin(angle);
+        viewFrustum = Frustum2D::view(viewOffset[0], viewOffset[1], config.zoom);
+        viewVersion++;
+    }
+
+    // Frustum2D::clipSpace() as the camera sees it, for a camera that does not move.
+    void resetCamera() {
+        viewOffset[0] = 0.0f;
+        viewOffset[1] = 0.0f;
+        viewFrustum = Frustum2D::view(0.0f, 0.0f, config.zoom);
+        viewVersion++;
+    }
+
+    // CullMode::Cpu: finds the visible instances of the current scene. Only reads the scene, so it can run while we wait for the GPU.
+    void cullScene() {
+        if (cullMode != CullMode::Cpu || (culledSceneVersion == scene.version && culledViewVersion == viewVersion)) return;
+
+        size_t instanceCount = scene.size();
+        uint32_t chunkCount = static_cast<uint32_t>((instanceCount + CULL_CHUNK_SIZE - 1) / CULL_CHUNK_SIZE);
+        cullVisibleIndices.resize(instanceCount);
+        chunkVisibleCounts.resize(chunkCount);
+        frameScheduler.parallelFor(chunkCount, [&](uint32_t chunk) {
+            size_t first = static_cast<size_t>(chunk) * CULL_CHUNK_SIZE;
+            chunkVisibleCounts[chunk] = cullKernels.cullSpheres(viewFrustum, scene.positionX.data(), scene.positionY.data(), scene.boundingRadius.data(),
+                first, std::min<size_t>(CULL_CHUNK_SIZE, instanceCount - first), cullVisibleIndices.data() + first);
+        });
+
+        chunkVisibleOffsets.resize(chunkCount);
+        visibleInstanceCount = 0;
+        for (uint32_t chunk = 0; chunk < chunkCount; chunk++) {
+            chunkVisibleOffsets[chunk] = visibleInstanceCount;
+            visibleInstanceCount += chunkVisibleCounts[chunk];
+        }
+        culledSceneVersion = scene.version;
+        culledViewVersion = viewVersion;
+        cullResultVersion++;
+    }
+
+    // What the instance buffers have to hold: the scene, or with CPU culling what of it the camera sees.
+    uint64_t instanceDataVersion() const {
+        return cullMode == CullMode::Cpu ? cullResultVersion : scene.version;
+    }
+
+    void setRecordMode(RecordMode mode) {
+        recordMode = mode;
+        if (mode == RecordMode::Prerecorded && prerecordedCommandBuffers.empty()) {
+            createPrerecordedCommandBuffers();
+        }
+        markCommandBuffersDirty();
+    }
+
+    void setCullMode(CullMode mode) {
+        CullMode previousMode = cullMode;
+        cullMode = mode == CullMode::Gpu && cullingPipeline == VK_NULL_HANDLE ? CullMode::None : mode; // see createCullingPipeline()
+        culledSceneVersion = ~0ULL;
+        instanceBufferVersions.assign(instanceBufferVersions.size(), ~0ULL); // culled or not, the instance buffers hold something else now
+        if (frameGraph && cullMode != previousMode) {
+            rebuildFrameGraph(); // the culling passes come or go
+        }
+        markCommandBuffersDirty();
+    }
+
+    void setRecordThreadCount(uint32_t threadCount) {
+        recordThreadCount = threadCount;
+        markCommandBuffersDirty();
+    }
+
+    // Pools are created lazily since the number of frame slots and threads can change at runtime.
+    void createThreadRecordingResources(uint32_t frameSlot) {
+        if (threadRecordingResources.size() < frameSlotCount()) {
+            threadRecordingResources.resize(frameSlotCount());
+        }
+        std::vector<ThreadRecordingResources>& slotResources = threadRecordingResources[frameSlot];
+        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+
+        while (slotResources.size() < recordThreadCount) {
+            ThreadRecordingResources resources{};
+
+            VkCommandPoolCreateInfo poolInfo{};
+            poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+            poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // no RESET_COMMAND_BUFFER_BIT, we reset the whole pool which is cheaper
+            poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+
+            if (vkCreateCommandPool(device, &poolInfo, nullptr, &resources.commandPool) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create recording thread command pool!");
+            }
+
+            VkCommandBufferAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = resources.commandPool;
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = 1;
+
+            if (vkAllocateCommandBuffers(device, &allocInfo, &resources.commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to allocate secondary command buffer!");
+            }
+            slotResources.push_back(resources);
+        }
+    }
+
+    // Call whenever something the recorded commands depend on changes (scene content, swap chain, pipeline).
+    void markCommandBuffersDirty() {
+        prerecordedDirty.assign(prerecordedCommandBuffers.size(), true);
+    }
+
+    // Sub-allocated like every other buffer, host visible blocks stay mapped, so writing uniforms is a plain memcpy.
+    void createUniformRing() {
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        createBuffer(UNIFORM_RING_BYTES_PER_FRAME * UNIFORM_RING_FRAME_CAPACITY, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformRingBuffer, uniformRingAllocation);
+        uniformRing.init(uniformRingBuffer, uniformRingAllocation.mapped, UNIFORM_RING_BYTES_PER_FRAME, UNIFORM_RING_FRAME_CAPACITY,
+            deviceProperties.limits.minUniformBufferOffsetAlignment);
+
+        // The set only names the ring buffer, so it never changes: prerecorded and dynamic command buffers of every slot bind it
+        frameDescriptorSet = descriptorAllocator.allocatePersistentSet(frameDescriptorSetLayout);
+        writeFrameDescriptorSet(frameDescriptorSet);
+    }
+
+    // The slot must not be in use by the GPU. Writes its frame uniforms, the dynamic offset points its command buffer at them.
+    void updateFrameUniforms(uint32_t slot) {
+        if (frameUniformOffsets.size() <= slot) {
+            frameUniformOffsets.resize(frameSlotCount(), 0);
+        }
+
+        uniformRing.beginFrame(slot);
+        FrameUniforms uniforms{ { viewOffset[0], viewOffset[1] }, config.zoom, sceneSeconds };
+        frameUniformOffsets[slot] = uniformRing.push(uniforms); // always the start of the slot's region
+    }
+
+    void writeFrameDescriptorSet(VkDescriptorSet descriptorSet) {
+        VkDescriptorBufferInfo bufferInfo{ uniformRing.buffer(), 0, sizeof(FrameUniforms) }; // the dynamic offset picks the frame
+        VkWriteDescriptorSet write{};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = descriptorSet;
+        write.dstBinding = 0;
+        write.descriptorCount = 1;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        write.pBufferInfo = &bufferInfo;
+        vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+    }
+
+    // Everything the command buffer of imageIndex reads has to be up to date before recording.
+    void prepareFrameResources(uint32_t imageIndex) {
+        // Wait for the frame that last rendered this image. Usually that was this frame slot's last frame, which is done already.
+        graphicsTimeline.wait(imageTimelineValues[imageIndex]);
+        if (config.readback) { // the copy at the end of this frame overwrites the slot's buffer
+            auto waitStart = BenchmarkClock::now();
+            readbackWriter.waitForSlot(frameSlotFor(imageIndex));
+            frameReadbackStallMs += millisecondsSince(waitStart);
+        }
+        readGpuQueries(frameSlotFor(imageIndex)); // this frame resets the slot's query pools
+        updateFrameUniforms(frameSlotFor(imageIndex));
+        updateInstanceBuffer(frameSlotFor(imageIndex));
+    }
+
+    VkCommandBuffer prepareCommandBuffer(uint32_t imageIndex) {
+        if (recordMode == RecordMode::Prerecorded) {
+            if (prerecordedDirty[imageIndex]) {
+                // No SIMULTANEOUS_USE needed, prepareFrameResources() waited for the image's last frame, so the buffer is never pending here
+                vkResetCommandBuffer(prerecordedCommandBuffers[imageIndex], 0);
+                recordCommandBuffer(prerecordedCommandBuffers[imageIndex], imageIndex);
+                prerecordedDirty[imageIndex] = false;
+            }
+            return prerecordedCommandBuffers[imageIndex];
+        }
+
+        vkResetCommandBuffer(commandBuffers[currentFrame], 0);
+        recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        return commandBuffers[currentFrame];
+    }
+
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, VkCommandBufferUsageFlags usage = 0) {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = usage;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to begin recording the command buffer!");
+        }
+
+        // Queries have to be reset outside of a render pass before they can be written again.
+        uint32_t frameSlot = frameSlotFor(imageIndex);
+        if (gpuTimestampsSupported) {
+            vkCmdResetQueryPool(commandBuffer, timestampQueryPools[frameSlot], 0, TIMESTAMP_QUERY_COUNT);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPools[frameSlot], 0);
+        }
+        if (pipelineStatisticsActive()) {
+            vkCmdResetQueryPool(commandBuffer, pipelineStatisticsQueryPools[frameSlot], 0, 1);
+            vkCmdBeginQuery(commandBuffer, pipelineStatisticsQueryPools[frameSlot], 0, 0);
+        }
+
+        if (gpuTimestampsSupported && cullMode != CullMode::Gpu) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPools[frameSlot], 1); // no culling pass to wait for
+        }
+
+        RenderGraphFrame frame;
+        frame.imageIndex = imageIndex;
+        frame.frameSlot = frameSlot;
+        frame.usage = usage;
+        frame.bindImage(swapChainTarget, swapChainImages[imageIndex], swapChainImageViews[imageIndex]);
+        frameGraph->execute(commandBuffer, frame);
+
+        if (pipelineStatisticsActive()) {
+            vkCmdEndQuery(commandBuffer, pipelineStatisticsQueryPools[frameSlot], 0);
+        }
+        if (gpuTimestampsSupported && !config.readback) { // the readback pass writes it before its copy
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPools[frameSlot], 2);
+        }
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to record command buffer!");
+        }
+    }
+
+    // The scene pass of the frame graph, inside its render pass.
+    void recordScene(const RenderGraphContext& context) {
+        uint32_t frameSlot = context.frame->frameSlot;
+        if (recordThreadCount > 0) {
+            std::vector<VkCommandBuffer> secondaryCommandBuffers = recordSecondaryCommandBuffers(frameSlot, context);
+            vkCmdExecuteCommands(context.commandBuffer, static_cast<uint32_t>(secondaryCommandBuffers.size()), secondaryCommandBuffers.data());
+            return;
+        }
+        recordDraws(context.commandBuffer, frameSlot, 0, drawListSize());
+    }
+
+    // The draw list: the scene's instances split into config.drawCount draw calls (fewer if there are not enough instances).
+    uint32_t drawListSize() const {
+        return std::max<uint32_t>(1, std::min(config.drawCount, recordedInstanceCount));
+    }
+
+    // Records draws [firstDraw, lastDraw) of the draw list. Everything a secondary command buffer needs is bound again since nothing is inherited.
+    void recordDraws(VkCommandBuffer commandBuffer, uint32_t frameSlot, uint32_t firstDraw, uint32_t lastDraw) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+
+        VkViewport viewport = createViewport();
+        VkRect2D scissor = createScissor();
+
+        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+        VkBuffer instances = cullMode == CullMode::Gpu ? cullingSlots[frameSlot].visibleInstances : instanceBuffers[frameSlot];
+        VkBuffer vertexBuffers[] = { vertexBuffer, instances };
+        VkDeviceSize offsets[] = { 0, 0 };
+        vkCmdBindVertexBuffers(commandBuffer, 0, 2, vertexBuffers, offsets);
+        vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT16); // uint16 is enough for up to 65535 vertices and halves the index bandwidth
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &frameDescriptorSet, 1, &frameUniformOffsets[frameSlot]);
+
+        if (cullMode == CullMode::Gpu) {
+            // The culling pass wrote how many instances of each draw are visible, the CPU never looks at them.
+            pushDrawConstants(commandBuffer, firstDraw); // one tint per indirect batch
+            VkBuffer drawCommands = cullingSlots[frameSlot].drawCommands;
+            uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+            if (multiDrawIndirectSupported) {
+                vkCmdDrawIndexedIndirect(commandBuffer, drawCommands, firstDraw * stride, lastDraw - firstDraw, stride);
+                return;
+            }
+            for (uint32_t draw = firstDraw; draw < lastDraw; draw++) {
+                vkCmdDrawIndexedIndirect(commandBuffer, drawCommands, draw * stride, 1, stride);
+            }
+            return;
+        }
+
+        // Many instances per draw call instead of one call per object, firstInstance selects the slice of the instance buffer
+        uint32_t drawCount = drawListSize();
+        for (uint32_t draw = firstDraw; draw < lastDraw; draw++) {
+            uint32_t firstInstance = static_cast<uint32_t>(static_cast<uint64_t>(recordedInstanceCount) * draw / drawCount);
+            uint32_t endInstance = static_cast<uint32_t>(static_cast<uint64_t>(recordedInstanceCount) * (draw + 1) / drawCount);
+            if (draw == firstDraw || config.shadeDraws) {
+                pushDrawConstants(commandBuffer, draw);
+            }
+            vkCmdDrawIndexed(commandBuffer, indexCount, endInstance - firstInstance, 0, 0, firstInstance);
+        }
+    }
+
+    void pushDrawConstants(VkCommandBuffer commandBuffer, uint32_t draw) {
+        DrawPushConstants constants{ { 1.0f, 1.0f, 1.0f, 1.0f } };
+        if (config.shadeDraws) {
+            // a few distinct tints, neighbouring draws never get the same one
+            static const float shades[][3] = { { 1.0f, 0.4f, 0.4f }, { 0.4f, 1.0f, 0.4f }, { 0.4f, 0.4f, 1.0f }, { 1.0f, 1.0f, 0.3f }, { 0.3f, 1.0f, 1.0f }, { 1.0f, 0.3f, 1.0f } };
+            const float* shade = shades[draw % 6];
+            constants = { { shade[0], shade[1], shade[2], 1.0f } };
+        }
+        vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants), &constants);
+    }
+
+    // Copies the rendered image into the frame slot's readback buffer, the host reads it once the frame's timeline value is reached.
+    // The frame graph put the image into TRANSFER_SRC_OPTIMAL on the way out of the render pass and makes the copy visible to the host.
+    void recordReadback(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t frameSlot) {
+        if (gpuTimestampsSupported) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPools[frameSlot], 2); // the render pass is done, the copy is not part of it
+        }
+        VkBufferImageCopy region{};
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffers[frameSlot], 1, &region);
+    }
+
+    // Culls into the indirect draws of the frame slot. The frame graph cleared them before and makes them visible to the draws after.
+    void recordCullingPass(VkCommandBuffer commandBuffer, uint32_t frameSlot) {
+        const CullingSlot& culling = cullingSlots[frameSlot];
+        uint32_t drawCount = drawListSize();
+        CullingPushConstants pushConstants{ recordedInstanceCount, drawCount, indexCount, meshBoundingRadius };
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullingPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullingPipelineLayout, 0, 1, &culling.descriptorSet, 1, &frameUniformOffsets[frameSlot]);
+        vkCmdPushConstants(commandBuffer, cullingPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+        // one row of workgroups per draw, wide enough for the largest one
+        uint32_t largestDraw = (recordedInstanceCount + drawCount - 1) / drawCount;
+        vkCmdDispatch(commandBuffer, std::max(1u, (largestDraw + CULLING_WORKGROUP_SIZE - 1) / CULLING_WORKGROUP_SIZE), drawCount, 1);
+    }
+
+    std::vector<VkCommandBuffer> recordSecondaryCommandBuffers(uint32_t frameSlot, const RenderGraphContext& context) {
+        createThreadRecordingResources(frameSlot);
+        std::vector<ThreadRecordingResources>& slotResources = threadRecordingResources[frameSlot];
+
+        VkCommandBufferInheritanceInfo inheritanceInfo{};
+        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        inheritanceInfo.renderPass = context.renderPass;
+        inheritanceInfo.subpass = context.subpass;
+        inheritanceInfo.framebuffer = context.framebuffer; // optional, but knowing it may let the driver record better commands
+        inheritanceInfo.pipelineStatistics = pipelineStatisticsActive() ? PIPELINE_STATISTICS_FLAGS : 0;
+
+        uint32_t drawCount = drawListSize();
+        frameScheduler.parallelFor(recordThreadCount, [&](uint32_t slice) {
+            // The frame slot is not in use by the GPU anymore, so the whole pool can be recycled at once.
+            vkResetCommandPool(device, slotResources[slice].commandPool, 0);
+
+            VkCommandBufferBeginInfo beginInfo{};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            beginInfo.flags = context.frame->usage | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT; // executed entirely inside the render pass
+            beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+            VkCommandBuffer commandBuffer = slotResources[slice].commandBuffer;
+            if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to begin recording a secondary command buffer!");
+            }
+            // contiguous slices keep each thread's instance data in one piece of memory
+            uint32_t firstDraw = static_cast<uint32_t>(static_cast<uint64_t>(drawCount) * slice / recordThreadCount);
+            uint32_t lastDraw = static_cast<uint32_t>(static_cast<uint64_t>(drawCount) * (slice + 1) / recordThreadCount);
+            recordDraws(commandBuffer, frameSlot, firstDraw, lastDraw);
+            if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to record a secondary command buffer!");
+            }
+        });
+
+        std::vector<VkCommandBuffer> commandBuffers;
+        for (uint32_t slice = 0; slice < recordThreadCount; slice++) {
+            commandBuffers.push_back(slotResources[slice].commandBuffer);
+        }
+        return commandBuffers;
+    }
+
+    void createSyncObjects() {
+        // Value 0 is complete from the start, so the first wait of every frame slot returns right away.
+        frameTimelineValues.assign(maxFramesInFlight, 0);
+        if (config.headless) return; // the binary semaphores are only for acquiring and presenting swap chain images
+
+        imageAvailableSemaphores.resize(maxFramesInFlight);
+        renderFinishedSemaphores.resize(maxFramesInFlight);
+
+        VkSemaphoreCreateInfo semaphoreInfo{};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+        for (uint32_t i = 0; i < maxFramesInFlight; i++)
+        {
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
+                vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS) {
+                throw std::runtime_error("Failed to create semaphores (synchronization objects)!");
+            }
+        }
+    }
+
+    // Blocks until the frame slot's previous frame is done, the start of every frame.
+    void waitForFrameSlot() {
+        graphicsTimeline.wait(frameTimelineValues[currentFrame]);
+        recordGpuTimings();
+        destroyRetiredResources();
+    }
+
+    // Submits the frame's command buffers, signaling the next graphics timeline value (and renderFinished when presenting).
+    void submitFrame(uint32_t imageIndex, VkCommandBuffer commandBuffer) {
+        SubmitSync sync;
+        if (!config.headless) {
+            sync.wait(imageAvailableSemaphores[currentFrame], VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT); // wait before outputing/storing the image. This means vertex shader can run before ^^
+        }
+        std::vector<VkCommandBuffer> submitCommandBuffers;
+        VkCommandBuffer ownershipCommandBuffer = acquireFinishedUploads(sync);
+        if (ownershipCommandBuffer != VK_NULL_HANDLE) {
+            submitCommandBuffers.push_back(ownershipCommandBuffer);
+        }
+        submitCommandBuffers.push_back(commandBuffer);
+
+        uint64_t frameValue = graphicsTimeline.peekNextValue();
+        sync.signal(graphicsTimeline.semaphore(), frameValue);
+        if (!config.headless) {
+            sync.signal(renderFinishedSemaphores[currentFrame]);
+        }
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = static_cast<uint32_t>(submitCommandBuffers.size());
+        submitInfo.pCommandBuffers = submitCommandBuffers.data();
+        sync.apply(submitInfo);
+
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit draw command buffer into graphics queue!");
+        }
+        graphicsTimeline.commitSubmitted(frameValue);
+        frameTimelineValues[currentFrame] = frameValue;
+        imageTimelineValues[imageIndex] = frameValue;
+        lastSubmittedImage = imageIndex;
+        if (config.readback) {
+            uint32_t frameSlot = frameSlotFor(imageIndex);
+            ReadbackFrame frame;
+            frame.frameNumber = readbackFrameNumber++;
+            frame.data = readbackAllocations[frameSlot].mapped;
+            frame.width = swapChainExtent.width;
+            frame.height = swapChainExtent.height;
+            frame.rowPitch = static_cast<size_t>(swapChainExtent.width) * 4;
+            frame.format = swapChainImageFormat;
+            frame.measured = frameTasks.measured;
+            readbackWriter.submit(frameSlot, frameValue, frame);
+        }
+        if (gpuTimestampsSupported || pipelineStatisticsSupported) {
+            querySlotTimelineValues[frameSlotFor(imageIndex)] = frameValue; // keyed like the pools the command buffer wrote
+        }
+        releaseAcquiredUploads();
+    }
+
+    void createReadbackBuffers() {
+        if (!config.readback) return;
+        // HOST_CACHED makes the CPU reads fast (uncached memory is read a word at a time across the bus), COHERENT spares us
+        // invalidating sub-allocated ranges by hand. Fall back to plain coherent memory if the device has no such type.
+        VkMemoryPropertyFlags cachedFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        for (uint32_t i = 0; i < physicalDeviceInfo.memory.memoryTypeCount; i++) {
+            if ((physicalDeviceInfo.memory.memoryTypes[i].propertyFlags & cachedFlags) == cachedFlags) {
+                properties = cachedFlags;
+                break;
+            }
+        }
+
+        VkDeviceSize frameBytes = static_cast<VkDeviceSize>(swapChainExtent.width) * swapChainExtent.height * 4; // every offscreen format has 4 byte pixels
+        readbackBuffers.resize(frameSlotCount());
+        readbackAllocations.resize(frameSlotCount());
+        for (uint32_t slot = 0; slot < frameSlotCount(); slot++) {
+            createBuffer(frameBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties, readbackBuffers[slot], readbackAllocations[slot]);
+        }
+
+        if (!config.readbackPath.empty()) {
+            frameEncoder.open(config.readbackPath, config.readbackFormat.value_or(frameOutputFormatForPath(config.readbackPath)),
+                swapChainExtent.width, swapChainExtent.height, config.readbackFps, config.simdLevel.value_or(bestSimdLevel()));
+        }
+        readbackWriter.start(graphicsTimeline, frameSlotCount(), [this](const ReadbackFrame& frame) { consumeReadbackFrame(frame); });
+        readbackMemoryCached = (properties & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) != 0;
+    }
+
+    // Runs on the writer thread. Without a file the pixels are still read, so the numbers include getting them out of host memory.
+    void consumeReadbackFrame(const ReadbackFrame& frame) {
+        if (frameEncoder.isOpen()) {
+            frameEncoder.encode(frame); // straight from the mapped buffer
+            return;
+        }
+        const uint64_t* words = static_cast<const uint64_t*>(frame.data);
+        uint64_t checksum = 0;
+        for (size_t i = 0; i < frame.byteCount() / sizeof(uint64_t); i++) {
+            checksum += words[i];
+        }
+        readbackChecksum = checksum;
+    }
+
+    // Blocks until every submitted frame was consumed and the encoder handed it to the OS.
+    void flushReadback() {
+        if (!readbackWriter.isRunning()) return;
+        readbackWriter.flush();
+        if (frameEncoder.isOpen()) {
+            frameEncoder.flush();
+        }
+    }
+
+    // Copies a rendered offscreen image into host memory. Waits for the device, only meant for checks after a run.
+    RgbImage readbackImage(uint32_t imageIndex) {
+        VkDeviceSize rowPitch = static_cast<VkDeviceSize>(swapChainExtent.width) * 4; // every offscreen format has 4 byte pixels
+        VkBuffer readbackBuffer;
+        Allocation readbackAllocation;
+        createBuffer(rowPitch * swapChainExtent.height, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            readbackBuffer, readbackAllocation);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+        VkCommandBuffer commandBuffer;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to allocate readback command buffer!");
+        }
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to begin recording the readback command buffer!");
+        }
+
+        // The render pass left the image in TRANSFER_SRC_OPTIMAL, only the color writes have to be made visible to the copy.
+        VkImageMemoryBarrier imageBarrier{};
+        imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        imageBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        imageBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        imageBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        imageBarrier.image = swapChainImages[imageIndex];
+        imageBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier);
+
+        VkBufferImageCopy region{};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0; // tightly packed
+        region.bufferImageHeight = 0;
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer, 1, &region);
+
+        VkBufferMemoryBarrier bufferBarrier{};
+        bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        bufferBarrier.buffer = readbackBuffer;
+        bufferBarrier.offset = 0;
+        bufferBarrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to record readback command buffer!");
+        }
+
+        SubmitSync sync;
+        uint64_t readbackValue = graphicsTimeline.peekNextValue();
+        sync.signal(graphicsTimeline.semaphore(), readbackValue);
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+        sync.apply(submitInfo);
+        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+            throw std::runtime_error("Failed to submit readback command buffer!");
+        }
+        graphicsTimeline.commitSubmitted(readbackValue);
+        graphicsTimeline.wait(readbackValue);
+
+        bool bgra = swapChainImageFormat == VK_FORMAT_B8G8R8A8_SRGB || swapChainImageFormat == VK_FORMAT_B8G8R8A8_UNORM;
+        RgbImage image = rgbFromPixels(readbackAllocation.mapped, swapChainExtent.width, swapChainExtent.height, static_cast<size_t>(rowPitch), bgra);
 
-            VkFramebufferCreateInfo framebufferInfo{};
-            framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-            framebufferInfo.renderPass = renderPass;
-            framebufferInfo.attachmentCount = 1;
-            framebufferInfo.pAttachments = attachments;
-            framebufferInfo.width = swapChainExtent.width;
-            framebufferInfo.height = swapChainExtent.height;
-            framebufferInfo.layers = 1;
+        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+        vkDestroyBuffer(device, readbackBuffer, nullptr);
+        allocator.free(readbackAllocation);
+        return image;
+    }
 
-            if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swapChainFramebuffers[i]) != VK_SUCCESS) {
-                throw std::runtime_error("Failed to create framebuffer!");
-            }
+    // Reads the last frame back and writes it as the golden image or compares it against the golden image.
+    void checkGoldenImage() {
+        if (config.goldenMode == GoldenMode::None) return;
+        vkDeviceWaitIdle(device);
+        RgbImage frame = readbackImage(lastSubmittedImage);
+        frame.comment = std::string("rendered on ") + physicalDeviceInfo.properties.deviceName;
+        profiler.report.setInfo("golden_image", config.goldenPath);
+
+        if (config.goldenMode == GoldenMode::Capture) {
+            writePpm(config.goldenPath, frame);
+            std::cerr << "Wrote golden image " << config.goldenPath << std::endl;
+            profiler.report.setInfo("golden", "captured");
+            return;
+        }
+
+        RgbImage golden = readPpm(config.goldenPath);
+        if (golden.comment != frame.comment) { // another rasterizer rounds differently, that is not a regression
+            std::cerr << "Golden image was " << golden.comment << ", this run was " << frame.comment << ", expect small differences" << std::endl;
+        }
+        ImageDiff diff = compareImages(frame, golden, config.goldenTolerance);
+        double mismatchedPercent = diff.mismatchedPercent(golden);
+        goldenPassed = mismatchedPercent <= config.goldenMaxMismatchPercent;
+        profiler.report.setInfo("golden", goldenPassed ? "pass" : "fail");
+        profiler.report.setMetric("golden_mismatched_pixels", static_cast<double>(diff.mismatchedPixels));
+        profiler.report.setMetric("golden_mismatched_percent", mismatchedPercent);
+        profiler.report.setMetric("golden_max_channel_difference", diff.maxChannelDifference);
+        profiler.report.setMetric("golden_mean_absolute_error", diff.meanAbsoluteError);
+
+        if (goldenPassed) {
+            std::cerr << "Frame matches golden image " << config.goldenPath << " (" << diff.mismatchedPixels << " pixels off by more than " << config.goldenTolerance << ")" << std::endl;
+            return;
         }
+        // next to the golden image, so a failed run can be looked at and, if the change was intended, copied over it
+        writePpm(config.goldenPath + ".actual.ppm", frame);
+        writePpm(config.goldenPath + ".diff.ppm", diff.diffImage);
+        std::cerr << "Frame differs from golden image " << config.goldenPath << ": " << mismatchedPercent << "% of the pixels are off by more than "
+            << config.goldenTolerance << " (max " << diff.maxChannelDifference << "), see " << config.goldenPath << ".actual.ppm and .diff.ppm" << std::endl;
     }
 
-    void createCommandPool() {
-        QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+    bool isBenchmarking() const {
+        return config.benchmarkFrames > 0;
+    }
 
-        VkCommandPoolCreateInfo poolInfo{};
-        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;   //learn more here: https://registry.khronos.org/vulkan/specs/1.3-extensions/man/html/VkCommandPoolCreateFlagBits.html
-        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    // Per-frame resources (query pools, instance buffers) exist once per frame slot. Slots are per frame in flight,
+    // but a prerecorded command buffer belongs to an image and always uses the same resources.
+    uint32_t frameSlotCount() const {
+        return std::max<uint32_t>(maxFramesInFlight, static_cast<uint32_t>(swapChainImages.size()));
+    }
 
-        if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to create command pool!");
-        }
+    uint32_t frameSlotFor(uint32_t imageIndex) const {
+        return recordMode == RecordMode::Prerecorded ? imageIndex : currentFrame;
     }
 
-    void createCommandBuffers() {
-        commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    // Without inheritedQueries secondary command buffers must not run inside a query, so the statistics are skipped for threaded recording.
+    bool pipelineStatisticsActive() const {
+        return pipelineStatisticsSupported && (recordThreadCount == 0 || inheritedQueriesSupported);
+    }
 
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+    void createQueryPools() {
+        if (!isBenchmarking()) return;
 
-        if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to allocate command buffers!");
-        }
-    }
+        VkPhysicalDeviceProperties deviceProperties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+        timestampPeriod = deviceProperties.limits.timestampPeriod;
 
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+        std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
 
-        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to begin recording the command buffer!");
+        uint32_t validBits = queueFamilies[findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits;
+        gpuTimestampsSupported = validBits > 0; // 0 valid bits means the queue can not write timestamps at all
+        timestampMask = validBits >= 64 ? ~0ULL : ((1ULL << validBits) - 1);
+
+        if (!gpuTimestampsSupported) {
+            std::cerr << "GPU timestamps are not supported by the graphics queue, the report will only contain CPU timings." << std::endl;
         }
+        createQueryPoolsForSlots();
+    }
 
-        VkRenderPassBeginInfo renderPassInfo{};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
-        renderPassInfo.renderArea.offset = {0, 0};
-        renderPassInfo.renderArea.extent = swapChainExtent;
+    void createQueryPoolsForSlots() {
+        // Only ever grows, a recreated swap chain may come with more images than before.
+        querySlotTimelineValues.resize(std::max<size_t>(querySlotTimelineValues.size(), frameSlotCount()), 0);
+        gpuQuerySamples.reserve(querySlotTimelineValues.size() * 4);
+        if (gpuTimestampsSupported) {
+            size_t firstNewPool = timestampQueryPools.size();
+            timestampQueryPools.resize(std::max<size_t>(firstNewPool, frameSlotCount()));
+            for (size_t i = firstNewPool; i < timestampQueryPools.size(); i++) {
+                VkQueryPoolCreateInfo queryPoolInfo{};
+                queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                queryPoolInfo.queryCount = TIMESTAMP_QUERY_COUNT;
+
+                if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPools[i]) != VK_SUCCESS) {
+                    throw std::runtime_error("Failed to create timestamp query pool!");
+                }
+            }
+        }
 
-        VkClearValue clearColor = {{{0.0f,0.0f,0.0f,1.0f}}}; // clear with black
-        renderPassInfo.clearValueCount = 1;
-        renderPassInfo.pClearValues = &clearColor;
+        if (pipelineStatisticsSupported) {
+            size_t firstNewPool = pipelineStatisticsQueryPools.size();
+            pipelineStatisticsQueryPools.resize(std::max<size_t>(firstNewPool, frameSlotCount()));
+            for (size_t i = firstNewPool; i < pipelineStatisticsQueryPools.size(); i++) {
+                VkQueryPoolCreateInfo queryPoolInfo{};
+                queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                queryPoolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+                queryPoolInfo.queryCount = 1;
+                // The results are written in bit order, so vertex invocations come before fragment invocations.
+                queryPoolInfo.pipelineStatistics = PIPELINE_STATISTICS_FLAGS;
+
+                if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &pipelineStatisticsQueryPools[i]) != VK_SUCCESS) {
+                    throw std::runtime_error("Failed to create pipeline statistics query pool!");
+                }
+            }
+        }
+    }
 
-        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    // Reads the results of the frame that last wrote the slot's query pools before they get reset. Runs on whichever thread
+    // prepares the frame, so the samples are only collected here and recorded by recordGpuTimings().
+    void readGpuQueries(uint32_t slot) {
+        if (slot >= querySlotTimelineValues.size() || querySlotTimelineValues[slot] == 0) return;
+        graphicsTimeline.wait(querySlotTimelineValues[slot]); // already reached, the frame waited for the slot's last user
+        querySlotTimelineValues[slot] = 0;
+
+        if (gpuTimestampsSupported) {
+            uint64_t timestamps[TIMESTAMP_QUERY_COUNT];
+            if (vkGetQueryPoolResults(device, timestampQueryPools[slot], 0, TIMESTAMP_QUERY_COUNT, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+                uint64_t ticks = (timestamps[2] - timestamps[1]) & timestampMask;
+                gpuQuerySamples.push_back({ "gpu_render_pass_ms", ticks * timestampPeriod / 1e6 });
+                if (cullMode == CullMode::Gpu) {
+                    uint64_t cullingTicks = (timestamps[1] - timestamps[0]) & timestampMask;
+                    gpuQuerySamples.push_back({ "gpu_culling_ms", cullingTicks * timestampPeriod / 1e6 });
+                }
+            }
+        }
+        if (pipelineStatisticsActive()) {
+            uint64_t statistics[PIPELINE_STATISTIC_COUNT];
+            if (vkGetQueryPoolResults(device, pipelineStatisticsQueryPools[slot], 0, 1, sizeof(statistics), statistics, sizeof(statistics), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+                gpuQuerySamples.push_back({ "gpu_vertex_invocations", static_cast<double>(statistics[0]) });
+                gpuQuerySamples.push_back({ "gpu_fragment_invocations", static_cast<double>(statistics[1]) });
+            }
+        }
+    }
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+    // Main thread only, the previous frame's tasks (and with them readGpuQueries()) are done.
+    void recordGpuTimings() {
+        for (const GpuQuerySample& sample : gpuQuerySamples) {
+            profiler.recordSample(sample.series, sample.value);
+        }
+        gpuQuerySamples.clear();
+    }
 
-        VkViewport viewport = createViewport();
-        VkRect2D scissor = createScissor();
+    void mainLoop() {
+        if (!isBenchmarking()) {
+            runFrames(config.headless && config.frameCount == 0 ? DEFAULT_HEADLESS_FRAME_COUNT : config.frameCount);
+            vkDeviceWaitIdle(device);
+            flushReadback();
+            return;
+        }
 
-        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        profiler.enable(config.warmupFrames);
+        for (const BenchmarkPass& pass : createBenchmarkPasses()) {
+            if (pass.setup) {
+                vkDeviceWaitIdle(device); // switching configuration between passes is allowed to be slow
+                pass.setup();
+            }
+            profiler.beginPass(pass.name);
+            measuredStreamBytes = 0;
+            uint64_t readbackFrames = 0;
+            uint64_t readbackBytes = 0;
+            readbackWriter.takeMeasuredStats(readbackFrames, readbackBytes); // the previous pass was flushed, start counting from zero
+            frameEncoder.takeStats();
+            bool completed = runFrames(config.warmupFrames + config.benchmarkFrames);
+
+            vkDeviceWaitIdle(device);
+            for (uint32_t slot = 0; slot < querySlotTimelineValues.size(); slot++) {
+                readGpuQueries(slot); // the last frames in flight are done now as well
+            }
+            recordGpuTimings();
+            retireFinishedUploads();
+            publishUploadStats(); // before finish(), while the profiler still counts the last batches as measured
+            if (readbackWriter.isRunning()) {
+                flushReadback(); // sustained readback: the pass is only over once the writer caught up
+                readbackWriter.takeMeasuredStats(readbackFrames, readbackBytes);
+            }
+            profiler.finish(); // after the idle wait so fps includes the GPU finishing the last frames
+            if (config.streamMegabytes > 0 && profiler.measuredSeconds() > 0.0) {
+                profiler.report.setMetric(profiler.seriesName("stream_mb_per_s"), measuredStreamBytes / (1024.0 * 1024.0) / profiler.measuredSeconds());
+            }
+            if (config.readback && profiler.measuredSeconds() > 0.0) {
+                profiler.report.setMetric(profiler.seriesName("readback_fps"), readbackFrames / profiler.measuredSeconds());
+                profiler.report.setMetric(profiler.seriesName("readback_mb_per_s"), readbackBytes / (1024.0 * 1024.0) / profiler.measuredSeconds());
+            }
+            VkDeviceSize transientBytes, transientCommitted;
+            frameGraph->transientMemoryBytes(transientBytes, transientCommitted);
+            profiler.report.setMetric(profiler.seriesName("transient_attachment_mb"), transientBytes / (1024.0 * 1024.0));
+            profiler.report.setMetric(profiler.seriesName("transient_committed_mb"), transientCommitted / (1024.0 * 1024.0));
+            const RenderGraphStats& graphStats = frameGraph->stats();
+            profiler.report.setMetric(profiler.seriesName("graph_passes"), graphStats.passes);
+            profiler.report.setMetric(profiler.seriesName("graph_subpasses"), graphStats.subpasses);
+            profiler.report.setMetric(profiler.seriesName("graph_barrier_batches"), graphStats.barrierBatches); // per frame
+            profiler.report.setMetric(profiler.seriesName("graph_image_barriers"), graphStats.imageBarriers);
+            profiler.report.setMetric(profiler.seriesName("graph_aliased_images"), graphStats.aliasedImages);
+            FrameEncoderStats encoded = frameEncoder.takeStats();
+            if (encoded.framesWritten > 0) { // per frame, wait > 0 means the disk or pipe could not keep up
+                profiler.report.setMetric(profiler.seriesName("encode_convert_ms"), encoded.convertMs / encoded.framesWritten);
+                profiler.report.setMetric(profiler.seriesName("encode_write_ms"), encoded.writeMs / encoded.framesWritten);
+                profiler.report.setMetric(profiler.seriesName("encode_wait_ms"), encoded.waitMs / encoded.framesWritten);
+            }
+            if (!completed) break;
+        }
+    }
 
-        vkCmdDraw(commandBuffer, 3, 1, 0, 0); // we got 3 verticies, no instances but technically one whole then I guess, 0 0 are offsets we do not want to set higher ^^.
+    std::vector<BenchmarkPass> createBenchmarkPasses() {
+        std::vector<BenchmarkPass> passes = { { "", nullptr } }; // plain benchmark of whatever the command line configured
+        if (config.compareRecordModes) {
+            passes = combinePasses(passes, {
+                { "dynamic", [this] { setRecordMode(RecordMode::Dynamic); } },
+                { "prerecorded", [this] { setRecordMode(RecordMode::Prerecorded); } }
+            });
+        }
+        if (config.compareCullModes) {
+            passes = combinePasses(passes, {
+                { "cull_none", [this] { setCullMode(CullMode::None); } },
+                { "cull_cpu", [this] { setCullMode(CullMode::Cpu); } },
+                { "cull_gpu", [this] { setCullMode(CullMode::Gpu); } }
+            });
+        }
+        if (config.threadSweep) {
+            std::vector<BenchmarkPass> sweep;
+            for (uint32_t threads : recordThreadSweepCounts()) {
+                // threads_N: N threads record, the main thread and N - 1 workers
+                sweep.push_back({ "threads_" + std::to_string(threads), [this, threads] {
+                    frameScheduler.resize(threads > 0 ? threads - 1 : 0);
+                    setRecordThreadCount(threads);
+                } });
+            }
+            passes = combinePasses(passes, sweep);
+        }
+        if (config.msaaSweep) {
+            std::vector<BenchmarkPass> sweep;
+            for (VkSampleCountFlagBits samples : supportedSampleCounts()) {
+                sweep.push_back({ "msaa_" + std::to_string(samples) + "x", [this, samples] { setSampleCount(samples); } });
+            }
+            passes = combinePasses(passes, sweep);
+        }
+        if (config.instanceSweep) {
+            std::vector<BenchmarkPass> sweep;
+            for (uint32_t count : instanceSweepCounts) {
+                sweep.push_back({ "instances_" + std::to_string(count), [this, count] { fillInstanceGrid(scene, count, config.worldSize); } });
+            }
+            passes = combinePasses(passes, sweep);
+        }
+        return passes;
+    }
 
-        vkCmdEndRenderPass(commandBuffer);
+    // 0 (main thread only), 1, 2, 4, ... and the core count itself
+    static std::vector<uint32_t> recordThreadSweepCounts() {
+        uint32_t coreCount = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<uint32_t> counts = { 0 };
+        for (uint32_t threads = 1; threads < coreCount; threads *= 2) {
+            counts.push_back(threads);
+        }
+        counts.push_back(coreCount);
+        return counts;
+    }
 
-        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to record command buffer!");
+    // Renders frameLimit frames (0 = until the window is closed), returns false if the window was closed before that.
+    bool runFrames(uint32_t frameLimit) {
+        for (uint32_t frame = 0; frameLimit == 0 || frame < frameLimit; frame++) {
+            if (config.headless) {
+                drawFrameHeadless();
+                continue;
+            }
+            if (glfwWindowShouldClose(window)) {
+                return false;
+            }
+            drawFrame();
         }
+        return true;
     }
 
-    void createSyncObjects() {
-        imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-        inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    void writeBenchmarkReport() {
+        if (!profiler.isEnabled() && !config.startupReport) return;
 
-        VkSemaphoreCreateInfo semaphoreInfo{};
-        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        profiler.report.setInfo("device", physicalDeviceInfo.properties.deviceName);
+        profiler.report.setInfo("device_index", std::to_string(physicalDeviceInfo.index));
+        profiler.report.setInfo("device_type", deviceTypeName(physicalDeviceInfo.properties.deviceType));
+        if (!physicalDeviceInfo.uuid.empty()) {
+            profiler.report.setInfo("device_uuid", physicalDeviceInfo.uuid);
+        }
+        profiler.report.setMetric("device_score", static_cast<double>(physicalDeviceScore));
+        profiler.report.setMetric("device_local_mb", static_cast<double>(deviceLocalBytes(physicalDeviceInfo.memory) / (1024 * 1024)));
+        profiler.report.setInfo("mode", config.headless ? "headless" : "windowed");
+        if (!config.compareRecordModes) {
+            profiler.report.setInfo("record_mode", recordMode == RecordMode::Prerecorded ? "prerecorded" : "dynamic");
+        }
+        profiler.report.setInfo("extent", std::to_string(swapChainExtent.width) + "x" + std::to_string(swapChainExtent.height));
+        profiler.report.setInfo("frames_in_flight", std::to_string(maxFramesInFlight));
+        profiler.report.setInfo("swapchain_images", std::to_string(swapChainImages.size()));
+        profiler.report.setInfo("low_latency", config.lowLatency ? "true" : "false");
+        if (!config.headless) {
+            profiler.report.setInfo("present_mode", presentModeName(activePresentMode));
+        }
+        if (!config.instanceSweep) {
+            profiler.report.setInfo("instances", std::to_string(scene.size()));
+        }
+        if (!config.threadSweep) {
+            profiler.report.setInfo("record_threads", std::to_string(recordThreadCount));
+            profiler.report.setInfo("worker_threads", std::to_string(frameScheduler.workerCount()));
+        }
+        profiler.report.setInfo("draws", std::to_string(config.drawCount));
+        if (!config.compareCullModes) {
+            profiler.report.setInfo("culling", cullModeName(cullMode));
+        }
+        profiler.report.setInfo("simd", simdLevelName(cullKernels.level));
+        profiler.report.setInfo("world_size", std::to_string(config.worldSize));
+        profiler.report.setInfo("zoom", std::to_string(config.zoom));
+        profiler.report.setInfo("camera", config.cameraPan ? "pan" : "fixed");
+        profiler.report.setMetric("descriptor_pools", descriptorAllocator.poolCount());
+        profiler.report.setInfo("transfer_queue", hasDedicatedTransferQueue() ? "family " + std::to_string(transferQueueFamily) : "graphics");
+        profiler.report.setInfo("stream_mb_per_frame", std::to_string(config.streamMegabytes));
+        profiler.report.setInfo("pipeline_variant", config.variantSweep ? "sweep" : boundPipelineVariant.name());
+        if (!config.msaaSweep) {
+            profiler.report.setInfo("msaa", std::to_string(msaaSamples) + "x");
+        }
+        profiler.report.setInfo("depth", depthFormat != VK_FORMAT_UNDEFINED ? "on" : "off");
+        profiler.report.setInfo("transient_memory", frameGraph->stats().lazyMemory ? "lazily_allocated" : "device_local");
+        profiler.report.setMetric("pipeline_variants", pipelineVariants.readyCount());
+        if (config.readback) {
+            profiler.report.setInfo("readback_memory", readbackMemoryCached ? "cached" : "uncached");
+            if (frameEncoder.isOpen()) {
+                profiler.report.setInfo("readback_format", frameOutputFormatName(frameEncoder.outputFormat()));
+                profiler.report.setInfo("encode_simd", simdLevelName(frameEncoder.simdLevel()));
+            }
+        }
 
-        VkFenceCreateInfo fenceInfo{};
-        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        recordMemoryStats();
+        writeReport(profiler.report, config);
+    }
 
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-        {
-            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS ||
-                vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS ||
-                vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS) {
-                throw std::runtime_error("Failed to create semaphores and fences (synchronization objects)!");
-            }
+    void recordMemoryStats() {
+        MemoryStats stats = allocator.getStats();
+        profiler.report.setMetric("memory_device_allocations", stats.deviceAllocationCount);
+        profiler.report.setMetric("memory_dedicated_allocations", stats.dedicatedAllocationCount);
+        profiler.report.setMetric("memory_sub_allocations", stats.allocationCount - stats.dedicatedAllocationCount);
+        profiler.report.setMetric("memory_bytes_used", static_cast<double>(stats.bytesUsed));
+        profiler.report.setMetric("memory_bytes_reserved", static_cast<double>(stats.bytesReserved));
+        profiler.report.setMetric("memory_fragmentation", stats.fragmentation());
+    }
+
+    // Exports how long every task of the last frame took and the critical path through the task graph.
+    void recordTaskTimings() {
+        const std::vector<TaskTiming>& timings = frameScheduler.timings();
+        for (size_t i = 0; i < timings.size(); i++) {
+            profiler.recordSample(taskSeriesNames[i].c_str(), timings[i].durationMs);
+        }
+        profiler.recordSample("critical_path_ms", frameScheduler.criticalPathMs());
+        if (config.readback) {
+            profiler.recordSample("readback_stall_ms", frameReadbackStallMs);
+            frameReadbackStallMs = 0.0;
         }
     }
 
-    void mainLoop() {
-        while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents(); // check for window close event for example
-            drawFrame();
+    // Main thread, once the tasks that upload are done.
+    void publishUploadStats() {
+        if (profiler.isRecording()) {
+            measuredStreamBytes += pendingUploadStats.retiredBytes;
         }
+        profiler.recordSample("upload_stall_ms", pendingUploadStats.stallMs);
+        pendingUploadStats = UploadStats{};
+    }
 
-        vkDeviceWaitIdle(device);
+    void sampleInput() {
+        glfwPollEvents(); // check for window close event for example
+        inputSampleTime = BenchmarkClock::now();
     }
 
-    void drawFrame() {
-        vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX); // Wait until last frame is done. If the fence was never signaled we will wait here forever! That is why we manually set our inFlightFence to signaled initially!
-        vkResetFences(device, 1, &inFlightFences[currentFrame]); // Unsignal fence as waitForFences does only wait till the fence is done, but does not unsignal it ^^.
+    // Builds the tasks of a frame once, drawFrame() and drawFrameHeadless() run them every frame.
+    void buildFrameTaskGraph() {
+        frameScheduler.clear();
 
-        uint32_t imageIndex;
-        vkAcquireNextImageKHR(device, swapChain, INT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-        vkResetCommandBuffer(commandBuffers[currentFrame], 0);
-        recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
+        // Normally input is read first and then we may block on the previous frame, so it is already stale when we record.
+        // In low latency mode we block first and read the input right before recording and presenting.
+        TaskScheduler::TaskId pollInput = 0;
+        if (!config.headless && !config.lowLatency) {
+            pollInput = frameScheduler.addTask("poll_input", [this] { sampleInput(); }, {}, TaskAffinity::MainThread);
+        }
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        // recordGpuTimings() writes into the profiler, which only the main thread touches
+        TaskScheduler::TaskId waitForFrame = frameScheduler.addTask("wait_for_frame", [this] { waitForFrameSlot(); }, {}, TaskAffinity::MainThread); // Wait until this slot's last frame is done
 
-        VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] }; // wait until image is available
-        VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT }; // wait before outputing/storing the image. This means vertex shader can run before ^^
-        submitInfo.waitSemaphoreCount = 1;
-        submitInfo.pWaitSemaphores = waitSemaphores; // why not &imageAvailableSemaphore here?!
-        submitInfo.pWaitDstStageMask = waitStages;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+        if (!config.headless && config.lowLatency) {
+            pollInput = frameScheduler.addTask("poll_input", [this] { sampleInput(); }, { waitForFrame }, TaskAffinity::MainThread);
+        }
+
+        // only touch CPU side scene data, so they run while we still wait for the GPU
+        TaskScheduler::TaskId update = frameScheduler.addTask("update_scene", [this] { updateScene(); });
+        TaskScheduler::TaskId cull = frameScheduler.addTask("cull_instances", [this] { cullScene(); }, { update });
+
+        // Without a swap chain drawFrameHeadless() picks the image, there is nothing to acquire.
+        TaskScheduler::TaskId acquire = waitForFrame;
+        if (!config.headless) {
+            acquire = frameScheduler.addTask("acquire_next_image", [this] {
+                VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &frameTasks.imageIndex);
+                if (result == VK_ERROR_OUT_OF_DATE_KHR) { // the swap chain can not be used anymore (e.g. the window was resized), nothing got acquired
+                    return;
+                }
+                else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) { // SUBOPTIMAL still presents fine, we recreate after presenting
+                    throw std::runtime_error("Failed to acquire swap chain image!");
+                }
+                frameTasks.imageAcquired = true; // nothing to reset if we bail out before submitting, the timeline value we waited for stays reached
+            }, { waitForFrame });
+        }
 
-        VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
-        submitInfo.signalSemaphoreCount = 1;
-        submitInfo.pSignalSemaphores = signalSemaphores;
+        // The tasks below have nothing to do if the swap chain turned out to be out of date.
+        TaskScheduler::TaskId upload = frameScheduler.addTask("upload_instances", [this] {
+            if (!frameTasks.imageAcquired) return;
+            prepareFrameResources(frameTasks.imageIndex);
+        }, { acquire, cull });
+
+        TaskScheduler::TaskId record = frameScheduler.addTask("record_command_buffer", [this] {
+            if (!frameTasks.imageAcquired) return;
+            frameTasks.commandBuffer = prepareCommandBuffer(frameTasks.imageIndex);
+        }, { upload });
+
+        // copies run on the transfer queue while the command buffer is recorded
+        TaskScheduler::TaskId stream = frameScheduler.addTask("stream_assets", [this] { streamAssets(); }, { waitForFrame });
+
+        TaskScheduler::TaskId submit = frameScheduler.addTask("queue_submit", [this] {
+            if (!frameTasks.imageAcquired) return;
+            submitFrame(frameTasks.imageIndex, frameTasks.commandBuffer);
+        }, { record, stream });
+
+        if (!config.headless) {
+            frameScheduler.addTask("queue_present", [this] {
+                if (!frameTasks.imageAcquired) return;
+                VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
+                VkSwapchainKHR swapChains[] = { swapChain };
+
+                VkPresentInfoKHR presentInfo{};
+                presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+                presentInfo.waitSemaphoreCount = 1;
+                presentInfo.pWaitSemaphores = signalSemaphores;
+                presentInfo.swapchainCount = 1;
+                presentInfo.pSwapchains = swapChains;
+                presentInfo.pImageIndices = &frameTasks.imageIndex;
+                presentInfo.pResults = nullptr; // You can attach a VkResult Array here when using multiple swap chains to see which swap chains might have failed!
+
+                frameTasks.presentResult = vkQueuePresentKHR(presentationQueue, &presentInfo);
+                profiler.recordPhase("input_to_present", inputSampleTime); // CPU side only, the display adds its own queue on top
+            }, { submit, pollInput }, TaskAffinity::MainThread);
+        }
 
-        if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
-            throw std::runtime_error("Failed to submit draw command buffer into graphics queue!");
+        taskSeriesNames.clear();
+        for (TaskScheduler::TaskId id = 0; id < frameScheduler.taskCount(); id++) {
+            taskSeriesNames.push_back(frameScheduler.taskName(id) + "_ms");
         }
+    }
+
+    void drawFrameHeadless() {
+        profiler.beginFrame();
+        updatePipelineVariant();
+
+        // Without a swap chain there is nothing to acquire, we just cycle through our own images.
+        frameTasks = FrameTaskState{};
+        frameTasks.measured = profiler.isRecording();
+        frameTasks.imageIndex = headlessImageIndex;
+        frameTasks.imageAcquired = true;
+        headlessImageIndex = (headlessImageIndex + 1) % static_cast<uint32_t>(swapChainImages.size());
 
-        VkSwapchainKHR swapChains[] = { swapChain };
+        frameScheduler.run();
+        publishUploadStats();
+        recordTaskTimings();
 
-        VkPresentInfoKHR presentInfo{};
-        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = signalSemaphores;
-        presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = swapChains;
-        presentInfo.pImageIndices = &imageIndex;
-        presentInfo.pResults = nullptr; // You can attach a VkResult Array here when using multiple swap chains to see which swap chains might have failed!
+        currentFrame = (currentFrame + 1) % maxFramesInFlight;
+        profiler.endFrame();
+    }
+
+    void drawFrame() {
+        profiler.beginFrame();
+        updatePipelineVariant();
+
+        frameTasks = FrameTaskState{};
+        frameTasks.measured = profiler.isRecording();
+        frameScheduler.run();
+        publishUploadStats();
 
-        vkQueuePresentKHR(presentationQueue, &presentInfo);
+        if (!frameTasks.imageAcquired) {
+            recreateSwapChain();
+            return;
+        }
+        recordTaskTimings();
 
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        currentFrame = (currentFrame + 1) % maxFramesInFlight;
+        profiler.endFrame();
+
+        if (frameTasks.presentResult == VK_ERROR_OUT_OF_DATE_KHR || frameTasks.presentResult == VK_SUBOPTIMAL_KHR || framebufferResized) {
+            framebufferResized = false;
+            recreateSwapChain();
+        }
+        else if (frameTasks.presentResult != VK_SUCCESS) {
+            throw std::runtime_error("Failed to present swap chain image!");
+        }
     }
 
     void cleanup() {
-        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+        flushDeferredDestructions();
+        readbackWriter.stop();
+        frameEncoder.close();
+        for (size_t i = 0; i < readbackBuffers.size(); i++) {
+            vkDestroyBuffer(device, readbackBuffers[i], nullptr);
+            allocator.free(readbackAllocations[i]);
+        }
+        for (size_t i = 0; i < imageAvailableSemaphores.size(); i++)
         {
             vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
             vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-            vkDestroyFence(device, inFlightFences[i], nullptr);
         }
-        vkDestroyCommandPool(device, commandPool, nullptr);
-        for (auto framebuffer : swapChainFramebuffers) {
-            vkDestroyFramebuffer(device, framebuffer, nullptr);
+        for (size_t i = 0; i < instanceBuffers.size(); i++) {
+            vkDestroyBuffer(device, instanceBuffers[i], nullptr);
+            allocator.free(instanceBufferAllocations[i]);
+        }
+        for (CullingSlot& culling : cullingSlots) {
+            if (culling.visibleInstances != VK_NULL_HANDLE) {
+                vkDestroyBuffer(device, culling.visibleInstances, nullptr);
+                allocator.free(culling.visibleInstancesAllocation);
+            }
+            if (culling.drawCommands != VK_NULL_HANDLE) {
+                vkDestroyBuffer(device, culling.drawCommands, nullptr);
+                allocator.free(culling.drawCommandsAllocation);
+            }
+        }
+        vkDestroyBuffer(device, indexBuffer, nullptr);
+        allocator.free(indexBufferAllocation);
+        vkDestroyBuffer(device, vertexBuffer, nullptr);
+        allocator.free(vertexBufferAllocation);
+        vkDestroyBuffer(device, stagingRingBuffer, nullptr);
+        allocator.free(stagingRingAllocation);
+        vkDestroyBuffer(device, uniformRingBuffer, nullptr);
+        allocator.free(uniformRingAllocation);
+        if (streamBuffer != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, streamBuffer, nullptr);
+            allocator.free(streamBufferAllocation);
+        }
+        vkDestroyCommandPool(device, transferCommandPool, nullptr); // frees the batch command buffers as well
+        dedicatedTransferTimeline.destroy();
+        graphicsTimeline.destroy();
+        for (auto queryPool : timestampQueryPools) {
+            vkDestroyQueryPool(device, queryPool, nullptr);
         }
-        vkDestroyPipeline(device, graphicsPipeline, nullptr);
-        vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
-        vkDestroyRenderPass(device, renderPass, nullptr);
+        for (auto queryPool : pipelineStatisticsQueryPools) {
+            vkDestroyQueryPool(device, queryPool, nullptr);
+        }
+        frameScheduler.resize(0);
+        for (auto& slotResources : threadRecordingResources) {
+            for (auto& resources : slotResources) {
+                vkDestroyCommandPool(device, resources.commandPool, nullptr); // frees its secondary command buffer as well
+            }
+        }
+        vkDestroyCommandPool(device, commandPool, nullptr);
+        frameGraph->destroy(); // framebuffers and transient attachments
+        pipelineVariants.destroy(); // also waits for variants still compiling
+        vkDestroyPipeline(device, cullingPipeline, nullptr);
+        descriptorAllocator.destroy(); // frees the descriptor sets as well
+        vkDestroyPipelineCache(device, pipelineCache, nullptr);
+        shaderLibrary.destroy();
+        descriptorLayoutCache.destroy();
+        renderPassCache.destroy();
         for (auto imageView : swapChainImageViews) {
             vkDestroyImageView(device, imageView, nullptr);
         }
-        vkDestroySwapchainKHR(device, swapChain, nullptr);
+        if (config.headless) {
+            for (size_t i = 0; i < swapChainImages.size(); i++) {
+                vkDestroyImage(device, swapChainImages[i], nullptr);
+                allocator.free(offscreenImageAllocations[i]);
+            }
+        }
+        else {
+            vkDestroySwapchainKHR(device, swapChain, nullptr);
+        }
+        allocator.destroy();
         vkDestroyDevice(device, nullptr);
         if (enableValidationLayers) {
             auto func = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(instance, "vkDestroyDebugUtilsMessengerEXT");
@@ -945,18 +3645,410 @@ private:
             }
         }
 
-        vkDestroySurfaceKHR(instance, surface, nullptr);
+        if (!config.headless) {
+            vkDestroySurfaceKHR(instance, surface, nullptr);
+        }
         vkDestroyInstance(instance,nullptr);
-        glfwDestroyWindow(window);
-        glfwTerminate();
+        if (!config.headless) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
     }
 };
 
-int main() {
-    std::cout<<"START main\n";
-    HelloTriangleApplication app;
+static const uint32_t CULL_MICROBENCHMARK_COUNTS[] = { 10000, 100000, 1000000 };
+static const float CULL_MICROBENCHMARK_WORLD_SIZE = 2.0f; // about a quarter of the instances is visible, so the kernels can not skip much
+
+// Times the scalar and every supported SIMD flavour of the culling and transform kernels on the same scenes, single threaded.
+void runCullingMicrobenchmark(const AppConfig& config) {
+    uint32_t iterations = config.benchmarkFrames > 0 ? config.benchmarkFrames : 100;
+    BenchmarkReport report;
+    report.setInfo("mode", "cull_microbench");
+    report.setInfo("best_simd", simdLevelName(bestSimdLevel()));
+    Frustum2D frustum = Frustum2D::clipSpace();
+
+    for (uint32_t count : CULL_MICROBENCHMARK_COUNTS) {
+        Scene scene;
+        scene.meshRadius = boundingRadius(vertices);
+        fillInstanceGrid(scene, count, CULL_MICROBENCHMARK_WORLD_SIZE);
+        std::vector<uint32_t> visible(count);
+        std::string countName = "instances_" + std::to_string(count) + ".";
+        double scalarCullMs = 0.0;
+        double scalarTransformMs = 0.0;
+
+        for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::Sse2, SimdLevel::Avx2, SimdLevel::Neon }) {
+            if (!simdLevelSupported(level)) continue;
+            CullingKernels kernels = selectCullingKernels(level);
+            std::string name = countName + simdLevelName(level) + ".";
+            std::vector<double> cullSamples;
+            std::vector<double> transformSamples;
+            size_t visibleCount = 0;
+            for (uint32_t iteration = 0; iteration < config.warmupFrames + iterations; iteration++) {
+                auto start = BenchmarkClock::now();
+                visibleCount = kernels.cullSpheres(frustum, scene.positionX.data(), scene.positionY.data(), scene.boundingRadius.data(), 0, count, visible.data());
+                double cullMs = millisecondsSince(start);
+                start = BenchmarkClock::now();
+                kernels.advanceRotations(scene.rotation.data(), 0, count, 0.01f);
+                double transformMs = millisecondsSince(start);
+                if (iteration < config.warmupFrames) continue;
+                cullSamples.push_back(cullMs);
+                transformSamples.push_back(transformMs);
+                report.addSample(name + "cull_ms", cullMs);
+                report.addSample(name + "transform_ms", transformMs);
+            }
+            report.setMetric(name + "visible", static_cast<double>(visibleCount)); // also keeps the compiler from dropping the loop
+
+            double cullMs = SampleStatistics::compute(cullSamples).median;
+            double transformMs = SampleStatistics::compute(transformSamples).median;
+            if (level == SimdLevel::Scalar) {
+                scalarCullMs = cullMs;
+                scalarTransformMs = transformMs;
+            }
+            else {
+                report.setMetric(name + "cull_speedup", cullMs > 0.0 ? scalarCullMs / cullMs : 0.0);
+                report.setMetric(name + "transform_speedup", transformMs > 0.0 ? scalarTransformMs / transformMs : 0.0);
+            }
+        }
+    }
+    writeReport(report, config);
+}
+
+void printUsage() {
+    std::cout << "Usage: VulkanTutorialFirstTriangle [options]\n"
+        << "  --headless     render offscreen without a window or swap chain (e.g. on lavapipe/SwiftShader)\n"
+        << "  --frames N     stop after N frames (headless default: " << DEFAULT_HEADLESS_FRAME_COUNT << ")\n"
+        << "  --bench N      benchmark N frames and print min/median/p95/p99/max per frame phase and fps\n"
+        << "  --warmup M     run M untimed frames before the benchmark starts\n"
+        << "  --report-format json|csv   benchmark output format (default json)\n"
+        << "  --report-file PATH         write the benchmark report to PATH instead of stdout\n"
+        << "  --startup-report           report initialization timings (cold vs. warm pipeline cache) even without --bench\n"
+        << "  --pipeline-cache PATH      pipeline cache file (default pipeline_cache.bin)\n"
+        << "  --no-pipeline-cache        do not load or store a pipeline cache\n"
+        << "  --frames-in-flight N       frames the CPU may record ahead of the GPU (1-" << MAX_SUPPORTED_FRAMES_IN_FLIGHT << ", default " << DEFAULT_FRAMES_IN_FLIGHT << ")\n"
+        << "  --swapchain-images N       requested swap chain (or offscreen) image count (1-" << MAX_SUPPORTED_SWAPCHAIN_IMAGES << "), clamped to what the surface supports\n"
+        << "  --present-mode immediate|mailbox|fifo|fifo_relaxed\n"
+        << "  --low-latency              one frame in flight, minimal swap chain, input sampled after the frame wait\n"
+        << "  --record-mode dynamic|prerecorded|compare\n"
+        << "                 re-record every frame (default), record once per framebuffer, or benchmark both\n"
+        << "  --instances N              draw N instances of the triangle with one draw call (default 1)\n"
+        << "  --instance-sweep           benchmark 1, 10, ... 1000000 instances, one pass each\n"
+        << "  --draws N                  split the instances into N draw calls (default 1)\n"
+        << "  --record-threads N         record secondary command buffers on N worker threads (default 0: main thread only)\n"
+        << "  --thread-sweep             benchmark recording with 0, 1, 2, 4, ... threads up to the core count\n"
+        << "  --worker-threads N         task scheduler threads besides the main thread (default: cores - 1)\n"
+        << "  --animate                  rotate every instance each frame\n"
+        << "  --zoom Z                   camera zoom, < 1 shows more of the world (default 1)\n"
+        << "  --pan                      move the camera in a circle over the instance grid\n"
+        << "  --shade-draws              tint every draw call differently\n"
+        << "  --blend [OPACITY]          draw the instances translucent (default opacity 0.5)\n"
+        << "  --cull-face none|front|back  which triangle faces the rasterizer drops (default back)\n"
+        << "  --no-rotation              pipeline variant without the rotation in the vertex shader\n"
+        << "  --no-vertex-colors         pipeline variant that colors by instance only\n"
+        << "  --msaa 1|2|4|8             samples per pixel, resolved into the swap chain image (default 1, capped at what the device supports)\n"
+        << "  --msaa-sweep               benchmark every sample count the device supports\n"
+        << "  --no-depth                 render without the transient depth attachment\n"
+        << "  --variant-sweep            switch to another pipeline variant every 60 frames, compiled in the background\n"
+        << "  --world-size S             spread the instances over S x S screens, so culling has something to drop (default 1)\n"
+        << "  --culling none|cpu|gpu|compare\n"
+        << "                 draw every instance (default), cull with SIMD on the CPU, cull on the GPU and draw indirect, or benchmark all\n"
+        << "  --simd scalar|sse2|avx2|neon  CPU culling kernels to use (default: the best the CPU supports)\n"
+        << "  --cull-microbench          compare the scalar and SIMD culling kernels at 10k, 100k and 1M instances and exit\n"
+        << "  --stream-mb N              upload N MB through the transfer queue every frame and report the throughput\n"
+        << "  --no-transfer-queue        do all uploads on the graphics queue, even if the device has a transfer queue\n"
+        << "  --device INDEX|UUID|NAME   run on this GPU instead of the best scoring one, also read from VK_TRIANGLE_DEVICE\n"
+        << "  --list-devices             print every device with its score and exit\n"
+        << "  --device-sweep             run once on every suitable device, --report-file gets a .deviceN suffix per run\n"
+        << "  --golden-capture FILE.ppm  render headless with a fixed timestep and save the last frame as the golden image\n"
+        << "  --golden-compare FILE.ppm  same run, but fail if the last frame differs from the golden image (use --device llvmpipe for a GPU-less check)\n"
+        << "  --golden-tolerance N       per channel difference a pixel may have and still match (default 2)\n"
+        << "  --golden-max-mismatch P    percent of the pixels that may differ by more than the tolerance (default 0)\n"
+        << "  --readback [FILE]          headless, copy every frame to host memory and consume it on a background thread,\n"
+        << "                             frames are streamed into FILE, which may be a named pipe that ffmpeg reads from or - for stdout\n"
+        << "  --readback-format raw|ppm|y4m  stream format (default: from the extension of FILE, raw otherwise)\n"
+        << "  --readback-fps N           frame rate written into the Y4M header (default 60)\n"
+        << "  --fixed-timestep S         advance the scene by S seconds per frame instead of the measured time (golden runs: 1/60)\n"
+        << "  --help         show this text\n";
+}
+
+AppConfig parseCommandLine(int argc, char* argv[]) {
+    AppConfig config;
+    if (const char* device = std::getenv("VK_TRIANGLE_DEVICE")) { // --device wins
+        config.deviceSelector = device;
+    }
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--headless") {
+            config.headless = true;
+        }
+        else if (arg == "--frames" && i + 1 < argc) {
+            config.frameCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--bench" && i + 1 < argc) {
+            config.benchmarkFrames = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--warmup" && i + 1 < argc) {
+            config.warmupFrames = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--report-format" && i + 1 < argc) {
+            config.reportFormat = parseReportFormat(argv[++i]);
+        }
+        else if (arg == "--report-file" && i + 1 < argc) {
+            config.reportPath = argv[++i];
+        }
+        else if (arg == "--startup-report") {
+            config.startupReport = true;
+        }
+        else if (arg == "--pipeline-cache" && i + 1 < argc) {
+            config.pipelineCachePath = argv[++i];
+        }
+        else if (arg == "--no-pipeline-cache") {
+            config.pipelineCachePath.clear();
+        }
+        else if (arg == "--frames-in-flight" && i + 1 < argc) {
+            config.framesInFlight = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (config.framesInFlight < 1 || config.framesInFlight > MAX_SUPPORTED_FRAMES_IN_FLIGHT) {
+                throw std::runtime_error("--frames-in-flight must be between 1 and " + std::to_string(MAX_SUPPORTED_FRAMES_IN_FLIGHT));
+            }
+        }
+        else if (arg == "--swapchain-images" && i + 1 < argc) {
+            config.swapchainImageCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (config.swapchainImageCount < 1 || config.swapchainImageCount > MAX_SUPPORTED_SWAPCHAIN_IMAGES) {
+                throw std::runtime_error("--swapchain-images must be between 1 and " + std::to_string(MAX_SUPPORTED_SWAPCHAIN_IMAGES));
+            }
+        }
+        else if (arg == "--present-mode" && i + 1 < argc) {
+            config.presentMode = parsePresentMode(argv[++i]);
+        }
+        else if (arg == "--low-latency") {
+            config.lowLatency = true;
+        }
+        else if (arg == "--record-mode" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "dynamic") {
+                config.recordMode = RecordMode::Dynamic;
+            }
+            else if (mode == "prerecorded") {
+                config.recordMode = RecordMode::Prerecorded;
+            }
+            else if (mode == "compare") {
+                config.compareRecordModes = true;
+            }
+            else {
+                throw std::runtime_error("Unknown record mode: " + mode);
+            }
+        }
+        else if (arg == "--instances" && i + 1 < argc) {
+            config.instanceCount = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--instance-sweep") {
+            config.instanceSweep = true;
+        }
+        else if (arg == "--draws" && i + 1 < argc) {
+            config.drawCount = std::max(1u, static_cast<uint32_t>(std::stoul(argv[++i])));
+        }
+        else if (arg == "--record-threads" && i + 1 < argc) {
+            config.recordThreads = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--thread-sweep") {
+            config.threadSweep = true;
+        }
+        else if (arg == "--worker-threads" && i + 1 < argc) {
+            config.workerThreads = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--animate") {
+            config.animate = true;
+        }
+        else if (arg == "--zoom" && i + 1 < argc) {
+            config.zoom = std::stof(argv[++i]);
+            if (config.zoom <= 0.0f) {
+                throw std::runtime_error("--zoom must be positive");
+            }
+        }
+        else if (arg == "--pan") {
+            config.cameraPan = true;
+        }
+        else if (arg == "--shade-draws") {
+            config.shadeDraws = true;
+        }
+        else if (arg == "--blend") {
+            config.pipelineVariant.blend = true;
+            config.pipelineVariant.opacity = 0.5f;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                config.pipelineVariant.opacity = std::stof(argv[++i]);
+            }
+        }
+        else if (arg == "--cull-face" && i + 1 < argc) {
+            std::string face = argv[++i];
+            if (face == "none") {
+                config.pipelineVariant.cullMode = VK_CULL_MODE_NONE;
+            }
+            else if (face == "front") {
+                config.pipelineVariant.cullMode = VK_CULL_MODE_FRONT_BIT;
+            }
+            else if (face == "back") {
+                config.pipelineVariant.cullMode = VK_CULL_MODE_BACK_BIT;
+            }
+            else {
+                throw std::runtime_error("Unknown face cull mode: " + face);
+            }
+        }
+        else if (arg == "--no-rotation") {
+            config.pipelineVariant.shaderFeatures &= ~SHADER_FEATURE_ROTATION;
+        }
+        else if (arg == "--no-vertex-colors") {
+            config.pipelineVariant.shaderFeatures &= ~SHADER_FEATURE_VERTEX_COLORS;
+        }
+        else if (arg == "--msaa" && i + 1 < argc) {
+            uint32_t samples = static_cast<uint32_t>(std::stoul(argv[++i]));
+            if (samples != 1 && samples != 2 && samples != 4 && samples != 8) {
+                throw std::runtime_error("MSAA sample count must be 1, 2, 4 or 8!");
+            }
+            config.pipelineVariant.samples = static_cast<VkSampleCountFlagBits>(samples); // the flag bit of N samples is N
+        }
+        else if (arg == "--msaa-sweep") {
+            config.msaaSweep = true;
+        }
+        else if (arg == "--no-depth") {
+            config.depth = false;
+        }
+        else if (arg == "--variant-sweep") {
+            config.variantSweep = true;
+        }
+        else if (arg == "--world-size" && i + 1 < argc) {
+            config.worldSize = std::stof(argv[++i]);
+            if (config.worldSize <= 0.0f) {
+                throw std::runtime_error("--world-size must be positive");
+            }
+        }
+        else if (arg == "--culling" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "none") {
+                config.cullMode = CullMode::None;
+            }
+            else if (mode == "cpu") {
+                config.cullMode = CullMode::Cpu;
+            }
+            else if (mode == "gpu") {
+                config.cullMode = CullMode::Gpu;
+            }
+            else if (mode == "compare") {
+                config.compareCullModes = true;
+            }
+            else {
+                throw std::runtime_error("Unknown culling mode: " + mode);
+            }
+        }
+        else if (arg == "--stream-mb" && i + 1 < argc) {
+            config.streamMegabytes = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--no-transfer-queue") {
+            config.transferQueue = false;
+        }
+        else if (arg == "--simd" && i + 1 < argc) {
+            config.simdLevel = parseSimdLevel(argv[++i]);
+            if (!simdLevelSupported(config.simdLevel.value())) {
+                throw std::runtime_error(std::string("This CPU or build does not support ") + simdLevelName(config.simdLevel.value()));
+            }
+        }
+        else if (arg == "--cull-microbench") {
+            config.cullMicrobenchmark = true;
+        }
+        else if (arg == "--device" && i + 1 < argc) {
+            config.deviceSelector = argv[++i];
+        }
+        else if (arg == "--list-devices") {
+            config.listDevices = true;
+        }
+        else if (arg == "--device-sweep") {
+            config.deviceSweep = true;
+        }
+        else if (arg == "--golden-capture" && i + 1 < argc) {
+            config.goldenMode = GoldenMode::Capture;
+            config.goldenPath = argv[++i];
+        }
+        else if (arg == "--golden-compare" && i + 1 < argc) {
+            config.goldenMode = GoldenMode::Compare;
+            config.goldenPath = argv[++i];
+        }
+        else if (arg == "--golden-tolerance" && i + 1 < argc) {
+            config.goldenTolerance = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--golden-max-mismatch" && i + 1 < argc) {
+            config.goldenMaxMismatchPercent = std::stod(argv[++i]);
+        }
+        else if (arg == "--readback") {
+            config.readback = true;
+            config.headless = true; // swap chain images belong to the presentation engine, we read our own
+            if (i + 1 < argc && (argv[i + 1][0] != '-' || std::string(argv[i + 1]) == "-")) {
+                config.readbackPath = argv[++i];
+            }
+        }
+        else if (arg == "--readback-format" && i + 1 < argc) {
+            config.readbackFormat = parseFrameOutputFormat(argv[++i]);
+        }
+        else if (arg == "--readback-fps" && i + 1 < argc) {
+            config.readbackFps = static_cast<uint32_t>(std::stoul(argv[++i]));
+        }
+        else if (arg == "--fixed-timestep" && i + 1 < argc) {
+            config.fixedTimestep = std::stof(argv[++i]);
+        }
+        else if (arg == "--help") {
+            printUsage();
+            std::exit(EXIT_SUCCESS);
+        }
+        else {
+            printUsage();
+            throw std::runtime_error("Unknown or incomplete command line argument: " + arg);
+        }
+    }
+
+    // A golden run has to render the same frames every time: no window, no wall clock, and it reports its timings as well.
+    if (config.goldenMode != GoldenMode::None) {
+        config.headless = true;
+        if (config.fixedTimestep <= 0.0f) {
+            config.fixedTimestep = 1.0f / 60.0f;
+        }
+        if (config.benchmarkFrames == 0) {
+            config.benchmarkFrames = config.frameCount > 0 ? config.frameCount : DEFAULT_GOLDEN_FRAME_COUNT;
+        }
+    }
+    // Diagnostics go to stderr, but the report would still end up in the middle of the frames.
+    if (config.readbackPath == "-" && config.benchmarkFrames > 0 && config.reportPath.empty()) {
+        throw std::runtime_error("--readback - writes the frames to stdout, the benchmark report needs --report-file!");
+    }
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    std::cerr<<"START main\n";
     try {
+        AppConfig config = parseCommandLine(argc, argv);
+        if (config.cullMicrobenchmark) {
+            runCullingMicrobenchmark(config);
+            return EXIT_SUCCESS;
+        }
+        if (config.listDevices) {
+            HelloTriangleApplication(config).listDevices(true);
+            return EXIT_SUCCESS;
+        }
+        if (config.deviceSweep) {
+            // A fresh application per device, every run starts from a cold device like a normal run would
+            for (const PhysicalDeviceInfo& info : HelloTriangleApplication(config).listDevices(false)) {
+                AppConfig deviceConfig = config;
+                deviceConfig.deviceSelector = std::to_string(info.index);
+                if (!deviceConfig.reportPath.empty()) {
+                    deviceConfig.reportPath += ".device" + std::to_string(info.index);
+                }
+                HelloTriangleApplication app(deviceConfig);
+                app.run();
+            }
+            return EXIT_SUCCESS;
+        }
+        HelloTriangleApplication app(config);
         app.run();
+        if (!app.passed()) {
+            return EXIT_FAILURE;
+        }
     } catch (const std::exception& e) { 
         std::cerr << e.what() << std::endl;
         return EXIT_FAILURE;
@@ -1,2 +1,3 @@
 glslc .\first_shader.vert -o vert.spv
 glslc .\first_shader.frag -o frag.spv
+glslc .\cull.comp -o cull.spv
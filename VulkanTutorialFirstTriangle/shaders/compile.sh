@@ -0,0 +1,8 @@
+#!/bin/sh
+# compile.bat for macOS and Linux. Set GLSLC if glslc from the Vulkan SDK is not on the PATH.
+set -e
+cd "$(dirname "$0")"
+GLSLC="${GLSLC:-glslc}"
+"$GLSLC" first_shader.vert -o vert.spv
+"$GLSLC" first_shader.frag -o frag.spv
+"$GLSLC" cull.comp -o cull.spv
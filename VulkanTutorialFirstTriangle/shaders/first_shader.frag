@@ -1,8 +1,14 @@
 #version 450
 
+layout(constant_id = 1) const float OPACITY = 1.0; // < 1 only for the blending pipeline variants
+
+layout(push_constant) uniform DrawParameters { // per draw call, see DrawPushConstants in main.cpp
+    vec4 tint;
+} draw;
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 0) out vec4 outColor; //layout(location = 0) target frame buffer with index 0
 
 void main(){//invoked for every fragment
-    outColor = vec4(fragColor, 1.0);
+    outColor = vec4(fragColor * draw.tint.rgb, OPACITY);
 }
\ No newline at end of file
@@ -1,21 +1,31 @@
 #version 450
 
-layout(location = 0) out vec3 fragColor;
+layout(location = 0) in vec2 inPosition; // filled from the vertex buffer, see Vertex::getAttributeDescriptions()
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec4 instanceTransform; // per instance: xy offset, z scale, w rotation in radians
+layout(location = 3) in vec3 instanceColor;
 
-vec2 positions[3] = vec2[](
-    vec2(0.0,-0.5),
-    vec2(0.5,0.5),
-    vec2(-0.5,0.5)
-);
+// Set per pipeline variant, see ShaderFeatureBits in PipelineVariants.h. The disabled branches are compiled out.
+layout(constant_id = 0) const uint SHADER_FEATURES = 3;
+const uint FEATURE_ROTATION = 1;
+const uint FEATURE_VERTEX_COLORS = 2;
 
-vec3 colors[3] = vec3[](
-    vec3(1.0,0.0,0.0),
-    vec3(0.0,1.0,0.0),
-    vec3(0.0,0.0,1.0)
-);
+layout(set = 0, binding = 0) uniform FrameUniforms { // written once per frame into the uniform ring, see FrameUniforms in main.cpp
+    vec2 viewOffset; // world position in the center of the screen
+    float viewScale;
+    float time;
+} frame;
 
+layout(location = 0) out vec3 fragColor;
 
 void main(){//invoked for every vertex
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
+    vec2 position = inPosition;
+    if ((SHADER_FEATURES & FEATURE_ROTATION) != 0) {
+        float s = sin(instanceTransform.w);
+        float c = cos(instanceTransform.w);
+        position = vec2(c * inPosition.x - s * inPosition.y, s * inPosition.x + c * inPosition.y);
+    }
+    vec2 world = position * instanceTransform.z + instanceTransform.xy;
+    gl_Position = vec4((world - frame.viewOffset) * frame.viewScale, 0.0, 1.0);
+    fragColor = (SHADER_FEATURES & FEATURE_VERTEX_COLORS) != 0 ? inColor * instanceColor : instanceColor;
 }
\ No newline at end of file